@@ -1,261 +1,888 @@
 #include "audio.h"
 #include "common.h"
+#include "eq.h"
+#include "gain.h"
+#include "latency.h"
+#include "loudness.h"
+#include "opus_stream.h"
+#include "playout.h"
+#include "prebuffer.h"
+#include "settings.h"
+#include "spsc_ring.h"
 #include <malloc.h>
 #include <stdio.h>
 #include <string.h>
 
-#define SAMPLE_RATE 48000
+#define DEFAULT_SAMPLE_RATE 48000
 #define CHANNELS 2
 #define BYTES_PER_SAMPLE 2 // int16
 
-#define NDSP_NUM_BUFFERS 4
-#define NDSP_SAMPLES_PER_BUF 960 // 48000 * 0.02
-#define NDSP_BUF_SIZE_BYTES (NDSP_SAMPLES_PER_BUF * CHANNELS * BYTES_PER_SAMPLE)
+// wavebuf size is picked at audio_init, queue depth adapts at runtime
+#define NDSP_MAX_BUFFERS 8
+#define NDSP_BUF_MS 20
+#define NDSP_BUF_MS_LOW 10
+#define NDSP_DEPTH 4                 // default mode: 4 x 20ms
+#define NDSP_DEPTH_MIN 3
+#define NDSP_DEPTH_LOW 3 // low latency mode: 3 x 10ms
+#define NDSP_DEPTH_LOW_MIN 2
 
-#define RB_SIZE (192 * 1024)
+// feeder poll interval while waiting for the start cushion
+#define PRIME_POLL_NS (10 * 1000 * 1000)
+
+// shrink the queue by one after this long without an underrun
+#define DEPTH_STABLE_MS 30000
+
+#define RB_SIZE (256 * 1024) // must be a power of two for the spsc ring
+
+// zero-copy mode: the decoder writes straight into a pool of linear memory
+// wavebuf slots, the feeder only flushes and queues them.
+#define SLOT_COUNT 96       // upper bound, ~1s of audio is actually used
+#define SLOT_QUEUE_SIZE 128 // power of two >= SLOT_COUNT
 
 // NDSP
-static ndspWaveBuf s_waveBufs[NDSP_NUM_BUFFERS];
+static ndspWaveBuf s_waveBufs[NDSP_MAX_BUFFERS];
 static int16_t *s_ndspMem = NULL; // linear memory for wavebufs
 static LightEvent s_event;
 
-// Ring Buffer
-static uint8_t *s_rbMem              = NULL;
-static size_t s_rbReadPos            = 0;
-static size_t s_rbWritePos           = 0;
-static volatile size_t s_rbAvailable = 0; // thread-safe track
-static LightLock s_rbLock;
+// completion tracking. the feeder queues every submitted wavebuf index in
+// s_submitQ, ndsp_cb moves finished ones to s_doneQ in playback order.
+static SpscRing s_submitQ; // feeder -> ndsp_cb
+static SpscRing s_doneQ;   // ndsp_cb -> feeder
+
+// feeder-owned state
+static uint8_t s_freeBufs[NDSP_MAX_BUFFERS]; // ring mode, refill order
+static int s_freeHead  = 0;
+static int s_freeCount = 0;
+static int s_inFlight  = 0;
+
+// buffer geometry and adaptive queue depth
+static int s_sampleRate      = DEFAULT_SAMPLE_RATE;
+static bool s_lowLatency     = false;
+static uint32_t s_bufSamples = 0;
+static size_t s_bufBytes     = 0;
+static int s_slotCount       = 0;
+static int s_depth           = NDSP_DEPTH;
+static int s_depthMin        = NDSP_DEPTH_MIN;
+static bool s_started        = false; // first buffer went out
+static bool s_primed         = false; // start or refill cushion reached
+static bool s_dry            = false; // currently underrunning
+static u64 s_stableSinceMs   = 0;
+
+// set by the feeder when it has room but no data, so the decoder only
+// wakes it when it is actually starved
+static bool s_feederStarved = false;
+
+// set by audio_flush(), the feeder drops decoded audio not yet queued
+static bool s_flush  = false;
+static bool s_paused = false;
+
+// bumped by audio_flush(), the decoder drops its partly filled slot
+static uint32_t s_flushSeq = 0;
+
+// Ring Buffer (decoder -> feeder, lock-free)
+static SpscRing s_pcmRing;
+
+// Slot pool (zero-copy mode)
+static ndspWaveBuf s_slots[SLOT_COUNT];
+static int16_t *s_slotMem = NULL;
+static SpscRing s_slotFree;  // feeder -> decoder, slot indices
+static SpscRing s_slotReady; // decoder -> feeder, slot indices
+
+static bool s_zeroCopy = false;
+
+// decoder sleeps on this until the feeder has freed at least s_wakeSpace
+// (bytes in ring mode, slots in zero-copy mode)
+static LightEvent s_spaceEvent;
+static bool s_decoderWaiting   = false;
+static size_t s_wakeSpace      = 0;
+static int s_decodeWatermarkMs = 40;
 
 #define DECODE_CHUNK_SAMPLES 1024
+#define DECODE_CHUNK_BYTES (DECODE_CHUNK_SAMPLES * CHANNELS * BYTES_PER_SAMPLE)
+
+// concealment near the pcm ring's wrap point or a slot's end goes through
+// here
+static int16_t s_bounce[DECODE_CHUNK_SAMPLES * CHANNELS];
+
+// packet loss concealment. when the stream stalls and less than this much
+// decoded audio is left, opus synthesizes frames until data comes back.
+#define CONCEAL_LOW_MS 40
+static int s_concealMaxMs = 1000; // per stall, 0 disables concealment
+
+// decode result for a chunk the latency controller dropped
+#define DECODE_SKIPPED -100
+static float s_speed = 1.0f; // output rate factor, see update_latency()
+
+// telemetry, every field has a single writer thread
+static AudioStats s_stats;
+
+// log per-block kernel cost once at startup
+static bool s_benchmark = false;
+
+// pipeline cost in cpu ticks, reported per second of audio
+#define PROFILE_INTERVAL_SECONDS 10
+static volatile u64 s_feedTicks = 0; // only written by the feeder
+
+void audio_register_settings(void) {
+    settings_register_bool("audio_zero_copy", &s_zeroCopy);
+    settings_register_int("audio_decode_watermark_ms", &s_decodeWatermarkMs);
+    settings_register_bool("audio_low_latency", &s_lowLatency);
+    settings_register_int("audio_decode_rate", &s_sampleRate);
+    settings_register_int("audio_conceal_max_ms", &s_concealMaxMs);
+    settings_register_bool("audio_benchmark", &s_benchmark);
+    gain_register_settings();
+    eq_register_settings();
+    loudness_register_settings();
+    prebuffer_register_settings();
+}
 
-// returns bytes written
-static size_t rb_write(const void *data, size_t size) {
-    LightLock_Lock(&s_rbLock);
+int audio_get_sample_rate(void) {
+    // 24000 or 16000 trade treble for a much cheaper decode on old 3ds
+    return opus_stream_rate_valid(s_sampleRate) ? s_sampleRate
+                                                : DEFAULT_SAMPLE_RATE;
+}
 
-    size_t space = RB_SIZE - s_rbAvailable;
-    if (size > space)
-        size = space;
+static ndspWaveBuf *wavebuf(uint8_t idx) {
+    return s_zeroCopy ? &s_slots[idx] : &s_waveBufs[idx];
+}
 
-    if (size == 0) {
-        LightLock_Unlock(&s_rbLock);
-        return 0;
-    }
+// runs on the ndsp thread once per audio frame
+static void ndsp_cb(void *u) {
+    (void) u;
 
-    size_t end = s_rbWritePos + size;
-    if (end > RB_SIZE) {
-        size_t first_part = RB_SIZE - s_rbWritePos;
-        memcpy(s_rbMem + s_rbWritePos, data, first_part);
-        memcpy(s_rbMem, (const uint8_t *) data + first_part, size - first_part);
-        s_rbWritePos = size - first_part;
-    } else {
-        memcpy(s_rbMem + s_rbWritePos, data, size);
-        s_rbWritePos += size;
-        if (s_rbWritePos == RB_SIZE)
-            s_rbWritePos = 0;
+    // buffers finish in the order they were queued, so only the oldest
+    // one needs checking
+    bool done = false;
+    SpscSpan span;
+    while (spsc_ring_read_reserve(&s_submitQ, 1, &span) == 1) {
+        uint8_t idx = *span.ptr[0];
+        if (wavebuf(idx)->status != NDSP_WBUF_DONE)
+            break;
+
+        spsc_ring_read_commit(&s_submitQ, 1);
+        spsc_ring_write(&s_doneQ, &idx, 1);
+        done = true;
     }
 
-    s_rbAvailable += size;
-
-    LightLock_Unlock(&s_rbLock);
-
-    // signal audio thread that data is available
-    LightEvent_Signal(&s_event);
-
-    return size;
+    if (done)
+        LightEvent_Signal(&s_event);
 }
 
-// returns bytes read
-static size_t rb_read(void *dest, size_t size) {
-    LightLock_Lock(&s_rbLock);
+static bool slots_init(void) {
+    s_slotCount = s_sampleRate / s_bufSamples;
+    if (s_slotCount > SLOT_COUNT)
+        s_slotCount = SLOT_COUNT;
 
-    if (size > s_rbAvailable)
-        size = s_rbAvailable;
+    size_t slotTotalSize = s_slotCount * s_bufBytes;
+    s_slotMem            = linearAlloc(slotTotalSize);
+    if (!s_slotMem)
+        return false;
+    memset(s_slotMem, 0, slotTotalSize);
 
-    if (size == 0) {
-        LightLock_Unlock(&s_rbLock);
-        return 0;
+    if (!spsc_ring_init(&s_slotFree, SLOT_QUEUE_SIZE) ||
+        !spsc_ring_init(&s_slotReady, SLOT_QUEUE_SIZE)) {
+        spsc_ring_free(&s_slotFree);
+        linearFree(s_slotMem);
+        s_slotMem = NULL;
+        return false;
     }
 
-    size_t end = s_rbReadPos + size;
-    if (end > RB_SIZE) {
-        size_t first_part = RB_SIZE - s_rbReadPos;
-        memcpy(dest, s_rbMem + s_rbReadPos, first_part);
-        memcpy((uint8_t *) dest + first_part, s_rbMem, size - first_part);
-        s_rbReadPos = size - first_part;
-    } else {
-        memcpy(dest, s_rbMem + s_rbReadPos, size);
-        s_rbReadPos += size;
-        if (s_rbReadPos == RB_SIZE)
-            s_rbReadPos = 0;
+    memset(s_slots, 0, sizeof(s_slots));
+    for (uint8_t i = 0; i < s_slotCount; i++) {
+        size_t offset         = i * s_bufBytes;
+        s_slots[i].data_vaddr = (void *) ((uint8_t *) s_slotMem + offset);
+        s_slots[i].nsamples   = s_bufSamples;
+        s_slots[i].status     = NDSP_WBUF_DONE;
+        spsc_ring_write(&s_slotFree, &i, 1);
     }
 
-    s_rbAvailable -= size;
-
-    LightLock_Unlock(&s_rbLock);
-    return size;
-}
-
-static size_t rb_get_available(void) {
-    LightLock_Lock(&s_rbLock);
-    size_t avail = s_rbAvailable;
-    LightLock_Unlock(&s_rbLock);
-    return avail;
+    return true;
 }
 
-static size_t rb_get_space(void) {
-    LightLock_Lock(&s_rbLock);
-    size_t space = RB_SIZE - s_rbAvailable;
-    LightLock_Unlock(&s_rbLock);
-    return space;
+static void slots_free(void) {
+    spsc_ring_free(&s_slotFree);
+    spsc_ring_free(&s_slotReady);
+    if (s_slotMem) {
+        linearFree(s_slotMem);
+        s_slotMem = NULL;
+    }
 }
 
-static void ndsp_cb(void *u) {
-    (void) u;
-    LightEvent_Signal(&s_event);
+static void buffers_free(void) {
+    if (s_ndspMem) {
+        linearFree(s_ndspMem);
+        s_ndspMem = NULL;
+    }
+    spsc_ring_free(&s_pcmRing);
+    spsc_ring_free(&s_submitQ);
+    spsc_ring_free(&s_doneQ);
+    slots_free();
 }
 
 bool audio_init(void) {
-    // rb init
-    s_rbMem = malloc(RB_SIZE);
-    if (!s_rbMem)
-        return false;
-    memset(s_rbMem, 0, RB_SIZE);
-    s_rbReadPos   = 0;
-    s_rbWritePos  = 0;
-    s_rbAvailable = 0;
-    LightLock_Init(&s_rbLock);
-
-    // ndsp mem init
-    size_t ndspTotalSize = NDSP_NUM_BUFFERS * NDSP_BUF_SIZE_BYTES;
-    s_ndspMem            = linearAlloc(ndspTotalSize);
-    if (!s_ndspMem) {
-        free(s_rbMem);
-        s_rbMem = NULL;
+    if (!spsc_ring_init(&s_submitQ, SLOT_QUEUE_SIZE) ||
+        !spsc_ring_init(&s_doneQ, SLOT_QUEUE_SIZE)) {
+        buffers_free();
         return false;
     }
-    // clear audio memory
-    memset(s_ndspMem, 0, ndspTotalSize);
+
+    s_freeHead  = 0;
+    s_freeCount = 0;
+    s_inFlight  = 0;
+
+    // pick buffer geometry for the mode
+    s_sampleRate = audio_get_sample_rate();
+    s_bufSamples =
+        s_sampleRate / 1000 * (s_lowLatency ? NDSP_BUF_MS_LOW : NDSP_BUF_MS);
+    s_bufBytes      = s_bufSamples * CHANNELS * BYTES_PER_SAMPLE;
+    s_depth         = s_lowLatency ? NDSP_DEPTH_LOW : NDSP_DEPTH;
+    s_depthMin      = s_lowLatency ? NDSP_DEPTH_LOW_MIN : NDSP_DEPTH_MIN;
+    s_started       = false;
+    s_primed        = false;
+    s_speed         = 1.0f;
+    s_dry           = false;
+    s_stableSinceMs = osGetTime();
+    playout_reset(s_sampleRate);
+    gain_init(s_sampleRate);
+    eq_init(s_sampleRate);
+    loudness_init(s_sampleRate);
+
+    if (s_zeroCopy) {
+        if (!slots_init()) {
+            buffers_free();
+            return false;
+        }
+    } else {
+        // rb init
+        if (!spsc_ring_init(&s_pcmRing, RB_SIZE)) {
+            buffers_free();
+            return false;
+        }
+
+        // ndsp mem init
+        size_t ndspTotalSize = NDSP_MAX_BUFFERS * s_bufBytes;
+        s_ndspMem            = linearAlloc(ndspTotalSize);
+        if (!s_ndspMem) {
+            buffers_free();
+            return false;
+        }
+        // clear audio memory
+        memset(s_ndspMem, 0, ndspTotalSize);
+
+        // setup wavebufs
+        memset(s_waveBufs, 0, sizeof(s_waveBufs));
+        for (int i = 0; i < NDSP_MAX_BUFFERS; i++) {
+            // calculate offset carefully
+            size_t offset = i * s_bufBytes;
+            s_waveBufs[i].data_vaddr =
+                (void *) ((uint8_t *) s_ndspMem + offset);
+            s_waveBufs[i].nsamples = s_bufSamples;
+            s_waveBufs[i].status   = NDSP_WBUF_DONE;
+
+            s_freeBufs[s_freeCount++] = i;
+        }
+    }
 
     // ndsp init
     if (R_FAILED(ndspInit())) {
-        linearFree(s_ndspMem);
-        free(s_rbMem);
-        s_rbMem = NULL;
+        buffers_free();
         return false;
     }
 
     ndspChnReset(0);
     ndspSetOutputMode(NDSP_OUTPUT_STEREO);
     ndspChnSetFormat(0, NDSP_FORMAT_STEREO_PCM16);
-    ndspChnSetRate(0, SAMPLE_RATE);
-
-    // setup wavebufs
-    memset(s_waveBufs, 0, sizeof(s_waveBufs));
-    for (int i = 0; i < NDSP_NUM_BUFFERS; i++) {
-        // calculate offset carefully
-        size_t offset            = i * NDSP_BUF_SIZE_BYTES;
-        s_waveBufs[i].data_vaddr = (void *) ((uint8_t *) s_ndspMem + offset);
-        s_waveBufs[i].nsamples   = NDSP_SAMPLES_PER_BUF;
-        s_waveBufs[i].status     = NDSP_WBUF_DONE;
-    }
+    ndspChnSetRate(0, s_sampleRate); // matches the opus decode rate
 
     LightEvent_Init(&s_event, RESET_ONESHOT);
+    LightEvent_Init(&s_spaceEvent, RESET_ONESHOT);
     ndspSetCallback(ndsp_cb, NULL);
 
+    // low watermark, never less than one decode chunk and never more than
+    // half the cushion so the decoder still runs ahead of playback
+    if (s_zeroCopy) {
+        size_t bufMs = s_bufSamples / (s_sampleRate / 1000);
+        size_t slots = (s_decodeWatermarkMs + bufMs - 1) / bufMs;
+        if (slots < 1)
+            slots = 1;
+        if (slots > (size_t) s_slotCount / 2)
+            slots = s_slotCount / 2;
+        s_wakeSpace = slots;
+    } else {
+        size_t bytes = (size_t) s_decodeWatermarkMs * (s_sampleRate / 1000) *
+                       CHANNELS * BYTES_PER_SAMPLE;
+        if (bytes < DECODE_CHUNK_BYTES)
+            bytes = DECODE_CHUNK_BYTES;
+        if (bytes > RB_SIZE / 2)
+            bytes = RB_SIZE / 2;
+        s_wakeSpace = bytes;
+    }
+
+    bool isNew3ds = false;
+    APT_CheckNew3DS(&isNew3ds);
+    log_debug("audio: %s pipeline, %s latency, %lu samples/buf, depth %d "
+              "(%d-%d), %s",
+              s_zeroCopy ? "zero-copy" : "ring",
+              s_lowLatency ? "low" : "normal", (unsigned long) s_bufSamples,
+              s_depth, s_depthMin, NDSP_MAX_BUFFERS,
+              isNew3ds ? "new3ds" : "old3ds");
+
+    if (s_benchmark) {
+        gain_benchmark(s_bufSamples);
+        eq_benchmark(DECODE_CHUNK_SAMPLES);
+    }
+
     return true;
 }
 
 void audio_exit(void) {
     ndspExit();
+    buffers_free();
+}
 
-    if (s_ndspMem) {
-        linearFree(s_ndspMem);
-        s_ndspMem = NULL;
+void audio_signal_exit(void) {
+    LightEvent_Signal(&s_event);
+    LightEvent_Signal(&s_spaceEvent);
+}
+
+void audio_set_paused(bool paused) {
+    s_paused = paused;
+    ndspChnSetPaused(0, paused);
+}
+
+bool audio_is_paused(void) {
+    return s_paused;
+}
+
+void audio_flush(void) {
+    latency_flush();
+    __atomic_add_fetch(&s_flushSeq, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&s_flush, true, __ATOMIC_SEQ_CST);
+    LightEvent_Signal(&s_event);
+}
+
+static size_t decoder_space(void) {
+    return s_zeroCopy ? spsc_ring_available(&s_slotFree)
+                      : spsc_ring_space(&s_pcmRing);
+}
+
+// decoder side. the flag store and the space load are ordered against the
+// feeder's commit and flag load, so one of the two always sees the other.
+static void decoder_wait_space(void) {
+    __atomic_store_n(&s_decoderWaiting, true, __ATOMIC_SEQ_CST);
+
+    // the feeder may have drained before it saw the flag
+    if (decoder_space() >= s_wakeSpace) {
+        __atomic_store_n(&s_decoderWaiting, false, __ATOMIC_SEQ_CST);
+        return;
     }
-    if (s_rbMem) {
-        free(s_rbMem);
-        s_rbMem = NULL;
+
+    LightEvent_Wait(&s_spaceEvent);
+}
+
+// feeder side, called after consuming from the ring or recycling slots
+static void wake_decoder(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&s_decoderWaiting, __ATOMIC_SEQ_CST))
+        return;
+
+    if (decoder_space() >= s_wakeSpace) {
+        __atomic_store_n(&s_decoderWaiting, false, __ATOMIC_SEQ_CST);
+        LightEvent_Signal(&s_spaceEvent);
     }
 }
 
-void audio_signal_exit(void) {
-    LightEvent_Signal(&s_event);
+// decoded audio the feeder has not picked up yet
+static int decoder_buffered_ms(void) {
+    size_t frames = s_zeroCopy ? spsc_ring_available(&s_slotReady) *
+                                     s_bufSamples
+                               : spsc_ring_available(&s_pcmRing) /
+                                     (CHANNELS * BYTES_PER_SAMPLE);
+    return frames / (s_sampleRate / 1000);
+}
+
+static bool feeder_data_ready(void) {
+    return s_zeroCopy ? spsc_ring_available(&s_slotReady) > 0
+                      : spsc_ring_available(&s_pcmRing) >= s_bufBytes;
+}
+
+// decoder side, called after publishing data
+static void wake_feeder(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&s_feederStarved, __ATOMIC_SEQ_CST))
+        return;
+
+    if (feeder_data_ready()) {
+        __atomic_store_n(&s_feederStarved, false, __ATOMIC_SEQ_CST);
+        LightEvent_Signal(&s_event);
+    }
+}
+
+static void profile_report(u64 *decodeTicks, u64 *lastFeedTicks,
+                           u64 *samples) {
+    if (*samples < (u64) s_sampleRate * PROFILE_INTERVAL_SECONDS)
+        return;
+
+    u64 feedTicks = s_feedTicks;
+    u64 seconds   = *samples / s_sampleRate;
+
+    log_debug("audio: decode %llu cyc/s, feed %llu cyc/s (%s, %d Hz)",
+              *decodeTicks / seconds, (feedTicks - *lastFeedTicks) / seconds,
+              s_zeroCopy ? "zero-copy" : "ring", s_sampleRate);
+
+    *decodeTicks   = 0;
+    *lastFeedTicks = feedTicks;
+    *samples       = 0;
+}
+
+static int decode(OpusStream *os, int16_t *dst, int frames, bool conceal) {
+    return conceal ? opus_stream_conceal(os, dst, frames)
+                   : opus_stream_read(os, dst, frames);
+}
+
+// ring mode: decode into the pcm ring, feeder copies into wavebufs
+static int decode_ring(OpusStream *os, bool conceal) {
+    // check space
+    SpscSpan span;
+    size_t space =
+        spsc_ring_write_reserve(&s_pcmRing, DECODE_CHUNK_BYTES, &span);
+
+    if (space < DECODE_CHUNK_BYTES)
+        return 0;
+
+    // decode straight into the ring. only the first segment is
+    // contiguous, so near the wrap point we get a shorter read.
+    int16_t *dst = (int16_t *) span.ptr[0];
+    int frames   = span.len[0] / (CHANNELS * BYTES_PER_SAMPLE);
+    if (conceal) {
+        // one wavebuf at a time. plc only makes whole 2.5ms quanta, so a
+        // short first segment would stall it at the wrap point for good:
+        // conceal into the bounce buffer and split it over both segments
+        int want = s_bufSamples < DECODE_CHUNK_SAMPLES ? s_bufSamples
+                                                       : DECODE_CHUNK_SAMPLES;
+        if (frames < want)
+            dst = s_bounce;
+        frames = want;
+    }
+    int samples = decode(os, dst, frames, conceal);
+    if (samples <= 0)
+        return samples;
+    if (!conceal && latency_skip(dst, samples))
+        return DECODE_SKIPPED;
+
+    loudness_feed(dst, samples);
+    eq_process(dst, samples);
+    gain_apply(dst, samples);
+
+    if (dst == s_bounce) {
+        size_t bytes = samples * CHANNELS * BYTES_PER_SAMPLE;
+        size_t first = bytes < span.len[0] ? bytes : span.len[0];
+        memcpy(span.ptr[0], s_bounce, first);
+        memcpy(span.ptr[1], (uint8_t *) s_bounce + first, bytes - first);
+    }
+
+    // publish to feeder, counted first so a flush never drops more than
+    // the playout clock has seen
+    playout_decoded(samples);
+    spsc_ring_write_commit(&s_pcmRing, samples * CHANNELS * BYTES_PER_SAMPLE);
+    return samples;
+}
+
+// zero-copy mode: decode into the current slot, hand it over once full
+static int decode_slot(OpusStream *os, int *slot, uint32_t *fill,
+                       bool conceal) {
+    if (*slot < 0) {
+        uint8_t idx;
+        if (spsc_ring_read(&s_slotFree, &idx, 1) == 0)
+            return 0;
+        *slot = idx;
+        *fill = 0;
+    }
+
+    int16_t *dst = s_slots[*slot].data_pcm16 + *fill * CHANNELS;
+    int left     = s_bufSamples - *fill;
+    int samples;
+    if (conceal && left < s_sampleRate / 400) {
+        // plc only makes whole 2.5ms quanta and would stall on a shorter
+        // rest of the slot: conceal one into the bounce buffer, keep what
+        // fits
+        samples = decode(os, s_bounce, s_sampleRate / 400, conceal);
+        if (samples > left)
+            samples = left;
+        if (samples > 0)
+            memcpy(dst, s_bounce, samples * CHANNELS * BYTES_PER_SAMPLE);
+    } else {
+        samples = decode(os, dst, left, conceal);
+    }
+    if (samples <= 0)
+        return samples;
+    if (!conceal && latency_skip(dst, samples))
+        return DECODE_SKIPPED; // the slot is filled over
+
+    loudness_feed(dst, samples);
+    eq_process(dst, samples);
+    gain_apply(dst, samples);
+
+    *fill += samples;
+    playout_decoded(samples);
+    if (*fill == s_bufSamples) {
+        uint8_t idx = (uint8_t) *slot;
+        spsc_ring_write(&s_slotReady, &idx, 1);
+        *slot = -1;
+    }
+    return samples;
+}
+
+// decoder side, follow the latency controller's catch-up state
+static void update_latency(OpusStream *os, int samples) {
+    latency_update(os, samples, playout_latency_ms());
+
+    // catch up with live, or let the start-up cushion grow. both are opt-in
+    // since they shift the pitch, by default the rate never changes.
+    float speed = 1.0f;
+    if (latency_speeding_up())
+        speed = LATENCY_SPEEDUP;
+    else if (prebuffer_growing(latency_behind_ms()))
+        speed = PREBUFFER_SLOWDOWN;
+
+    if (speed != s_speed) {
+        s_speed = speed;
+        ndspChnSetRate(0, s_sampleRate * speed);
+    }
 }
 
 // decoder thread
 void audio_decoder_thread(void *arg) {
-    OggOpusFile *of = (OggOpusFile *) arg;
-    if (!of)
+    AudioSource *src = (AudioSource *) arg;
+    if (!src)
         return;
 
-    int16_t tempBuf[DECODE_CHUNK_SAMPLES * CHANNELS];
+    // headers come over the network, the ui keeps running meanwhile
+    OpusStream *os = src->os;
+    if (!opus_stream_open(os, src->read, src->user, s_sampleRate))
+        return;
+    prebuffer_note_open();
+
+    int slot          = -1; // slot being filled (zero-copy mode)
+    uint32_t fill     = 0;
+    uint32_t flushSeq = __atomic_load_n(&s_flushSeq, __ATOMIC_SEQ_CST);
+
+    u64 decodeTicks = 0, lastFeedTicks = 0, profSamples = 0;
+
+    bool conceal  = false;
+    int concealed = 0; // frames synthesized in the current stall
+    u64 stalledAt = 0; // first failed read of the current stall, 0 if none
 
     while (!s_quit) {
-        // check space
-        size_t space = rb_get_space();
+        // a flush also drops the pre-seek audio in the slot being filled
+        uint32_t seq = __atomic_load_n(&s_flushSeq, __ATOMIC_SEQ_CST);
+        if (seq != flushSeq) {
+            flushSeq = seq;
+            if (slot >= 0) {
+                playout_discard(fill);
+                fill = 0;
+            }
+        }
 
-        if (space < sizeof(tempBuf)) {
-            svcSleepThread(10 * 1000 * 1000); // 10ms
+        // sleep until the feeder makes room for a chunk
+        bool full = s_zeroCopy
+                        ? (slot < 0 && spsc_ring_available(&s_slotFree) == 0)
+                        : spsc_ring_space(&s_pcmRing) < DECODE_CHUNK_BYTES;
+        if (full) {
+            decoder_wait_space();
             continue;
         }
 
-        // decode
-        int samples = op_read_stereo(of, tempBuf, DECODE_CHUNK_SAMPLES);
+        u64 start = svcGetSystemTick();
+        int samples = s_zeroCopy ? decode_slot(os, &slot, &fill, conceal)
+                                 : decode_ring(os, conceal);
+
+        if (conceal) {
+            // keep synthesizing until the cushion is back, then go back to
+            // waiting for real data
+            if (samples > 0) {
+                concealed += samples;
+                s_stats.concealedFrames += samples;
+                wake_feeder();
+            }
+            conceal = samples > 0 && decoder_buffered_ms() < CONCEAL_LOW_MS &&
+                      concealed < s_concealMaxMs * (s_sampleRate / 1000);
+            continue;
+        }
+
+        if (samples == DECODE_SKIPPED) {
+            update_latency(os, 0);
+            continue;
+        }
+
+        // one stall per run of failed reads, however often the stream
+        // queue times out during it
+        if (samples <= 0 && stalledAt == 0) {
+            s_stats.decoderStalls++;
+            stalledAt = osGetTime();
+        }
+
+        if (samples == OPUS_STREAM_STALLED) {
+            // the stream queue timed out, cover the gap before the feeder
+            // runs dry. past the limit the feeder underruns as usual.
+            conceal = decoder_buffered_ms() < CONCEAL_LOW_MS &&
+                      concealed < s_concealMaxMs * (s_sampleRate / 1000);
+            continue;
+        }
+
+        if (samples == OPUS_STREAM_HOLE)
+            continue; // lost data in the stream, just keep reading
 
         if (samples < 0) {
-            svcSleepThread(100 * 1000 * 1000); // 100ms
+            svcSleepThread(100 * 1000 * 1000); // 100ms backoff on hard errors
             continue;
         }
 
         if (samples == 0) {
-            svcSleepThread(10 * 1000 * 1000);
+            // end of stream, only happens on quit
+            LightEvent_Wait(&s_spaceEvent);
             continue;
         }
 
-        // write to rb
-        rb_write(tempBuf, samples * CHANNELS * BYTES_PER_SAMPLE);
+        if (stalledAt != 0) {
+            s_stats.stalledMs += osGetTime() - stalledAt;
+            stalledAt = 0;
+        }
+
+        if (concealed > 0) {
+            log_debug("audio: concealed %d ms of stalled stream",
+                      concealed / (s_sampleRate / 1000));
+            concealed = 0;
+        }
+
+        decodeTicks += svcGetSystemTick() - start;
+        profSamples += samples;
+        profile_report(&decodeTicks, &lastFeedTicks, &profSamples);
+        update_latency(os, samples);
+
+        // only wakes the feeder if it ran dry
+        wake_feeder();
+    }
+}
+
+static void submit(uint8_t idx) {
+    ndspWaveBuf *buf = wavebuf(idx);
+
+    DSP_FlushDataCache(buf->data_pcm16, s_bufBytes);
+    buf->nsamples = s_bufSamples;
+    ndspChnWaveBufAdd(0, buf);
+    playout_submit(buf);
+
+    // status is queued now, safe to hand to ndsp_cb
+    spsc_ring_write(&s_submitQ, &idx, 1);
+    s_inFlight++;
+    s_started = true;
+    s_dry     = false;
+}
+
+// grow the queue after an underrun, shrink it again once playback has been
+// stable for a while
+static void adapt_depth(bool starved) {
+    u64 now = osGetTime();
+
+    if (starved && s_started && s_inFlight == 0 && !s_dry) {
+        // every queued buffer played out, this was audible. hold playback
+        // back until the cushion is refilled instead of trickling on.
+        // counted once per episode, submit() clears s_dry again.
+        s_dry           = true;
+        s_primed        = false;
+        s_stableSinceMs = now;
+        s_stats.underruns++;
+        if (s_depth < NDSP_MAX_BUFFERS) {
+            s_depth++;
+            log_debug("audio: underrun, depth %d -> %d (%lu ms queued)",
+                      s_depth - 1, s_depth,
+                      (unsigned long) (s_depth * s_bufSamples /
+                                       (s_sampleRate / 1000)));
+        }
+        return;
+    }
+
+    if (s_depth > s_depthMin && now - s_stableSinceMs > DEPTH_STABLE_MS) {
+        s_stableSinceMs = now; // restart the stable period
+        s_depth--;
+        log_debug("audio: stable, depth %d -> %d (%lu ms queued)",
+                  s_depth + 1, s_depth,
+                  (unsigned long) (s_depth * s_bufSamples /
+                                   (s_sampleRate / 1000)));
+    }
+}
+
+// take back buffers ndsp has finished with, oldest first
+static void collect_done(void) {
+    bool recycled = false;
+    uint8_t idx;
+
+    while (spsc_ring_read(&s_doneQ, &idx, 1) == 1) {
+        s_inFlight--;
+        if (s_zeroCopy) {
+            spsc_ring_write(&s_slotFree, &idx, 1);
+            recycled = true;
+        } else {
+            s_freeBufs[(s_freeHead + s_freeCount) % NDSP_MAX_BUFFERS] = idx;
+            s_freeCount++;
+        }
     }
+
+    if (recycled)
+        wake_decoder();
 }
 
-int16_t *g_audio_buffer             = NULL;
-uint32_t g_audio_buffer_num_samples = 0;
+// ring mode, refill free wavebufs in the order they finished, up to the
+// current depth. returns true if it ran out of data first.
+static bool refill_ring(void) {
+    while (s_freeCount > 0 && s_inFlight < s_depth) {
+        if (spsc_ring_available(&s_pcmRing) < s_bufBytes) {
+            return true;
+        }
+
+        uint8_t idx = s_freeBufs[s_freeHead];
+        s_freeHead  = (s_freeHead + 1) % NDSP_MAX_BUFFERS;
+        s_freeCount--;
+
+        spsc_ring_read(&s_pcmRing, s_waveBufs[idx].data_pcm16, s_bufBytes);
+        wake_decoder();
+        submit(idx);
+    }
+    return false;
+}
+
+// zero-copy mode, keep up to the current depth of slots in flight (same
+// latency as ring mode). returns true if starved.
+static bool refill_slots(void) {
+    while (s_inFlight < s_depth) {
+        uint8_t idx;
+        if (spsc_ring_read(&s_slotReady, &idx, 1) == 0) {
+            return true;
+        }
+        submit(idx);
+    }
+    return false;
+}
+
+// feeder side, throw away decoded audio after a seek so the new position
+// is heard right away. what ndsp already has queued still plays out.
+static void drop_pending(void) {
+    uint32_t frames = 0;
+    if (s_zeroCopy) {
+        uint8_t idx;
+        while (spsc_ring_read(&s_slotReady, &idx, 1) == 1) {
+            spsc_ring_write(&s_slotFree, &idx, 1);
+            frames += s_bufSamples;
+        }
+    } else {
+        SpscSpan span;
+        size_t n = spsc_ring_read_reserve(&s_pcmRing, RB_SIZE, &span);
+        spsc_ring_read_commit(&s_pcmRing, n);
+        frames = n / (CHANNELS * BYTES_PER_SAMPLE);
+    }
+    playout_discard(frames);
+    wake_decoder();
+}
+
+static void sample_fill_level(void) {
+    size_t fill, size;
+    if (s_zeroCopy) {
+        fill = spsc_ring_available(&s_slotReady);
+        size = s_slotCount;
+    } else {
+        fill = spsc_ring_available(&s_pcmRing);
+        size = RB_SIZE;
+    }
+
+    size_t bucket = fill * AUDIO_FILL_BUCKETS / size;
+    if (bucket >= AUDIO_FILL_BUCKETS)
+        bucket = AUDIO_FILL_BUCKETS - 1;
+    s_stats.fillHistogram[bucket]++;
+}
+
+void audio_get_stats(AudioStats *out) {
+    memcpy(out, &s_stats, sizeof(AudioStats));
+}
+
+void audio_log_stats(void) {
+    AudioStats st;
+    audio_get_stats(&st);
+
+    char hist[AUDIO_FILL_BUCKETS * 11 + 1];
+    int len = 0;
+    for (int i = 0; i < AUDIO_FILL_BUCKETS; i++)
+        len += snprintf(hist + len, sizeof(hist) - len, " %lu",
+                        (unsigned long) st.fillHistogram[i]);
+
+    log_debug("audio: underruns %lu, decoder stalls %lu (%lu ms), concealed "
+              "%lu ms, depth %d, latency %d ms, fill%s",
+              (unsigned long) st.underruns, (unsigned long) st.decoderStalls,
+              (unsigned long) st.stalledMs,
+              (unsigned long) (st.concealedFrames / (s_sampleRate / 1000)),
+              s_depth, playout_latency_ms(), hist);
+
+    LoudnessStats ls;
+    loudness_get_stats(&ls);
+    u64 seconds = ls.frames / s_sampleRate;
+    log_debug("audio: momentary %.1f LUFS, short-term %.1f LUFS, agc %+.1f "
+              "dB, limited %lu blocks, meter %llu cyc/s",
+              ls.momentary, ls.shortTerm, ls.autoGainDb,
+              (unsigned long) gain_limited_blocks(),
+              seconds ? ls.ticks / seconds : 0);
+}
+
+// feeder side, hold the first buffer back until the start cushion is
+// decoded or the decoder cannot buffer any more
+static bool primed(void) {
+    if (s_primed)
+        return true;
+
+    // the first start, or resuming after an underrun
+    int ms     = decoder_buffered_ms();
+    bool ready = s_started ? prebuffer_refilled(ms) : prebuffer_ready(ms);
+    if (!ready && decoder_space() >= s_wakeSpace)
+        return false;
+
+    s_primed = true;
+    if (s_started)
+        log_debug("audio: resuming with %d ms buffered", ms);
+    else
+        prebuffer_started(ms);
+    return true;
+}
 
 // feeder thread
 void audio_thread(void *arg) {
     (void) arg;
 
     while (!s_quit) {
-        bool bufferFree = false;
-        bool rbEmpty    = false;
-
-        // check all buffers
-        for (int i = 0; i < NDSP_NUM_BUFFERS; i++) {
-            if (s_waveBufs[i].status == NDSP_WBUF_DONE) {
-                bufferFree = true;
-
-                size_t avail = rb_get_available();
-                if (avail >= NDSP_BUF_SIZE_BYTES) {
-                    // fill and submit
-                    rb_read(s_waveBufs[i].data_pcm16, NDSP_BUF_SIZE_BYTES);
-
-                    g_audio_buffer             = s_waveBufs[i].data_pcm16;
-                    g_audio_buffer_num_samples = NDSP_SAMPLES_PER_BUF;
-
-                    DSP_FlushDataCache(s_waveBufs[i].data_pcm16,
-                                       NDSP_BUF_SIZE_BYTES);
-                    s_waveBufs[i].nsamples = NDSP_SAMPLES_PER_BUF;
-                    ndspChnWaveBufAdd(0, &s_waveBufs[i]);
-                } else {
-                    rbEmpty = true;
-                }
-            }
+        if (!primed()) {
+            LightEvent_WaitTimeout(&s_event, PRIME_POLL_NS);
+            continue;
         }
 
-        if (bufferFree && rbEmpty) {
-            LightEvent_WaitTimeout(&s_event, 100000000LL);
-        } else if (!bufferFree) {
-            // cannot fill because no free buffers. wait for playback
-            LightEvent_WaitTimeout(&s_event, 100000000LL);
+        u64 start = svcGetSystemTick();
+        if (__atomic_exchange_n(&s_flush, false, __ATOMIC_SEQ_CST))
+            drop_pending();
+        sample_fill_level();
+        collect_done();
+        bool starved = s_zeroCopy ? refill_slots() : refill_ring();
+        s_feedTicks += svcGetSystemTick() - start;
+
+        adapt_depth(starved);
+
+        if (starved) {
+            __atomic_store_n(&s_feederStarved, true, __ATOMIC_SEQ_CST);
+
+            // the decoder may have published before it saw the flag
+            if (feeder_data_ready()) {
+                __atomic_store_n(&s_feederStarved, false, __ATOMIC_SEQ_CST);
+                continue;
+            }
         }
+
+        // wakes on completed buffers, on the decoder if starved, or on quit
+        LightEvent_Wait(&s_event);
     }
 }
@@ -1,10 +1,34 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include "ogg.h"
+#include "opus_stream.h"
 #include <3ds.h>
-#include <opusfile.h>
 #include <stdbool.h>
 
+#define AUDIO_FILL_BUCKETS 8
+
+typedef struct {
+    uint32_t underruns;       // times everything queued played out, once each
+    uint32_t decoderStalls;   // runs of reads that returned an error or nothing
+    uint32_t stalledMs;       // time spent in those runs
+    uint32_t concealedFrames; // synthesized by opus plc during stream stalls
+    uint32_t fillHistogram[AUDIO_FILL_BUCKETS]; // pcm ring fill, in eighths
+} AudioStats;
+
+// what the decoder thread opens and plays
+typedef struct {
+    OggReadFunc read;
+    void *user;
+    OpusStream *os; // opened by the decoder thread, closed after joining it
+} AudioSource;
+
+// register audio settings, call before settings_load()
+void audio_register_settings(void);
+
+// output rate, opus decodes natively at this rate (low power below 48000)
+int audio_get_sample_rate(void);
+
 // initialize ndsp, allocate memory, setup buffers and events
 bool audio_init(void);
 
@@ -14,14 +38,25 @@ void audio_exit(void);
 // signal the audio thread to unblock (used during quit)
 void audio_signal_exit(void);
 
+// pause or resume output, decoding stops once the buffers are full
+void audio_set_paused(bool paused);
+bool audio_is_paused(void);
+
+// drop decoded audio not yet handed to ndsp, used after a seek
+void audio_flush(void);
+
 // audio decoding thread
 // audio feeding thread (NDSP)
 void audio_thread(void *arg);
 
-// audio decoding thread
+// audio decoding thread, arg is an AudioSource. opens the stream first,
+// which blocks until its headers arrive
 void audio_decoder_thread(void *arg);
 
-extern int16_t *g_audio_buffer;
-extern uint32_t g_audio_buffer_num_samples;
+// snapshot of the pipeline counters
+void audio_get_stats(AudioStats *out);
+
+// write the counters to the debug log
+void audio_log_stats(void);
 
 #endif
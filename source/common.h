@@ -17,6 +17,7 @@ extern volatile bool s_enable_metadata;
 #define THREAD_PRIO_STREAM 0x26   // below decoder, above main
 #define THREAD_PRIO_COVER 0x27    // just below stream, above main
 #define THREAD_PRIO_METADATA 0x28 // important for cover art
+#define THREAD_PRIO_RECORDER 0x29 // sd writes, above main
 #define THREAD_PRIO_CHAT 0x31     // lower than main
 
 #define RENDER_FPS_CAP 60
@@ -29,10 +30,14 @@ extern volatile bool s_enable_metadata;
 #define CHAT_STACK_SIZE (32 * 1024)
 #define METADATA_STACK_SIZE (32 * 1024)
 #define COVER_STACK_SIZE (32 * 1024)
+#define RECORDER_STACK_SIZE (16 * 1024)
 
 // timeouts and intervals
 #define SSL_HANDSHAKE_RETRY_DELAY_MS 10
+#define STREAM_STALL_TIMEOUT_MS 10                 // starved read gives up
 #define METADATA_REFRESH_INTERVAL_NS 10000000000LL // 10 seconds
 #define COVER_CHECK_INTERVAL_NS 2000000000LL       // 2 seconds
+#define STATS_LOG_INTERVAL_NS 30000000000LL        // 30 seconds
+#define SETTINGS_SAVE_DELAY_MS 2000                // after the last press
 
 #endif
@@ -0,0 +1,259 @@
+#include "eq.h"
+#include "settings.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __3DS__
+#include <3ds.h>
+#endif
+
+#define EQ_SHIFT 28
+#define EQ_ONE (1 << EQ_SHIFT)
+#define EQ_Q 0.9f // bandwidth of the peaking bands, and shelf slope
+#define EQ_PI 3.14159265f
+
+typedef enum { BAND_LOW_SHELF, BAND_PEAK, BAND_HIGH_SHELF } BandType;
+
+typedef struct {
+    int32_t b0, b1, b2, a1, a2; // Q28, a0 normalized to 1
+} Biquad;
+
+// a full set of coefficients, triple buffered. the main thread fills its
+// own bank and swaps it into the handover slot, the decoder swaps its bank
+// out of there between blocks. each bank has one owner at a time, so a
+// bank the decoder may still be running is never written.
+typedef struct {
+    Biquad band[EQ_BANDS];
+    int active[EQ_BANDS]; // indices of bands that are not flat
+    int count;
+} EqBank;
+
+typedef struct {
+    int32_t x1, x2, y1, y2;
+    int64_t err; // low bits dropped from the last output
+} BiquadState;
+
+static const BandType s_types[EQ_BANDS] = {
+    BAND_LOW_SHELF, BAND_PEAK, BAND_PEAK, BAND_PEAK, BAND_HIGH_SHELF};
+
+// settings, flat by default
+static bool s_enabled     = false;
+static int s_hz[EQ_BANDS] = {80, 250, 1000, 4000, 12000};
+static int s_db[EQ_BANDS] = {0, 0, 0, 0, 0};
+static int s_rate         = 48000;
+
+#define EQ_FRESH 4 // handover bank not taken by the decoder yet
+
+static EqBank s_banks[3];
+static int s_handover = 1; // bank index, plus EQ_FRESH
+static int s_back     = 2; // main thread's bank
+
+// decoder-owned
+static int s_bank = 0;
+static BiquadState s_state[EQ_BANDS][2];
+
+void eq_register_settings(void) {
+    static const char *hzKeys[EQ_BANDS] = {"eq_band1_hz", "eq_band2_hz",
+                                           "eq_band3_hz", "eq_band4_hz",
+                                           "eq_band5_hz"};
+    static const char *dbKeys[EQ_BANDS] = {"eq_band1_db", "eq_band2_db",
+                                           "eq_band3_db", "eq_band4_db",
+                                           "eq_band5_db"};
+
+    settings_register_bool("eq_enabled", &s_enabled);
+    for (int i = 0; i < EQ_BANDS; i++) {
+        settings_register_int(hzKeys[i], &s_hz[i]);
+        settings_register_int(dbKeys[i], &s_db[i]);
+    }
+}
+
+static int32_t to_fixed(float v) {
+    return (int32_t) lroundf(v * EQ_ONE);
+}
+
+// rbj audio eq cookbook
+static void design(Biquad *bq, BandType type, int hz, int db) {
+    float A     = powf(10.0f, db / 40.0f);
+    float w0    = 2.0f * EQ_PI * hz / s_rate;
+    float cw    = cosf(w0);
+    float alpha = sinf(w0) / (2.0f * EQ_Q);
+    float b0, b1, b2, a0, a1, a2;
+
+    if (type == BAND_PEAK) {
+        b0 = 1.0f + alpha * A;
+        b1 = -2.0f * cw;
+        b2 = 1.0f - alpha * A;
+        a0 = 1.0f + alpha / A;
+        a1 = -2.0f * cw;
+        a2 = 1.0f - alpha / A;
+    } else {
+        float sa = 2.0f * sqrtf(A) * alpha;
+        float s  = type == BAND_LOW_SHELF ? -1.0f : 1.0f;
+        b0       = A * ((A + 1) + s * (A - 1) * cw + sa);
+        b1       = -2.0f * s * A * ((A - 1) + s * (A + 1) * cw);
+        b2       = A * ((A + 1) + s * (A - 1) * cw - sa);
+        a0       = (A + 1) - s * (A - 1) * cw + sa;
+        a1       = 2.0f * s * ((A - 1) - s * (A + 1) * cw);
+        a2       = (A + 1) - s * (A - 1) * cw - sa;
+    }
+
+    bq->b0 = to_fixed(b0 / a0);
+    bq->b1 = to_fixed(b1 / a0);
+    bq->b2 = to_fixed(b2 / a0);
+    bq->a1 = to_fixed(a1 / a0);
+    bq->a2 = to_fixed(a2 / a0);
+}
+
+// recompute every band into our bank and hand it to the decoder. if the
+// last one was not taken yet it comes back and gets reused.
+static void publish(void) {
+    EqBank *b = &s_banks[s_back];
+
+    b->count = 0;
+    for (int i = 0; s_enabled && i < EQ_BANDS; i++) {
+        if (s_db[i] == 0)
+            continue;
+        design(&b->band[i], s_types[i], s_hz[i], s_db[i]);
+        b->active[b->count++] = i;
+    }
+
+    s_back = __atomic_exchange_n(&s_handover, s_back | EQ_FRESH,
+                                 __ATOMIC_ACQ_REL) &
+             ~EQ_FRESH;
+}
+
+// decoder side, switch to the newest bank if there is one
+static bool take(void) {
+    if (!(__atomic_load_n(&s_handover, __ATOMIC_ACQUIRE) & EQ_FRESH))
+        return false;
+    s_bank = __atomic_exchange_n(&s_handover, s_bank, __ATOMIC_ACQ_REL) &
+             ~EQ_FRESH;
+    return true;
+}
+
+static void clamp_band(int band) {
+    int nyquist = s_rate / 2 - 1;
+    if (s_hz[band] < 20)
+        s_hz[band] = 20;
+    if (s_hz[band] > nyquist)
+        s_hz[band] = nyquist;
+    if (s_db[band] < EQ_GAIN_MIN_DB)
+        s_db[band] = EQ_GAIN_MIN_DB;
+    if (s_db[band] > EQ_GAIN_MAX_DB)
+        s_db[band] = EQ_GAIN_MAX_DB;
+}
+
+void eq_init(int rate) {
+    s_rate = rate;
+    for (int i = 0; i < EQ_BANDS; i++)
+        clamp_band(i);
+
+    memset(s_state, 0, sizeof(s_state));
+    s_bank     = 0;
+    s_handover = 1;
+    s_back     = 2;
+    publish();
+    take();
+}
+
+void eq_set_enabled(bool enabled) {
+    s_enabled = enabled;
+    publish();
+}
+
+bool eq_is_enabled(void) {
+    return s_enabled;
+}
+
+static int16_t sat16(int32_t v) {
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t) v;
+}
+
+// one biquad over one channel of the block (stride 2)
+static void run_biquad(const Biquad *bq, BiquadState *st, int16_t *pcm,
+                       int frames) {
+    int32_t x1 = st->x1, x2 = st->x2, y1 = st->y1, y2 = st->y2;
+    int64_t err = st->err;
+
+    for (int i = 0; i < frames; i++) {
+        int32_t x   = pcm[i * 2];
+        int64_t acc = err;
+        acc += (int64_t) bq->b0 * x;
+        acc += (int64_t) bq->b1 * x1;
+        acc += (int64_t) bq->b2 * x2;
+        acc -= (int64_t) bq->a1 * y1;
+        acc -= (int64_t) bq->a2 * y2;
+
+        int32_t y = (int32_t) (acc >> EQ_SHIFT);
+        err       = acc & (EQ_ONE - 1);
+
+        // the state keeps the unclipped value, only the output saturates
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+
+        pcm[i * 2] = sat16(y);
+    }
+
+    st->x1  = x1;
+    st->x2  = x2;
+    st->y1  = y1;
+    st->y2  = y2;
+    st->err = err;
+}
+
+void eq_process(int16_t *pcm, int frames) {
+    // new coefficients, the old state would ring through them
+    if (take())
+        memset(s_state, 0, sizeof(s_state));
+
+    const EqBank *b = &s_banks[s_bank];
+    for (int n = 0; n < b->count; n++) {
+        int band = b->active[n];
+        for (int c = 0; c < 2; c++)
+            run_biquad(&b->band[band], &s_state[band][c], pcm + c, frames);
+    }
+}
+
+#ifdef __3DS__
+void eq_benchmark(int frames) {
+    int16_t *pcm = malloc(frames * 2 * sizeof(int16_t));
+    if (!pcm)
+        return;
+
+    // every band active on a spare copy of the settings
+    bool enabled = s_enabled;
+    int db[EQ_BANDS];
+    memcpy(db, s_db, sizeof(db));
+
+    s_enabled = true;
+    for (int i = 0; i < EQ_BANDS; i++)
+        s_db[i] = (i & 1) ? -6 : 6;
+    publish();
+
+    const int runs = 64;
+    u64 ticks      = 0;
+    for (int r = 0; r < runs; r++) {
+        for (int i = 0; i < frames * 2; i++)
+            pcm[i] = (int16_t) (i * 2654435761u >> 16);
+
+        u64 start = svcGetSystemTick();
+        eq_process(pcm, frames);
+        ticks += svcGetSystemTick() - start;
+    }
+
+    log_debug("eq: %d frames, %d bands, %llu cyc", frames, EQ_BANDS,
+              ticks / runs);
+
+    s_enabled = enabled;
+    memcpy(s_db, db, sizeof(db));
+    publish();
+    free(pcm);
+}
+#else
+void eq_benchmark(int frames) {
+    (void) frames;
+}
+#endif
@@ -0,0 +1,34 @@
+#ifndef EQ_H
+#define EQ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 5 band parametric eq in the decode path. bands are rbj biquads (low
+// shelf, three peaks, high shelf) run in direct form 1 with Q28
+// coefficients (+12 dB boosts need the headroom), a 64 bit accumulator and
+// error feedback, on interleaved int16 stereo in place. coefficients are
+// only computed when a band changes, flat bands are skipped.
+
+#define EQ_BANDS 5
+#define EQ_GAIN_MIN_DB -12
+#define EQ_GAIN_MAX_DB 12
+
+// register eq settings, call before settings_load()
+void eq_register_settings(void);
+
+// call before the decoder starts
+void eq_init(int rate);
+
+// main thread, picked up by the decoder on its next block. the bands
+// themselves come from the settings file.
+void eq_set_enabled(bool enabled);
+bool eq_is_enabled(void);
+
+// decoder thread, frames of interleaved stereo
+void eq_process(int16_t *pcm, int frames);
+
+// log cycles per block with every band active
+void eq_benchmark(int frames);
+
+#endif
@@ -0,0 +1,372 @@
+#ifndef __3DS__
+#define _POSIX_C_SOURCE 199309L // clock_gettime for the host benchmark
+#endif
+
+#include "gain.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "settings.h"
+
+#if defined(__ARM_FEATURE_DSP)
+#include <arm_acle.h>
+#endif
+
+#ifdef __3DS__
+#include <3ds.h>
+#else
+#include <time.h>
+#endif
+
+// written by the main thread, read by the decoder
+static int s_volume   = 100;
+static bool s_muted   = false;
+static int32_t s_trim = GAIN_UNITY;
+static int s_trimDb   = 0; // only used to persist the trim
+
+// decoder-owned ramp and limiter state
+static int32_t s_auto      = GAIN_UNITY;
+static int32_t s_current   = GAIN_UNITY;
+static int32_t s_limit     = GAIN_MAX;
+static int s_rampFrames    = 960;
+static int s_releaseFrames = 16800;
+static uint32_t s_limited  = 0;
+
+// 4x oversampled true peak, see true_peak()
+#define TP_TAPS 12
+
+// the last input samples of each channel, the intervals at the end of a
+// block are only checked once the next one arrives
+static int16_t s_tpHist[2][TP_TAPS - 1];
+
+static int32_t clamp_gain(int64_t g) {
+    return g < 0 ? 0 : g > GAIN_MAX ? GAIN_MAX : (int32_t) g;
+}
+
+static int16_t sat16(int32_t v) {
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t) v;
+}
+
+// volume follows a square law so the steps sound roughly even
+static int32_t target_gain(void) {
+    if (__atomic_load_n(&s_muted, __ATOMIC_RELAXED))
+        return 0;
+
+    int v       = __atomic_load_n(&s_volume, __ATOMIC_RELAXED);
+    int64_t vol = (int64_t) GAIN_UNITY * v * v / (100 * 100);
+    int64_t g   = vol * __atomic_load_n(&s_trim, __ATOMIC_RELAXED) >> 16;
+    return clamp_gain(g * s_auto >> 16);
+}
+
+void gain_register_settings(void) {
+    settings_register_int("audio_volume", &s_volume);
+    settings_register_int("audio_trim_db", &s_trimDb);
+}
+
+void gain_init(int rate) {
+    // loaded values are not range checked yet
+    gain_set_volume(s_volume);
+    gain_set_trim_db(s_trimDb);
+
+    s_rampFrames    = rate / 1000 * GAIN_RAMP_MS;
+    s_releaseFrames = rate / 1000 * GAIN_RELEASE_MS;
+    s_auto          = GAIN_UNITY;
+    s_limit         = GAIN_MAX;
+    s_current       = target_gain();
+    memset(s_tpHist, 0, sizeof(s_tpHist));
+}
+
+void gain_set_volume(int percent) {
+    if (percent < 0)
+        percent = 0;
+    if (percent > 100)
+        percent = 100;
+    __atomic_store_n(&s_volume, percent, __ATOMIC_RELAXED);
+}
+
+void gain_set_mute(bool mute) {
+    __atomic_store_n(&s_muted, mute, __ATOMIC_RELAXED);
+}
+
+void gain_set_trim_db(int db) {
+    if (db < GAIN_TRIM_MIN_DB)
+        db = GAIN_TRIM_MIN_DB;
+    if (db > GAIN_TRIM_MAX_DB)
+        db = GAIN_TRIM_MAX_DB;
+
+    // only place floats are used, once per change
+    int32_t trim = clamp_gain(lroundf(GAIN_UNITY * powf(10.0f, db / 20.0f)));
+    __atomic_store_n(&s_trim, trim, __ATOMIC_RELAXED);
+    s_trimDb = db;
+}
+
+void gain_set_auto(int32_t gain) {
+    s_auto = clamp_gain(gain);
+}
+
+uint32_t gain_limited_blocks(void) {
+    return s_limited;
+}
+
+int gain_get_volume(void) {
+    return __atomic_load_n(&s_volume, __ATOMIC_RELAXED);
+}
+
+bool gain_is_muted(void) {
+    return __atomic_load_n(&s_muted, __ATOMIC_RELAXED);
+}
+
+void gain_scale_c(int16_t *pcm, int frames, int32_t gain) {
+    for (int i = 0; i < frames * 2; i++)
+        pcm[i] = sat16((int32_t) (((int64_t) pcm[i] * gain) >> 16));
+}
+
+void gain_scale(int16_t *pcm, int frames, int32_t gain) {
+#if defined(__ARM_FEATURE_DSP)
+    // one 32 bit load per frame. smulw[bt] multiply the Q16 gain by either
+    // half and drop the low 16 bits, ssat clamps and the two halves are
+    // packed back (pkhbt). pcm is always 4 byte aligned here.
+    uint32_t *p = (uint32_t *) pcm;
+    for (int i = 0; i < frames; i++) {
+        int32_t x = (int32_t) p[i];
+        int32_t l = __ssat(__smulwb(gain, x), 16);
+        int32_t r = __ssat(__smulwt(gain, x), 16);
+        p[i]      = ((uint32_t) l & 0xFFFF) | ((uint32_t) r << 16);
+    }
+#else
+    gain_scale_c(pcm, frames, gain);
+#endif
+}
+
+static int32_t abs32(int32_t v) {
+    return v < 0 ? -v : v;
+}
+
+// 4x oversampled true peak. each phase is a kaiser windowed sinc (beta 4)
+// over 12 samples, Q15. phase 0 is the sample itself.
+static const int16_t s_tpPhases[3][TP_TAPS] = {
+    {-272, 652, -1324, 2560, -5487, 29501, 9600, -3640, 1840, -941, 434, -154},
+    {-295, 758, -1584, 3068, -6258, 20695, 20695, -6258, 3068, -1584, 758,
+     -295},
+    {-154, 434, -941, 1840, -3640, 9600, 29501, -5487, 2560, -1324, 652, -272},
+};
+
+// the magnitudes of each phase sum to under 2^16, so this can't overflow
+static int32_t tp_dot(const int16_t *x, int stride, const int16_t *h) {
+    int32_t acc = 0;
+    for (int k = 0; k < TP_TAPS; k++)
+        acc += x[k * stride] * h[k];
+    return acc >> 15;
+}
+
+// running peak over the oversampled points. a parabola through each local
+// maximum and its neighbours finds the peak between two points, which the
+// points alone read up to 5% low near 20 kHz.
+typedef struct {
+    int32_t peak, a, b;
+} TpScan;
+
+static void tp_push(TpScan *s, int32_t v) {
+    v = abs32(v);
+    if (s->b >= s->a && s->b >= v && s->b > 0) {
+        uint32_t d   = (uint32_t) (s->a - v) * (uint32_t) (s->a - v);
+        uint32_t den = 8 * (uint32_t) (2 * s->b - s->a - v);
+        int32_t top  = s->b + (den ? (int32_t) (d / den) : 0);
+        if (top > s->peak)
+            s->peak = top;
+    }
+    if (v > s->peak)
+        s->peak = v;
+    s->a = s->b;
+    s->b = v;
+}
+
+// the sample and the three points after it, x holds the 12 samples around
+// the interval at the given stride
+static void tp_interval(TpScan *s, const int16_t *x, int stride) {
+    tp_push(s, x[5 * stride]);
+    for (int p = 0; p < 3; p++)
+        tp_push(s, tp_dot(x, stride, s_tpPhases[p]));
+}
+
+// no point between samples reaches twice the largest sample around it, so
+// a channel whose samples stay under half of below skips the filter
+static int32_t true_peak(const int16_t *pcm, int frames, int32_t below) {
+    const int hist = TP_TAPS - 1;
+    int32_t peak   = 0;
+
+    for (int c = 0; c < 2; c++) {
+        int32_t top = 0;
+        for (int k = 0; k < hist; k++)
+            if (abs32(s_tpHist[c][k]) > top)
+                top = abs32(s_tpHist[c][k]);
+        for (int i = 0; i < frames; i++)
+            if (abs32(pcm[i * 2 + c]) > top)
+                top = abs32(pcm[i * 2 + c]);
+        if (2 * top <= below) {
+            if (top > peak)
+                peak = top;
+            continue;
+        }
+
+        TpScan s = {0, 0, 0};
+
+        // intervals that still reach back into the last block. interval j
+        // lies between samples j and j + 1 and needs j - 5 to j + 6.
+        int16_t win[TP_TAPS];
+        for (int j = -6; j < 5 && j + 6 < frames; j++) {
+            for (int k = 0; k < TP_TAPS; k++) {
+                int n  = j - 5 + k;
+                win[k] = n < 0 ? s_tpHist[c][n + hist] : pcm[n * 2 + c];
+            }
+            tp_interval(&s, win, 1);
+        }
+        for (int j = 5; j + 6 < frames; j++)
+            tp_interval(&s, pcm + (j - 5) * 2 + c, 2);
+
+        // the last samples get no interval yet but count as they are
+        for (int i = frames - 6 < 0 ? 0 : frames - 6; i < frames; i++)
+            tp_push(&s, pcm[i * 2 + c]);
+        if (s.peak > peak)
+            peak = s.peak;
+    }
+
+    // the filter reads up to 0.6% low below 20 kHz, cover that
+    return peak + (peak >> 7);
+}
+
+// keep the end of the block for the next true_peak(), before any gain
+static void tp_remember(const int16_t *pcm, int frames) {
+    const int hist = TP_TAPS - 1;
+    int keep       = frames < hist ? frames : hist;
+    for (int c = 0; c < 2; c++) {
+        memmove(s_tpHist[c], s_tpHist[c] + keep,
+                (hist - keep) * sizeof(int16_t));
+        for (int k = 0; k < keep; k++)
+            s_tpHist[c][hist - keep + k] = pcm[(frames - keep + k) * 2 + c];
+    }
+}
+
+// the limit drops to whatever the block allows as soon as it would go over
+// the ceiling and creeps back up exponentially while it stays clear.
+// returns the gain to aim for.
+static int32_t limit(const int16_t *pcm, int frames, int32_t target) {
+    int32_t grown = s_limit + (int32_t) ((int64_t) s_limit * frames /
+                                         s_releaseFrames);
+    if (grown > GAIN_MAX)
+        grown = GAIN_MAX;
+
+    // nothing can reach the ceiling, skip the scan
+    int32_t gain = target < grown ? target : grown;
+    if (((int64_t) 32768 * gain >> 16) <= GAIN_CEILING) {
+        s_limit = grown;
+        return gain;
+    }
+
+    // the input level the gain takes to the ceiling
+    int32_t below = (int32_t) (((int64_t) GAIN_CEILING << 16) / gain);
+    int32_t peak  = true_peak(pcm, frames, below);
+    if (peak == 0 || ((int64_t) peak * gain >> 16) <= GAIN_CEILING) {
+        s_limit = grown;
+        return gain;
+    }
+
+    s_limit = (int32_t) (((int64_t) GAIN_CEILING << 16) / peak);
+    gain    = s_limit < target ? s_limit : target;
+    s_limited++;
+
+    // no lookahead, so the attack has to be instant to stay clean
+    if (s_current > gain)
+        s_current = gain;
+    return gain;
+}
+
+// per frame steps towards target, only runs for the length of a ramp
+static int ramp(int16_t *pcm, int frames, int32_t target) {
+    int32_t step = (target - s_current) / s_rampFrames;
+    if (step == 0)
+        step = target > s_current ? 1 : -1;
+
+    int i = 0;
+    for (; i < frames && s_current != target; i++) {
+        s_current += step;
+        if ((step > 0 && s_current > target) ||
+            (step < 0 && s_current < target))
+            s_current = target;
+
+        for (int c = 0; c < 2; c++) {
+            int16_t *s = &pcm[i * 2 + c];
+            *s = sat16((int32_t) (((int64_t) *s * s_current) >> 16));
+        }
+    }
+    return i;
+}
+
+void gain_apply(int16_t *pcm, int frames) {
+    int32_t target = limit(pcm, frames, target_gain());
+    tp_remember(pcm, frames);
+
+    int done = 0;
+    if (s_current != target)
+        done = ramp(pcm, frames, target);
+
+    if (done == frames || s_current == GAIN_UNITY)
+        return;
+
+    if (s_current == 0) {
+        memset(pcm + done * 2, 0, (frames - done) * 2 * sizeof(int16_t));
+        return;
+    }
+
+    gain_scale(pcm + done * 2, frames - done, s_current);
+}
+
+#if defined(__ARM_FEATURE_DSP)
+#define BENCH_KERNEL "dsp"
+#else
+#define BENCH_KERNEL "portable"
+#endif
+
+// cpu cycles on the 3ds, nanoseconds on a host build
+#ifdef __3DS__
+#define BENCH_UNIT "cyc"
+static uint64_t bench_now(void) {
+    return svcGetSystemTick();
+}
+#else
+#define BENCH_UNIT "ns"
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+void gain_benchmark(int frames) {
+    int16_t *pcm = malloc(frames * 2 * sizeof(int16_t));
+    if (!pcm)
+        return;
+
+    const int runs    = 64;
+    uint64_t ticks[2] = {0, 0};
+    for (int k = 0; k < 2; k++) {
+        for (int r = 0; r < runs; r++) {
+            for (int i = 0; i < frames * 2; i++)
+                pcm[i] = (int16_t) (i * 2654435761u >> 16);
+
+            uint64_t start = bench_now();
+            if (k == 0)
+                gain_scale_c(pcm, frames, GAIN_UNITY * 3 / 4);
+            else
+                gain_scale(pcm, frames, GAIN_UNITY * 3 / 4);
+            ticks[k] += bench_now() - start;
+        }
+    }
+
+    log_debug("gain: %d frames, c %llu " BENCH_UNIT ", " BENCH_KERNEL
+              " %llu " BENCH_UNIT,
+              frames, (unsigned long long) (ticks[0] / runs),
+              (unsigned long long) (ticks[1] / runs));
+    free(pcm);
+}
@@ -0,0 +1,54 @@
+#ifndef GAIN_H
+#define GAIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// software volume between the decoder and the feeder. gains are Q16 fixed
+// point and applied in place to interleaved int16 stereo with saturation.
+// a peak limiter with an instant attack keeps the true peak of every block,
+// measured at 4x oversampling, under GAIN_CEILING whenever the gain could
+// push it over.
+// the arm build uses the armv6 dsp multiplies, gain_scale_c() is the
+// portable reference and builds anywhere.
+
+#define GAIN_UNITY 65536    // 0 dB
+#define GAIN_MAX 262143     // just under +12 dB
+#define GAIN_RAMP_MS 20     // length of a volume or mute transition
+#define GAIN_CEILING 29204  // -1 dBTP, the limiter keeps peaks below this
+#define GAIN_RELEASE_MS 350 // limiter recovers 6 dB in about this long
+#define GAIN_TRIM_MIN_DB -24
+#define GAIN_TRIM_MAX_DB 6
+
+// register gain settings, call before settings_load()
+void gain_register_settings(void);
+
+// call before the decoder starts, rate sets the ramp length
+void gain_init(int rate);
+
+// main thread, take effect on the next block with a short ramp
+void gain_set_volume(int percent); // 0-100
+void gain_set_mute(bool mute);
+void gain_set_trim_db(int db); // per-stream correction on top of volume
+
+// decoder thread, loudness normalization on top of volume and trim
+void gain_set_auto(int32_t gain);
+
+int gain_get_volume(void);
+bool gain_is_muted(void);
+
+// decoder thread, frames of interleaved stereo
+void gain_apply(int16_t *pcm, int frames);
+
+// blocks the limiter had to pull down, for telemetry
+uint32_t gain_limited_blocks(void);
+
+// fixed gain kernels, exposed for the benchmark
+void gain_scale_c(int16_t *pcm, int frames, int32_t gain);
+void gain_scale(int16_t *pcm, int frames, int32_t gain);
+
+// log the time per block for each kernel, cycles on the 3ds and
+// nanoseconds on a host build
+void gain_benchmark(int frames);
+
+#endif
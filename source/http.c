@@ -0,0 +1,328 @@
+#include "http.h"
+#include "settings.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void http_parser_init(HttpParser *p) {
+    HttpHeaderFunc onHeader = p->onHeader;
+    void *user              = p->user;
+
+    memset(p, 0, sizeof(HttpParser));
+    p->state         = HTTP_STATUS;
+    p->contentLength = -1;
+    p->remaining     = -1;
+    p->onHeader      = onHeader;
+    p->user          = user;
+}
+
+bool http_headers_done(const HttpParser *p) {
+    return p->state >= HTTP_BODY && p->state != HTTP_ERROR;
+}
+
+bool http_body_done(const HttpParser *p) {
+    return p->state == HTTP_DONE;
+}
+
+static char *trim(char *s) {
+    while (*s == ' ' || *s == '\t')
+        s++;
+    size_t len = strlen(s);
+    while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t'))
+        s[--len] = '\0';
+    return s;
+}
+
+static bool has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    for (const char *s = value; *s; s++) {
+        if (strncasecmp(s, token, len) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void start_body(HttpParser *p) {
+    if (p->status < 200) {
+        http_parser_init(p); // 1xx, the real response follows
+        return;
+    }
+
+    if (p->status == 204 || p->status == 304) {
+        p->state = HTTP_DONE;
+    } else if (p->chunked) {
+        p->state = HTTP_CHUNK_SIZE;
+    } else {
+        p->remaining = p->contentLength;
+        p->state     = p->remaining == 0 ? HTTP_DONE : HTTP_BODY;
+    }
+}
+
+static bool header_line(HttpParser *p, char *line) {
+    if (*line == '\0') {
+        start_body(p);
+        return true;
+    }
+
+    char *colon = strchr(line, ':');
+    if (!colon)
+        return false;
+    *colon      = '\0';
+    char *name  = trim(line);
+    char *value = trim(colon + 1);
+
+    if (strcasecmp(name, "content-length") == 0) {
+        char *end;
+        long long len = strtoll(value, &end, 10);
+        if (end == value || len < 0)
+            return false;
+        p->contentLength = len;
+    } else if (strcasecmp(name, "transfer-encoding") == 0) {
+        p->chunked = has_token(value, "chunked");
+    } else if (strcasecmp(name, "location") == 0) {
+        snprintf(p->location, sizeof(p->location), "%s", value);
+    }
+
+    if (p->onHeader)
+        p->onHeader(p->user, name, value);
+    return true;
+}
+
+// one complete line without its line break
+static bool handle_line(HttpParser *p, char *line) {
+    switch (p->state) {
+    case HTTP_STATUS: {
+        // "HTTP/1.1 200 OK", icecast may answer "ICY 200 OK"
+        if (*line == '\0')
+            return true; // stray crlf before the response
+        char *sp = strchr(line, ' ');
+        if (!sp || (strncmp(line, "HTTP/", 5) != 0 &&
+                    strncmp(line, "ICY", 3) != 0))
+            return false;
+        p->status = atoi(sp + 1);
+        if (p->status < 100 || p->status > 999)
+            return false;
+        p->state = HTTP_HEADERS;
+        return true;
+    }
+
+    case HTTP_HEADERS:
+        return header_line(p, line);
+
+    case HTTP_CHUNK_SIZE: {
+        char *end;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (end == line || (*end != '\0' && *end != ';' && *end != ' '))
+            return false;
+        if (size == 0) {
+            p->state = HTTP_TRAILER;
+        } else {
+            p->remaining = (int64_t) size;
+            p->state     = HTTP_BODY;
+        }
+        return true;
+    }
+
+    case HTTP_CHUNK_END:
+        if (*line != '\0')
+            return false;
+        p->state = HTTP_CHUNK_SIZE;
+        return true;
+
+    case HTTP_TRAILER:
+        if (*line == '\0')
+            p->state = HTTP_DONE;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+int http_parser_feed(HttpParser *p, uint8_t *data, size_t len) {
+    size_t in = 0, out = 0;
+
+    while (in < len) {
+        if (p->state == HTTP_ERROR)
+            return -1;
+        if (p->state == HTTP_DONE)
+            break;
+
+        if (p->state == HTTP_BODY) {
+            size_t n = len - in;
+            if (p->remaining >= 0 && (uint64_t) n > (uint64_t) p->remaining)
+                n = (size_t) p->remaining;
+
+            // decoded body only ever shrinks, so it fits in place
+            if (out != in)
+                memmove(data + out, data + in, n);
+            out += n;
+            in += n;
+            p->bodyBytes += n;
+
+            if (p->remaining >= 0) {
+                p->remaining -= n;
+                if (p->remaining == 0)
+                    p->state = p->chunked ? HTTP_CHUNK_END : HTTP_DONE;
+            }
+            continue;
+        }
+
+        // line based states, copy up to the next line break
+        const uint8_t *nl = memchr(data + in, '\n', len - in);
+        size_t n          = nl ? (size_t) (nl - (data + in)) : len - in;
+
+        size_t room = HTTP_LINE_MAX - 1 - p->lineLen;
+        memcpy(p->line + p->lineLen, data + in, n < room ? n : room);
+        p->lineLen += n < room ? n : room;
+        in += n;
+
+        if (!nl)
+            break;
+        in++; // the line break
+
+        if (p->lineLen > 0 && p->line[p->lineLen - 1] == '\r')
+            p->lineLen--;
+        p->line[p->lineLen] = '\0';
+        p->lineLen          = 0;
+
+        if (!handle_line(p, p->line)) {
+            p->state = HTTP_ERROR;
+            return -1;
+        }
+    }
+
+    return (int) out;
+}
+
+bool http_redirect_url(char *url, size_t size, const char *location) {
+    char next[HTTP_URL_MAX];
+    int len;
+
+    if (strncmp(location, "https://", 8) == 0) {
+        len = snprintf(next, sizeof(next), "%s", location);
+    } else if (strncmp(location, "//", 2) == 0) {
+        len = snprintf(next, sizeof(next), "https:%s", location);
+    } else if (location[0] == '/') {
+        const char *host = url + 8;
+        const char *path = strchr(host, '/');
+        size_t hostLen   = path ? (size_t) (path - host) : strlen(host);
+        len = snprintf(next, sizeof(next), "https://%.*s%s", (int) hostLen,
+                       host, location);
+    } else {
+        return false; // plain http or a relative path, not supported
+    }
+
+    if (len < 0 || (size_t) len >= sizeof(next) || (size_t) len >= size)
+        return false;
+    memcpy(url, next, len + 1);
+    return true;
+}
+
+// connects and sends the request, ctx is only left set up on success
+static bool send_request(SecureCtx *ctx, const char *url) {
+    if (strncmp(url, "https://", 8) != 0)
+        return false;
+
+    const char *host = url + 8;
+    const char *path = strchr(host, '/');
+    size_t hostLen   = path ? (size_t) (path - host) : strlen(host);
+
+    // host or host:port, the host header gets both
+    char hostName[256];
+    if (hostLen >= sizeof(hostName))
+        return false;
+    memcpy(hostName, host, hostLen);
+    hostName[hostLen] = '\0';
+
+    char name[256];
+    const char *port = "443";
+    snprintf(name, sizeof(name), "%s", hostName);
+    char *colon = strchr(name, ':');
+    if (colon) {
+        *colon = '\0';
+        port   = colon + 1;
+    }
+
+    if (!connect_ssl(ctx, name, port))
+        return false;
+
+    char req[1024];
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s\r\n"
+                       "User-Agent: %s\r\n"
+                       "Connection: close\r\n\r\n",
+                       path ? path : "/", hostName, HTTP_USER_AGENT);
+    if (len < 0 || len >= (int) sizeof(req)) {
+        cleanup_ssl(ctx);
+        return false;
+    }
+
+    for (int sent = 0; sent < len;) {
+        int ret = mbedtls_ssl_write(&ctx->ssl, (unsigned char *) req + sent,
+                                    len - sent);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            svcSleepThread(5 * 1000 * 1000);
+            continue;
+        }
+        if (ret <= 0) {
+            cleanup_ssl(ctx);
+            return false;
+        }
+        sent += ret;
+    }
+    return true;
+}
+
+bool http_open(SecureCtx *ctx, const char *url, HttpParser *p, uint8_t *buf,
+               size_t cap, size_t *bodyLen) {
+    char current[HTTP_URL_MAX];
+    snprintf(current, sizeof(current), "%s", url);
+
+    for (int hop = 0; hop <= HTTP_MAX_REDIRECTS; hop++) {
+        if (!send_request(ctx, current))
+            return false;
+
+        http_parser_init(p);
+        int body = 0;
+        while (!http_headers_done(p)) {
+            int r = mbedtls_ssl_read(&ctx->ssl, buf, cap);
+            if (r == MBEDTLS_ERR_SSL_WANT_READ ||
+                r == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                svcSleepThread(1 * 1000 * 1000);
+                continue;
+            }
+            if (r <= 0 || (body = http_parser_feed(p, buf, r)) < 0)
+                break;
+        }
+
+        if (!http_headers_done(p)) {
+            cleanup_ssl(ctx);
+            return false;
+        }
+
+        if (p->status >= 300 && p->status < 400 && p->location[0]) {
+            cleanup_ssl(ctx);
+            if (!http_redirect_url(current, sizeof(current), p->location))
+                return false;
+            log_debug("http: %d, redirected to %s", p->status, current);
+            continue;
+        }
+
+        if (p->status < 200 || p->status >= 300) {
+            log_debug("http: %d from %s", p->status, current);
+            cleanup_ssl(ctx);
+            return false;
+        }
+
+        *bodyLen = body;
+        return true;
+    }
+
+    log_debug("http: too many redirects for %s", url);
+    return false;
+}
@@ -0,0 +1,76 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include "net.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// incremental http/1.1 response parser. bytes are fed as they arrive and
+// looked at once: header lines are assembled and parsed one at a time, the
+// body is passed through with chunked framing stripped on the fly.
+
+#define HTTP_LINE_MAX 1024
+#define HTTP_URL_MAX 768
+#define HTTP_MAX_REDIRECTS 5
+
+typedef enum {
+    HTTP_STATUS,  // status line
+    HTTP_HEADERS, // header lines
+    HTTP_BODY,    // body bytes, or the data of one chunk
+    HTTP_CHUNK_SIZE,
+    HTTP_CHUNK_END, // crlf after a chunk
+    HTTP_TRAILER,   // lines after the last chunk
+    HTTP_DONE,      // body complete, anything after it is ignored
+    HTTP_ERROR,
+} HttpState;
+
+// called for every response header, name and value are trimmed
+typedef void (*HttpHeaderFunc)(void *user, const char *name,
+                               const char *value);
+
+typedef struct {
+    HttpState state;
+
+    int status;
+    int64_t contentLength; // -1 if not sent
+    bool chunked;
+    char location[HTTP_URL_MAX];
+
+    HttpHeaderFunc onHeader; // optional
+    void *user;
+
+    int64_t remaining; // body or chunk bytes left, -1 until close
+    uint64_t bodyBytes;
+
+    char line[HTTP_LINE_MAX]; // longer lines are cut off
+    size_t lineLen;
+} HttpParser;
+
+void http_parser_init(HttpParser *p);
+
+// consume len bytes. decoded body bytes are moved to the front of data and
+// their count is returned, -1 on a malformed response.
+int http_parser_feed(HttpParser *p, uint8_t *data, size_t len);
+
+// status and headers are known
+bool http_headers_done(const HttpParser *p);
+
+// the whole body arrived (content-length or last chunk)
+bool http_body_done(const HttpParser *p);
+
+// resolve a redirect target against the https url it came from, in place.
+// takes absolute https urls, protocol relative ones (//host/path, https is
+// kept) and absolute paths on the same host. false for anything else or
+// if the result does not fit.
+bool http_redirect_url(char *url, size_t size, const char *location);
+
+// connect, send a GET and read up to the end of the response headers,
+// following redirects. on success ctx stays connected, body bytes that
+// came with the headers are in buf[0..*bodyLen) and the rest is read
+// through p. fails on errors and non-2xx responses. the url may name a
+// port (https://host:port/path), 443 otherwise.
+bool http_open(SecureCtx *ctx, const char *url, HttpParser *p, uint8_t *buf,
+               size_t cap, size_t *bodyLen);
+
+#endif
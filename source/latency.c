@@ -0,0 +1,122 @@
+#include "latency.h"
+#include "settings.h"
+#include <stdlib.h>
+
+#define LATENCY_MAX_BEHIND_MS (3600 * 1000) // larger gaps are bogus granules
+#define LATENCY_SILENCE_PEAK 65              // -54 dBFS
+
+static int s_targetMs = 4000;  // 0 disables the controller
+static bool s_speedup = false; // play at LATENCY_SPEEDUP while catching up
+
+static StreamQueue *s_live = NULL;
+static int s_rate          = 48000;
+static volatile bool s_hold = false;
+static bool s_flushed       = false; // set by latency_flush, decoder clears
+
+// decoder-owned
+static bool s_catching    = false;
+static int s_settleFrames = 0; // left to decode before measuring again
+static LatencyStats s_stats;
+
+void latency_register_settings(void) {
+    settings_register_int("latency_target_ms", &s_targetMs);
+    settings_register_bool("latency_speedup", &s_speedup);
+}
+
+void latency_init(StreamQueue *live, int rate) {
+    s_live           = live;
+    s_rate           = rate;
+    s_stats.behindMs = -1;
+}
+
+void latency_set_hold(bool hold) {
+    s_hold = hold;
+}
+
+void latency_flush(void) {
+    __atomic_store_n(&s_flushed, true, __ATOMIC_RELEASE);
+}
+
+// granule distance to the live edge, only comparable within one chain
+static int measure(const OpusStream *os, int pipelineMs) {
+    uint32_t serial;
+    int64_t live;
+    if (!s_live || !os->haveHead || os->granule < 0 ||
+        !stream_queue_live_edge(s_live, &serial, &live) ||
+        serial != os->serial || live < os->granule)
+        return -1;
+
+    int64_t ms = (live - os->granule) / 48; // granules are 48 kHz
+    if (ms > LATENCY_MAX_BEHIND_MS)
+        return -1;
+    return (int) ms + pipelineMs;
+}
+
+void latency_update(const OpusStream *os, int frames, int pipelineMs) {
+    if (__atomic_exchange_n(&s_flushed, false, __ATOMIC_ACQ_REL)) {
+        // granule and pipeline still describe the old position
+        s_catching     = false;
+        s_settleFrames = s_rate / 1000 * LATENCY_SETTLE_MS;
+    }
+    if (s_settleFrames > 0) {
+        s_settleFrames -= frames;
+        s_stats.behindMs = -1;
+        return;
+    }
+
+    int behind       = measure(os, pipelineMs);
+    s_stats.behindMs = behind;
+
+    if (s_catching && s_speedup)
+        s_stats.fastFrames += frames;
+
+    if (s_targetMs <= 0 || s_hold) {
+        s_catching = false;
+        return;
+    }
+
+    // unknown right after a chain switch, keep doing what we did
+    if (behind < 0)
+        return;
+
+    if (!s_catching && behind > s_targetMs + LATENCY_HYSTERESIS_MS) {
+        s_catching = true;
+        s_stats.catchUps++;
+        log_debug("latency: %d ms behind live, catching up", behind);
+    } else if (s_catching && behind <= s_targetMs) {
+        s_catching = false;
+        log_debug("latency: back to %d ms behind live", behind);
+    }
+}
+
+int latency_behind_ms(void) {
+    return s_stats.behindMs;
+}
+
+bool latency_speeding_up(void) {
+    return s_catching && s_speedup;
+}
+
+bool latency_skip(const int16_t *pcm, int frames) {
+    if (!s_catching)
+        return false;
+
+    for (int i = 0; i < frames * 2; i++) {
+        if (abs(pcm[i]) > LATENCY_SILENCE_PEAK)
+            return false;
+    }
+
+    s_stats.skippedFrames += frames;
+    return true;
+}
+
+void latency_log_stats(void) {
+    LatencyStats st = s_stats;
+    int perMs       = s_rate / 1000;
+
+    log_debug("latency: %d ms behind live (target %d ms)%s, %lu catch-ups, "
+              "fast %llu ms, skipped %llu ms of silence",
+              st.behindMs, s_targetMs, s_catching ? ", catching up" : "",
+              (unsigned long) st.catchUps, st.fastFrames / perMs,
+              st.skippedFrames / perMs);
+}
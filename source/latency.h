@@ -0,0 +1,60 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "opus_stream.h"
+#include "stream.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// keeps playback near the live edge. how far behind we are is the granule
+// distance between the newest page received and the last page decoded,
+// plus the decoded audio not yet heard. once that exceeds the target by a
+// margin the controller catches up until it is back at the target by
+// skipping chunks of near-silence. with the latency_speedup setting the
+// output also runs slightly fast meanwhile, which raises the pitch by about
+// 17 cents and is off by default. nothing is done while the listener is
+// deliberately behind (paused or rewound).
+
+#define LATENCY_HYSTERESIS_MS 1000 // start catching up this far over target
+#define LATENCY_SPEEDUP 1.01f      // output rate while catching up, if enabled
+#define LATENCY_SETTLE_MS 1000     // measurements ignored after a flush
+
+typedef struct {
+    int behindMs;           // last measurement, -1 if unknown
+    uint32_t catchUps;      // times the target was exceeded
+    uint64_t fastFrames;    // decoded while playing fast
+    uint64_t skippedFrames; // near-silent audio dropped
+} LatencyStats;
+
+// register settings, call before settings_load()
+void latency_register_settings(void);
+
+// live is the queue the download thread fills, rate the output rate
+void latency_init(StreamQueue *live, int rate);
+
+// while held the listener chose to be behind, nothing is caught up
+void latency_set_hold(bool hold);
+
+// any thread, queued audio was dropped for a seek. the controller stops and
+// only measures again once LATENCY_SETTLE_MS has been decoded from the new
+// position, so leftovers from the old one can't start a catch-up.
+void latency_flush(void);
+
+// decoder side, after each decoded chunk. pipelineMs is the decoded audio
+// still ahead of the speaker.
+void latency_update(const OpusStream *os, int frames, int pipelineMs);
+
+// decoder side, last measurement or -1 if unknown
+int latency_behind_ms(void);
+
+// decoder side, output should run at LATENCY_SPEEDUP. only while catching
+// up with the latency_speedup setting on.
+bool latency_speeding_up(void);
+
+// decoder side, true if the chunk should be dropped instead of played
+bool latency_skip(const int16_t *pcm, int frames);
+
+// write the controller state to the debug log
+void latency_log_stats(void);
+
+#endif
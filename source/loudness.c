@@ -0,0 +1,197 @@
+#include "loudness.h"
+#include "gain.h"
+#include "settings.h"
+#include <math.h>
+#include <string.h>
+
+#ifdef __3DS__
+#include <3ds.h>
+#endif
+
+#define METER_RATE 12000
+#define GATE_LUFS -50.0f     // below this the short-term value is silence
+#define AGC_MAX_DB 12.0f     // correction range either way
+#define AGC_DB_PER_BLOCK 0.1f // 1 dB/s, slow enough to not pump
+
+typedef struct {
+    float b0, b1, b2, a1, a2;
+} KFilter;
+
+typedef struct {
+    float x1, x2, y1, y2;
+} KState;
+
+static bool s_enabled   = true;
+static int s_targetLufs = -16;
+
+// decoder-owned
+static int s_decimate   = 4;
+static int s_blockLen   = 1200; // meter samples per 100 ms block
+static KFilter s_shelf, s_highpass;
+static KState s_state[2][2]; // [filter][channel]
+
+static int s_decimPos = 0;
+static float s_decimSum[2];
+static int s_blockPos = 0;
+static float s_blockPower = 0.0f;
+
+static float s_blocks[LOUDNESS_SHORT_TERM_BLOCKS]; // mean power per block
+static int s_blockHead  = 0;
+static int s_blockCount = 0;
+
+static LoudnessStats s_stats;
+
+void loudness_register_settings(void) {
+    settings_register_bool("agc_enabled", &s_enabled);
+    settings_register_int("agc_target_lufs", &s_targetLufs);
+}
+
+// bs.1770 k-weighting for any rate, bilinear transform of the analog
+// prototypes (same derivation as libebur128)
+static void design(int rate) {
+    float f0 = 1681.974450955533f;
+    float G  = 3.999843853973347f;
+    float Q  = 0.7071752369554196f;
+    float K  = tanf(3.14159265f * f0 / rate);
+    float Vh = powf(10.0f, G / 20.0f);
+    float Vb = powf(Vh, 0.4996667741545416f);
+    float a0 = 1.0f + K / Q + K * K;
+
+    s_shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
+    s_shelf.b1 = 2.0f * (K * K - Vh) / a0;
+    s_shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
+    s_shelf.a1 = 2.0f * (K * K - 1.0f) / a0;
+    s_shelf.a2 = (1.0f - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444f;
+    Q  = 0.5003270373238773f;
+    K  = tanf(3.14159265f * f0 / rate);
+    a0 = 1.0f + K / Q + K * K;
+
+    s_highpass.b0 = 1.0f;
+    s_highpass.b1 = -2.0f;
+    s_highpass.b2 = 1.0f;
+    s_highpass.a1 = 2.0f * (K * K - 1.0f) / a0;
+    s_highpass.a2 = (1.0f - K / Q + K * K) / a0;
+}
+
+void loudness_init(int rate) {
+    s_decimate = rate / METER_RATE;
+    if (s_decimate < 1)
+        s_decimate = 1;
+
+    int meterRate = rate / s_decimate;
+    s_blockLen    = meterRate / 1000 * LOUDNESS_BLOCK_MS;
+    design(meterRate);
+
+    memset(s_state, 0, sizeof(s_state));
+    memset(s_blocks, 0, sizeof(s_blocks));
+    memset(&s_stats, 0, sizeof(s_stats));
+    s_decimPos    = 0;
+    s_decimSum[0] = s_decimSum[1] = 0.0f;
+    s_blockPos    = 0;
+    s_blockPower  = 0.0f;
+    s_blockHead   = 0;
+    s_blockCount  = 0;
+    s_stats.momentary = s_stats.shortTerm = -70.0f;
+
+    gain_set_auto(GAIN_UNITY);
+}
+
+static float run(const KFilter *f, KState *st, float x) {
+    float y = f->b0 * x + f->b1 * st->x1 + f->b2 * st->x2 - f->a1 * st->y1 -
+              f->a2 * st->y2;
+    st->x2 = st->x1;
+    st->x1 = x;
+    st->y2 = st->y1;
+    st->y1 = y;
+    return y;
+}
+
+static float to_lufs(float power) {
+    return power > 1e-10f ? -0.691f + 10.0f * log10f(power) : -70.0f;
+}
+
+static float mean_power(int blocks) {
+    if (blocks > s_blockCount)
+        blocks = s_blockCount;
+    if (blocks == 0)
+        return 0.0f;
+
+    float sum = 0.0f;
+    for (int i = 1; i <= blocks; i++)
+        sum += s_blocks[(s_blockHead - i + LOUDNESS_SHORT_TERM_BLOCKS) %
+                        LOUDNESS_SHORT_TERM_BLOCKS];
+    return sum / blocks;
+}
+
+// once per 100 ms block, the only place log and pow run
+static void end_block(void) {
+    s_blocks[s_blockHead] = s_blockPower / s_blockLen;
+    s_blockHead           = (s_blockHead + 1) % LOUDNESS_SHORT_TERM_BLOCKS;
+    if (s_blockCount < LOUDNESS_SHORT_TERM_BLOCKS)
+        s_blockCount++;
+    s_blockPower = 0.0f;
+
+    s_stats.momentary = to_lufs(mean_power(LOUDNESS_MOMENTARY_BLOCKS));
+    s_stats.shortTerm = to_lufs(mean_power(LOUDNESS_SHORT_TERM_BLOCKS));
+
+    float want = 0.0f;
+    if (s_enabled) {
+        // hold the current correction through silence and breaks
+        if (s_stats.shortTerm < GATE_LUFS)
+            return;
+        want = s_targetLufs - s_stats.shortTerm;
+        want = fmaxf(-AGC_MAX_DB, fminf(AGC_MAX_DB, want));
+    }
+
+    float db = s_stats.autoGainDb;
+    if (want > db)
+        db = fminf(want, db + AGC_DB_PER_BLOCK);
+    else
+        db = fmaxf(want, db - AGC_DB_PER_BLOCK);
+
+    if (db != s_stats.autoGainDb) {
+        s_stats.autoGainDb = db;
+        gain_set_auto((int32_t) (GAIN_UNITY * powf(10.0f, db / 20.0f)));
+    }
+}
+
+void loudness_feed(const int16_t *pcm, int frames) {
+#ifdef __3DS__
+    u64 start = svcGetSystemTick();
+#endif
+
+    const float scale = 1.0f / (32768.0f * s_decimate);
+
+    for (int i = 0; i < frames; i++) {
+        s_decimSum[0] += pcm[i * 2];
+        s_decimSum[1] += pcm[i * 2 + 1];
+        if (++s_decimPos < s_decimate)
+            continue;
+
+        // averaging is a crude anti-alias filter, good enough for a level
+        for (int c = 0; c < 2; c++) {
+            float x = s_decimSum[c] * scale;
+            x       = run(&s_shelf, &s_state[0][c], x);
+            x       = run(&s_highpass, &s_state[1][c], x);
+            s_blockPower += x * x;
+            s_decimSum[c] = 0.0f;
+        }
+        s_decimPos = 0;
+
+        if (++s_blockPos == s_blockLen) {
+            s_blockPos = 0;
+            end_block();
+        }
+    }
+
+#ifdef __3DS__
+    s_stats.ticks += svcGetSystemTick() - start;
+#endif
+    s_stats.frames += frames;
+}
+
+void loudness_get_stats(LoudnessStats *out) {
+    memcpy(out, &s_stats, sizeof(LoudnessStats));
+}
@@ -0,0 +1,37 @@
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// incremental ebu r128 style loudness meter on the decoder output, driving
+// a slow automatic gain towards a target. input is decimated to roughly
+// 12 kHz before k-weighting, which keeps the cost to a few cycles per
+// frame. power is collected in 100 ms blocks, the momentary value covers
+// the last 4 of them (400 ms) and the short-term value the last 30 (3 s).
+
+#define LOUDNESS_BLOCK_MS 100
+#define LOUDNESS_MOMENTARY_BLOCKS 4
+#define LOUDNESS_SHORT_TERM_BLOCKS 30
+
+typedef struct {
+    float momentary;  // LUFS
+    float shortTerm;  // LUFS
+    float autoGainDb; // correction currently applied
+    uint64_t ticks;   // cpu ticks spent metering
+    uint64_t frames;  // frames metered
+} LoudnessStats;
+
+// register settings, call before settings_load()
+void loudness_register_settings(void);
+
+// call before the decoder starts
+void loudness_init(int rate);
+
+// decoder thread, frames of interleaved stereo before eq and gain
+void loudness_feed(const int16_t *pcm, int frames);
+
+// snapshot for telemetry
+void loudness_get_stats(LoudnessStats *out);
+
+#endif
@@ -1,6 +1,5 @@
 #include <3ds.h>
 #include <malloc.h>
-#include <opusfile.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +8,19 @@
 #include "chat.h"
 #include "chat_net.h"
 #include "common.h"
+#include "eq.h"
+#include "gain.h"
+#include "latency.h"
 #include "metadata.h"
 #include "net.h"
+#include "opus_stream.h"
+#include "prebuffer.h"
+#include "recorder.h"
 #include "render.h"
 #include "settings.h"
+#include "standby.h"
 #include "stream.h"
+#include "timeshift.h"
 
 // global state
 volatile bool s_quit            = false;
@@ -50,9 +57,19 @@ int main(void) {
     // register username variable (chat_store.username is in chat.h)
     settings_register_string("username", chat_store.username,
                              sizeof(chat_store.username));
+    audio_register_settings();
+    timeshift_register_settings();
+    latency_register_settings();
+    stream_register_settings();
+    standby_register_settings();
+    net_register_settings();
 
     // settings_load overwrites the default username set in chat_init()
     settings_load();
+    net_configure_tls();
+
+    // time to first audio counts from here
+    prebuffer_reset();
 
     // audio/stream
     StreamQueue streamQ;
@@ -60,106 +77,239 @@ int main(void) {
 
     if (stream_queue_init(&streamQ, STREAM_BUF_SIZE)) {
         streamQ.net = &streamNetCtx;
-        streamQ.url = STREAM_URL;
+        // the built-in stream first, then mirrors and lower bitrates from
+        // settings
+        stream_queue_add_url(&streamQ, STREAM_URL);
+        stream_queue_add_configured_urls(&streamQ);
+
+        // record to sd, tees off the download thread
+        static Recorder recorder;
+        Thread recordTh = NULL;
+        if (recorder_init(&recorder)) {
+            recordTh = threadCreate(recorder_thread, &recorder,
+                                    RECORDER_STACK_SIZE, THREAD_PRIO_RECORDER,
+                                    -1, false);
+            if (recordTh)
+                streamQ.recorder = &recorder;
+            else
+                recorder_free(&recorder);
+        }
+
+        // second connection to fall back on when the first one stalls
+        static Standby standby;
+        static SecureCtx standbyNetCtx;
+        if (standby_enabled() && standby_init(&standby, &standbyNetCtx))
+            streamQ.standby = &standby;
 
         // start background download thread
         Thread streamTh =
             threadCreate(stream_download_thread, &streamQ, STREAM_STACK_SIZE,
                          THREAD_PRIO_STREAM, -1, false);
 
-        // blocks until enough data is buffered to read headers
-        OggOpusFile *of =
-            op_open_callbacks(&streamQ, &STREAM_CALLBACKS, NULL, 0, NULL);
-
-        if (of) {
-            if (audio_init()) {
-                // threads
-                Thread decoderTh =
-                    threadCreate(audio_decoder_thread, of, DECODER_STACK_SIZE,
-                                 THREAD_PRIO_DECODER, -1, false);
-                Thread audioTh =
-                    threadCreate(audio_thread, NULL, AUDIO_STACK_SIZE,
-                                 THREAD_PRIO_AUDIO, -1, false);
-                Thread chatTh =
-                    threadCreate(chat_net_thread, NULL, CHAT_STACK_SIZE,
-                                 THREAD_PRIO_CHAT, -1, false);
-                Thread metaTh = threadCreate(metadata_thread_func, NULL,
-                                             METADATA_STACK_SIZE,
-                                             THREAD_PRIO_METADATA, -1, false);
-
-                // main loop
-                static char swkbd_buf[256];
-
-                while (aptMainLoop()) {
-                    hidScanInput();
-                    u32 kDown = hidKeysDown();
-
-                    if (kDown & KEY_START)
-                        break;
-
-                    // username input
-                    if (kDown & KEY_Y) {
-                        SwkbdState swkbd;
-                        swkbdInit(&swkbd, SWKBD_TYPE_NORMAL, 2, 30);
-                        swkbdSetHintText(&swkbd, "Enter Username");
-                        swkbdSetInitialText(&swkbd, chat_store.username);
-                        if (swkbdInputText(&swkbd, swkbd_buf,
-                                           sizeof(swkbd_buf)) ==
-                            SWKBD_BUTTON_CONFIRM) {
-                            chat_set_username(swkbd_buf);
-                            settings_save(); // manually save since the
-                                             // registered variable was modified
-                        }
+        // pause and rewind, the decoder reads through the time-shift
+        // store when it is enabled
+        static TimeShift timeShift;
+        Thread shiftTh = NULL;
+        if (timeshift_budget() &&
+            timeshift_init(&timeShift, &streamQ, timeshift_budget())) {
+            shiftTh = threadCreate(timeshift_ingest_thread, &timeShift,
+                                   STREAM_STACK_SIZE, THREAD_PRIO_STREAM, -1,
+                                   false);
+            if (!shiftTh)
+                timeshift_free(&timeShift);
+        }
+
+        // the decoder thread opens it once the headers have arrived
+        static OpusStream opusStream;
+        static AudioSource source;
+        source.read = shiftTh ? timeshift_read : stream_queue_read;
+        source.user = shiftTh ? (void *) &timeShift : (void *) &streamQ;
+        source.os   = &opusStream;
+
+        // a starved read returns so the decoder can conceal the gap
+        // instead of blocking, opening the stream just keeps waiting
+        if (shiftTh)
+            timeshift_set_stall_timeout(&timeShift, STREAM_STALL_TIMEOUT_MS);
+        else
+            stream_queue_set_stall_timeout(&streamQ, STREAM_STALL_TIMEOUT_MS);
+
+        latency_init(&streamQ, audio_get_sample_rate());
+
+        if (audio_init()) {
+            // threads
+            Thread decoderTh =
+                threadCreate(audio_decoder_thread, &source, DECODER_STACK_SIZE,
+                             THREAD_PRIO_DECODER, -1, false);
+            Thread audioTh = threadCreate(audio_thread, NULL, AUDIO_STACK_SIZE,
+                                          THREAD_PRIO_AUDIO, -1, false);
+            Thread chatTh =
+                threadCreate(chat_net_thread, NULL, CHAT_STACK_SIZE,
+                             THREAD_PRIO_CHAT, -1, false);
+            Thread metaTh = threadCreate(metadata_thread_func, NULL,
+                                         METADATA_STACK_SIZE,
+                                         THREAD_PRIO_METADATA, -1, false);
+
+            // main loop
+            static char swkbd_buf[256];
+            u64 lastStatsLog = osGetTime();
+            u64 saveAt       = 0; // pending settings save, 0 if none
+
+            while (aptMainLoop()) {
+                hidScanInput();
+                u32 kDown = hidKeysDown();
+
+                if (kDown & KEY_START)
+                    break;
+
+                // software volume, ramped by the decoder
+                if (kDown & (KEY_DUP | KEY_DDOWN)) {
+                    int step = (kDown & KEY_DUP) ? 10 : -10;
+                    gain_set_volume(gain_get_volume() + step);
+                    saveAt = osGetTime() + SETTINGS_SAVE_DELAY_MS;
+                }
+
+                // eq on or off, the bands come from the settings file
+                if (kDown & KEY_DRIGHT) {
+                    eq_set_enabled(!eq_is_enabled());
+                    saveAt = osGetTime() + SETTINGS_SAVE_DELAY_MS;
+                }
+
+                // a run of presses is written to sd once
+                if (saveAt && osGetTime() >= saveAt) {
+                    saveAt = 0;
+                    settings_save();
+                }
+
+                if (kDown & KEY_SELECT)
+                    gain_set_mute(!gain_is_muted());
+
+                // start or stop recording the stream to sd
+                if (recordTh && (kDown & KEY_X))
+                    recorder_set_active(&recorder,
+                                        !recorder_is_active(&recorder));
+
+                // pause, the time-shift store keeps recording. with it
+                // we stay behind until R, without it resume catches up
+                if (kDown & KEY_B) {
+                    bool paused = !audio_is_paused();
+                    audio_set_paused(paused);
+                    if (paused || !shiftTh)
+                        latency_set_hold(paused);
+                }
+
+                // rewind 10s or back to live, queued pcm is dropped so
+                // the jump is heard right away
+                if (shiftTh && (kDown & (KEY_L | KEY_R))) {
+                    latency_set_hold(kDown & KEY_L);
+                    if (kDown & KEY_L)
+                        timeshift_seek_behind(
+                            &timeShift,
+                            timeshift_behind_ms(&timeShift) + 10000);
+                    else
+                        timeshift_jump_live(&timeShift);
+                    audio_flush();
+                }
+
+                // periodic pipeline telemetry
+                if ((osGetTime() - lastStatsLog) * 1000000ULL >=
+                    STATS_LOG_INTERVAL_NS) {
+                    lastStatsLog = osGetTime();
+                    audio_log_stats();
+                    latency_log_stats();
+                    stream_queue_log_stats(&streamQ);
+                    net_log_stats();
+                    if (shiftTh)
+                        timeshift_log_stats(&timeShift);
+                    if (recordTh)
+                        recorder_log_stats(&recorder);
+                }
+
+                // username input
+                if (kDown & KEY_Y) {
+                    SwkbdState swkbd;
+                    swkbdInit(&swkbd, SWKBD_TYPE_NORMAL, 2, 30);
+                    swkbdSetHintText(&swkbd, "Enter Username");
+                    swkbdSetInitialText(&swkbd, chat_store.username);
+                    if (swkbdInputText(&swkbd, swkbd_buf,
+                                       sizeof(swkbd_buf)) ==
+                        SWKBD_BUTTON_CONFIRM) {
+                        chat_set_username(swkbd_buf);
+                        settings_save(); // manually save since the
+                                         // registered variable was modified
                     }
+                }
 
-                    // chat message input
-                    if (kDown & KEY_A) {
-                        SwkbdState swkbd;
-                        swkbdInit(&swkbd, SWKBD_TYPE_NORMAL, 3, -1);
-                        swkbdSetHintText(&swkbd, "Chat Message...");
-                        if (swkbdInputText(&swkbd, swkbd_buf,
-                                           sizeof(swkbd_buf)) ==
-                            SWKBD_BUTTON_CONFIRM) {
-                            chat_send_message(swkbd_buf, NULL);
-                        }
+                // chat message input
+                if (kDown & KEY_A) {
+                    SwkbdState swkbd;
+                    swkbdInit(&swkbd, SWKBD_TYPE_NORMAL, 3, -1);
+                    swkbdSetHintText(&swkbd, "Chat Message...");
+                    if (swkbdInputText(&swkbd, swkbd_buf,
+                                       sizeof(swkbd_buf)) ==
+                        SWKBD_BUTTON_CONFIRM) {
+                        chat_send_message(swkbd_buf, NULL);
                     }
+                }
 
 #ifdef RENDER_FPS_CAP
-                    static int frame_tick = 0;
-                    frame_tick++;
-                    int skip = 60 / RENDER_FPS_CAP;
-                    if (skip < 1)
-                        skip = 1;
-
-                    if (frame_tick % skip != 0) {
-                        gspWaitForVBlank();
-                        continue;
-                    }
-#endif
+                static int frame_tick = 0;
+                frame_tick++;
+                int skip = 60 / RENDER_FPS_CAP;
+                if (skip < 1)
+                    skip = 1;
 
-                    render_chat();
+                if (frame_tick % skip != 0) {
+                    gspWaitForVBlank();
+                    continue;
                 }
+#endif
 
-                // cleanup
-                s_quit       = true;
-                streamQ.quit = true; // signal stream explicitly
+                render_chat();
+            }
 
-                // signal audio thread to wake up and see exit flag
-                audio_signal_exit();
+            if (saveAt)
+                settings_save();
 
-                LightEvent_Signal(&streamQ.canRead);
-                LightEvent_Signal(&streamQ.canWrite);
+            // cleanup
+            s_quit       = true;
+            streamQ.quit = true; // signal stream explicitly
 
-                threadJoin(decoderTh, UINT64_MAX);
-                threadJoin(audioTh, UINT64_MAX);
-                threadJoin(chatTh, UINT64_MAX);
-                threadJoin(streamTh, UINT64_MAX);
-                threadJoin(metaTh, UINT64_MAX);
+            // signal audio thread to wake up and see exit flag
+            audio_signal_exit();
 
-                audio_exit(); // ndsp exit
-            }
-            op_free(of);
+            LightEvent_Signal(&streamQ.canRead);
+            LightEvent_Signal(&streamQ.canWrite);
+            if (shiftTh)
+                timeshift_signal_exit(&timeShift);
+
+            threadJoin(decoderTh, UINT64_MAX);
+            threadJoin(audioTh, UINT64_MAX);
+            threadJoin(chatTh, UINT64_MAX);
+            threadJoin(streamTh, UINT64_MAX);
+            threadJoin(metaTh, UINT64_MAX);
+
+            audio_exit(); // ndsp exit
         }
+        opus_stream_close(&opusStream);
+
+        if (shiftTh) {
+            // also covers audio_init failing
+            streamQ.quit = true;
+            LightEvent_Signal(&streamQ.canRead);
+            timeshift_signal_exit(&timeShift);
+            threadJoin(shiftTh, UINT64_MAX);
+            timeshift_free(&timeShift);
+        }
+
+        if (recordTh) {
+            // closes the file on the way out
+            recorder_signal_exit(&recorder);
+            threadJoin(recordTh, UINT64_MAX);
+            recorder_free(&recorder);
+        }
+
+        if (streamQ.standby)
+            standby_free(&standby);
 
         stream_queue_free(&streamQ);
     }
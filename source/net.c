@@ -1,50 +1,113 @@
 #include "net.h"
+#include "http.h"
+#include "settings.h"
+#include <mbedtls/ecp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 static uint32_t *SOC_buffer = NULL;
 
+// tls sessions by host, shared by every connection so a repeat connect
+// does an abbreviated handshake
 typedef struct {
-    char host[256];
-    char path[512];
-    char port[6];
-} ParsedUrl;
-
-static bool parse_url(const char *url, ParsedUrl *out) {
-    if (!url || !out) return false;
-    memset(out, 0, sizeof(ParsedUrl));
-
-    const char *prefix = "https://";
-    if (strncmp(url, prefix, 8) != 0) return false; // only https
-
-    const char *domain_start = url + 8;
-    const char *path_start   = strchr(domain_start, '/');
+    char host[128];
+    char port[8];
+    mbedtls_ssl_session session;
+    bool valid;
+    u64 lastUsed;
+} CachedSession;
+
+static CachedSession s_sessions[NET_SESSION_CACHE];
+static LightLock s_sessionLock;
+static NetStats s_stats;
+
+// tls setup shared by every connection. the config is read-only once
+// connections use it, the drbg is not thread-safe and sits behind a lock.
+static struct {
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    LightLock drbgLock;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt cacert;
+    bool ready;
+} s_tls;
+
+// preference lists, cheapest on the arm11 first. there are no aes
+// instructions, so chacha20-poly1305 decrypts the stream for a fraction of
+// what aes-gcm costs, and x25519 is the quickest key exchange. everything
+// else mbedtls supports is still offered after them, for servers that
+// have none of these. tools/tls_bench.c measures the options.
+static char s_tlsSuites[512] =
+    "TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256,"
+    "TLS-ECDHE-RSA-WITH-CHACHA20-POLY1305-SHA256,"
+    "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256,"
+    "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256,"
+    "TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384,"
+    "TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256,"
+    "TLS-RSA-WITH-AES-128-GCM-SHA256";
+static char s_tlsCurves[96] = "x25519,secp256r1,secp384r1";
+
+// zero and MBEDTLS_ECP_DP_NONE terminated, the config points into them
+static int *s_suiteIds                  = NULL;
+static mbedtls_ecp_group_id *s_curveIds = NULL;
+
+static int locked_random(void *p, unsigned char *out, size_t len) {
+    (void) p;
+    LightLock_Lock(&s_tls.drbgLock);
+    int ret = mbedtls_ctr_drbg_random(&s_tls.drbg, out, len);
+    LightLock_Unlock(&s_tls.drbgLock);
+    return ret;
+}
 
-    size_t host_len = path_start ? (size_t)(path_start - domain_start) : strlen(domain_start);
-    if (host_len >= sizeof(out->host)) return false;
+static void tls_free(void) {
+    mbedtls_ssl_config_free(&s_tls.conf);
+    mbedtls_x509_crt_free(&s_tls.cacert);
+    mbedtls_ctr_drbg_free(&s_tls.drbg);
+    mbedtls_entropy_free(&s_tls.entropy);
+    free(s_suiteIds);
+    free(s_curveIds);
+    s_suiteIds  = NULL;
+    s_curveIds  = NULL;
+    s_tls.ready = false;
+}
 
-    memcpy(out->host, domain_start, host_len);
-    out->host[host_len] = '\0';
+// seed the drbg and build the client config once
+static bool tls_init(void) {
+    LightLock_Init(&s_tls.drbgLock);
+    mbedtls_entropy_init(&s_tls.entropy);
+    mbedtls_ctr_drbg_init(&s_tls.drbg);
+    mbedtls_ssl_config_init(&s_tls.conf);
+    mbedtls_x509_crt_init(&s_tls.cacert);
 
-    if (path_start) {
-        size_t path_len = strlen(path_start);
-        if (path_len >= sizeof(out->path)) return false;
-        strncpy(out->path, path_start, sizeof(out->path) - 1);
-        out->path[sizeof(out->path)-1] = '\0';
-    } else {
-        strncpy(out->path, "/", sizeof(out->path)-1);
-        out->path[sizeof(out->path)-1] = '\0';
+    const char *pers = "3ds_net";
+    if (mbedtls_ctr_drbg_seed(&s_tls.drbg, mbedtls_entropy_func,
+                              &s_tls.entropy, (const unsigned char *) pers,
+                              strlen(pers)) != 0 ||
+        mbedtls_ssl_config_defaults(&s_tls.conf, MBEDTLS_SSL_IS_CLIENT,
+                                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+        tls_free();
+        return false;
     }
 
-    // default HTTPS port
-    strncpy(out->port, "443", sizeof(out->port)-1);
-    out->port[sizeof(out->port)-1] = '\0';
+    mbedtls_ssl_conf_authmode(&s_tls.conf, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_ca_chain(&s_tls.conf, &s_tls.cacert, NULL);
+    mbedtls_ssl_conf_rng(&s_tls.conf, locked_random, NULL);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&s_tls.conf,
+                                     MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
 
+    s_tls.ready = true;
     return true;
 }
 
 int net_init(void) {
+    LightLock_Init(&s_sessionLock);
+    for (int i = 0; i < NET_SESSION_CACHE; i++)
+        mbedtls_ssl_session_init(&s_sessions[i].session);
+
     SOC_buffer = (uint32_t *) memalign(SOC_ALIGN, SOC_BUFFERSIZE);
 
     if (!SOC_buffer) {
@@ -57,10 +120,24 @@ int net_init(void) {
         return -2;
     }
 
+    if (!tls_init()) {
+        socExit();
+        free(SOC_buffer);
+        SOC_buffer = NULL;
+        printf("TLS init failed\n");
+        return -3;
+    }
+
     return 0;
 }
 
 void net_exit(void) {
+    for (int i = 0; i < NET_SESSION_CACHE; i++) {
+        mbedtls_ssl_session_free(&s_sessions[i].session);
+        s_sessions[i].valid = false;
+    }
+    tls_free();
+
     socExit();
     if (SOC_buffer) {
         free(SOC_buffer);
@@ -74,10 +151,6 @@ void cleanup_ssl(SecureCtx *ctx) {
     if (ctx->fd.fd != -1) mbedtls_net_free(&ctx->fd);
 
     mbedtls_ssl_free(&ctx->ssl);
-    mbedtls_ssl_config_free(&ctx->conf);
-    mbedtls_ctr_drbg_free(&ctx->ctr_drbg);
-    mbedtls_entropy_free(&ctx->entropy);
-    mbedtls_x509_crt_free(&ctx->cacert);
 
     if (ctx->pushBuf) {
         free(ctx->pushBuf);
@@ -85,32 +158,214 @@ void cleanup_ssl(SecureCtx *ctx) {
     }
 }
 
-bool connect_ssl(SecureCtx *ctx, const char *host, const char *port) {
-    memset(ctx, 0, sizeof(SecureCtx));
+// called with the lock held
+static CachedSession *find_session(const char *host, const char *port) {
+    for (int i = 0; i < NET_SESSION_CACHE; i++) {
+        CachedSession *c = &s_sessions[i];
+        if (c->valid && strcmp(c->host, host) == 0 &&
+            strcmp(c->port, port) == 0)
+            return c;
+    }
+    return NULL;
+}
 
-    mbedtls_net_init(&ctx->fd);
-    mbedtls_ssl_init(&ctx->ssl);
-    mbedtls_ssl_config_init(&ctx->conf);
-    mbedtls_x509_crt_init(&ctx->cacert);
-    mbedtls_ctr_drbg_init(&ctx->ctr_drbg);
-    mbedtls_entropy_init(&ctx->entropy);
+// offer the saved session for host, returns false if there is none
+static bool offer_session(SecureCtx *ctx, const char *host, const char *port) {
+    bool offered = false;
+    LightLock_Lock(&s_sessionLock);
+    CachedSession *c = find_session(host, port);
+    if (c && mbedtls_ssl_set_session(&ctx->ssl, &c->session) == 0) {
+        c->lastUsed = osGetTime();
+        offered     = true;
+    }
+    LightLock_Unlock(&s_sessionLock);
+    return offered;
+}
 
-    const char *pers = "3ds_net";
-    if (mbedtls_ctr_drbg_seed(&ctx->ctr_drbg, mbedtls_entropy_func, &ctx->entropy,
-                             (const unsigned char *)pers, strlen(pers)) != 0) {
-        cleanup_ssl(ctx);
+// keep the session of a finished handshake, replacing the least recently
+// used host when the cache is full
+static void save_session(SecureCtx *ctx, const char *host, const char *port) {
+    if (strlen(host) >= sizeof(s_sessions[0].host) ||
+        strlen(port) >= sizeof(s_sessions[0].port))
+        return;
+
+    LightLock_Lock(&s_sessionLock);
+    CachedSession *c = find_session(host, port);
+    for (int i = 0; !c && i < NET_SESSION_CACHE; i++) {
+        if (!s_sessions[i].valid)
+            c = &s_sessions[i];
+    }
+    if (!c) {
+        c = &s_sessions[0];
+        for (int i = 1; i < NET_SESSION_CACHE; i++) {
+            if (s_sessions[i].lastUsed < c->lastUsed)
+                c = &s_sessions[i];
+        }
+    }
+
+    mbedtls_ssl_session_free(&c->session);
+    mbedtls_ssl_session_init(&c->session);
+    c->valid = mbedtls_ssl_get_session(&ctx->ssl, &c->session) == 0;
+    strcpy(c->host, host);
+    strcpy(c->port, port);
+    c->lastUsed = osGetTime();
+    LightLock_Unlock(&s_sessionLock);
+}
+
+static void count_handshake(bool resumed, uint32_t ms) {
+    LightLock_Lock(&s_sessionLock);
+    if (resumed) {
+        s_stats.resumedHandshakes++;
+        s_stats.resumedMs += ms;
+    } else {
+        s_stats.fullHandshakes++;
+        s_stats.fullMs += ms;
+    }
+    s_stats.lastMs = ms;
+    LightLock_Unlock(&s_sessionLock);
+}
+
+void net_get_stats(NetStats *out) {
+    LightLock_Lock(&s_sessionLock);
+    memcpy(out, &s_stats, sizeof(NetStats));
+    LightLock_Unlock(&s_sessionLock);
+}
+
+void net_log_stats(void) {
+    NetStats st;
+    net_get_stats(&st);
+
+    log_debug("net: %lu full handshakes (avg %lu ms), %lu resumed (avg %lu "
+              "ms), last %lu ms",
+              (unsigned long) st.fullHandshakes,
+              (unsigned long) (st.fullHandshakes
+                                   ? st.fullMs / st.fullHandshakes
+                                   : 0),
+              (unsigned long) st.resumedHandshakes,
+              (unsigned long) (st.resumedHandshakes
+                                   ? st.resumedMs / st.resumedHandshakes
+                                   : 0),
+              (unsigned long) st.lastMs);
+}
+
+void net_register_settings(void) {
+    settings_register_string("tls_ciphersuites", s_tlsSuites,
+                             sizeof(s_tlsSuites));
+    settings_register_string("tls_curves", s_tlsCurves, sizeof(s_tlsCurves));
+}
+
+// copy the next name of a comma separated list, false at the end
+static bool next_name(const char **p, char *name, size_t size) {
+    while (**p == ',' || **p == ' ')
+        (*p)++;
+    if (!**p)
         return false;
+
+    size_t n = 0;
+    for (; **p && **p != ',' && **p != ' '; (*p)++) {
+        if (n + 1 < size)
+            name[n++] = **p;
     }
-                            
+    name[n] = 0;
+    return true;
+}
 
-    mbedtls_ssl_config_defaults(&ctx->conf, MBEDTLS_SSL_IS_CLIENT,
-                                MBEDTLS_SSL_TRANSPORT_STREAM,
-                                MBEDTLS_SSL_PRESET_DEFAULT);
-    mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_NONE);
-    mbedtls_ssl_conf_rng(&ctx->conf, mbedtls_ctr_drbg_random, &ctx->ctr_drbg);
+// the preferred suites, then the rest of what this mbedtls build offers in
+// its own order. returns how many were preferred.
+static int order_suites(void) {
+    const int *all = mbedtls_ssl_list_ciphersuites();
+    int total      = 0;
+    while (all[total])
+        total++;
+
+    s_suiteIds = malloc((NET_MAX_SUITES + total + 1) * sizeof(int));
+    if (!s_suiteIds)
+        return 0;
+
+    // names this mbedtls build doesn't know are skipped
+    char name[64];
+    const char *p = s_tlsSuites;
+    int preferred = 0;
+    while (preferred < NET_MAX_SUITES && next_name(&p, name, sizeof(name))) {
+        int id = mbedtls_ssl_get_ciphersuite_id(name);
+        if (id)
+            s_suiteIds[preferred++] = id;
+        else
+            log_debug("net: unknown cipher suite %s", name);
+    }
 
+    int n = preferred;
+    for (int i = 0; i < total; i++) {
+        int k = 0;
+        while (k < preferred && s_suiteIds[k] != all[i])
+            k++;
+        if (k == preferred)
+            s_suiteIds[n++] = all[i];
+    }
+    s_suiteIds[n] = 0;
+    return preferred;
+}
+
+// same for the curves
+static int order_curves(void) {
+    const mbedtls_ecp_group_id *all = mbedtls_ecp_grp_id_list();
+    int total                       = 0;
+    while (all[total] != MBEDTLS_ECP_DP_NONE)
+        total++;
+
+    s_curveIds = malloc((NET_MAX_CURVES + total + 1) *
+                        sizeof(mbedtls_ecp_group_id));
+    if (!s_curveIds)
+        return 0;
+
+    char name[64];
+    const char *p = s_tlsCurves;
+    int preferred = 0;
+    while (preferred < NET_MAX_CURVES && next_name(&p, name, sizeof(name))) {
+        const mbedtls_ecp_curve_info *info =
+            mbedtls_ecp_curve_info_from_name(name);
+        if (info)
+            s_curveIds[preferred++] = info->grp_id;
+        else
+            log_debug("net: unknown curve %s", name);
+    }
+
+    int n = preferred;
+    for (int i = 0; i < total; i++) {
+        int k = 0;
+        while (k < preferred && s_curveIds[k] != all[i])
+            k++;
+        if (k == preferred)
+            s_curveIds[n++] = all[i];
+    }
+    s_curveIds[n] = MBEDTLS_ECP_DP_NONE;
+    return preferred;
+}
 
-    if (mbedtls_ssl_setup(&ctx->ssl, &ctx->conf) != 0 ||
+void net_configure_tls(void) {
+    if (!s_tls.ready || s_suiteIds)
+        return;
+
+    // if the lists can't be built the config keeps mbedtls' defaults
+    int suites = order_suites();
+    if (s_suiteIds)
+        mbedtls_ssl_conf_ciphersuites(&s_tls.conf, s_suiteIds);
+    int curves = order_curves();
+    if (s_curveIds)
+        mbedtls_ssl_conf_curves(&s_tls.conf, s_curveIds);
+
+    log_debug("net: %d preferred cipher suites, %d preferred curves", suites,
+              curves);
+}
+
+bool connect_ssl(SecureCtx *ctx, const char *host, const char *port) {
+    memset(ctx, 0, sizeof(SecureCtx));
+
+    mbedtls_net_init(&ctx->fd);
+    mbedtls_ssl_init(&ctx->ssl);
+
+    // only the ssl context and socket are per connection
+    if (!s_tls.ready || mbedtls_ssl_setup(&ctx->ssl, &s_tls.conf) != 0 ||
         mbedtls_ssl_set_hostname(&ctx->ssl, host) != 0) {
         cleanup_ssl(ctx);
         return false;
@@ -123,11 +378,24 @@ bool connect_ssl(SecureCtx *ctx, const char *host, const char *port) {
 
     mbedtls_ssl_set_bio(&ctx->ssl, &ctx->fd, mbedtls_net_send, mbedtls_net_recv, NULL);
 
-    int handshake_ret;
+    bool offered = offer_session(ctx, host, port);
+    u64 started  = osGetTime();
+
+    // stepped by hand to see which way the handshake went. a resumed one,
+    // by session id or by ticket, goes from the server hello straight to
+    // change cipher spec and never gets the server's certificate.
+    bool fullHandshake              = false;
     int retry_count                 = 0;
     const int MAX_HANDSHAKE_RETRIES = 500; // 5 seconds timeout
 
-    while ((handshake_ret = mbedtls_ssl_handshake(&ctx->ssl)) != 0) {
+    while (ctx->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        if (ctx->ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE)
+            fullHandshake = true;
+
+        int handshake_ret = mbedtls_ssl_handshake_step(&ctx->ssl);
+        if (handshake_ret == 0)
+            continue;
+
         if (handshake_ret != MBEDTLS_ERR_SSL_WANT_READ &&
             handshake_ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
             // fatal error
@@ -144,9 +412,32 @@ bool connect_ssl(SecureCtx *ctx, const char *host, const char *port) {
         svcSleepThread(10 * 1000 * 1000); // 10ms between retries
     }
 
+    save_session(ctx, host, port);
+    count_handshake(!fullHandshake, (uint32_t) (osGetTime() - started));
+    if (offered && fullHandshake)
+        log_debug("net: %s declined session resumption", host);
+
     return true;
 }
 
+// the shared config holds no per-connection read timeout, these take it
+// from the SecureCtx instead
+static int send_ctx(void *p, const unsigned char *buf, size_t len) {
+    return mbedtls_net_send(&((SecureCtx *) p)->fd, buf, len);
+}
+
+static int recv_ctx_timeout(void *p, unsigned char *buf, size_t len,
+                            uint32_t timeout) {
+    (void) timeout;
+    SecureCtx *ctx = (SecureCtx *) p;
+    return mbedtls_net_recv_timeout(&ctx->fd, buf, len, ctx->readTimeoutMs);
+}
+
+void net_set_read_timeout(SecureCtx *ctx, uint32_t ms) {
+    ctx->readTimeoutMs = ms;
+    mbedtls_ssl_set_bio(&ctx->ssl, ctx, send_ctx, NULL, recv_ctx_timeout);
+}
+
 static int net_write_all(SecureCtx *ctx, const uint8_t *data, size_t len) {
     size_t written = 0;
     while (written < len) {
@@ -228,48 +519,41 @@ bool net_download(const char *url, uint8_t **outBuf, size_t *outSize) {
     *outBuf = NULL;
     *outSize = 0;
 
-    ParsedUrl parsed;
-    if (!parse_url(url, &parsed)) return false;
+    // initial buffer, grown once the length is known
+    size_t capacity = 32 * 1024;
+    uint8_t *buf = malloc(capacity + 1);
+    if (!buf) return false;
 
     SecureCtx ctx;
-    if (!connect_ssl(&ctx, parsed.host, parsed.port)) return false;
-
-    // build GET request
-    char req[1024];
-    int len = snprintf(req, sizeof(req),
-                       "GET %s HTTP/1.1\r\n"
-                       "Host: %s\r\n"
-                       "User-Agent: %s\r\n"
-                       "Connection: close\r\n\r\n",
-                       parsed.path, parsed.host, HTTP_USER_AGENT);
-
-    if (len < 0 || len >= (int)sizeof(req)) {
-        cleanup_ssl(&ctx);
+    HttpParser http = {0};
+    size_t total = 0;
+    if (!http_open(&ctx, url, &http, buf, capacity, &total)) {
+        free(buf);
         return false;
     }
 
-    if (net_write_all(&ctx, (uint8_t *)req, len) < 0) {
+    const size_t max_size = 16 * 1024 * 1024; // max 16 MB
+    if (http.contentLength > (int64_t)max_size) {
         cleanup_ssl(&ctx);
+        free(buf);
         return false;
     }
-
-    // initial buffer
-    size_t capacity = 32 * 1024;
-    size_t total = 0;
-    uint8_t *buf = malloc(capacity);
-    if (!buf) {
-        cleanup_ssl(&ctx);
-        return false;
+    if (http.contentLength > (int64_t)capacity) {
+        uint8_t *tmp = realloc(buf, (size_t)http.contentLength + 1);
+        if (tmp) {
+            buf = tmp;
+            capacity = (size_t)http.contentLength;
+        }
     }
 
-    int header_end = -1;
-    while (1) {
+    bool ok = true;
+    while (!http_body_done(&http)) {
         // grow buffer if needed
         if (total >= capacity) {
             size_t new_cap = capacity * 2;
-            if (new_cap > 16 * 1024 * 1024) break; // max 16 MB
-            uint8_t *tmp = realloc(buf, new_cap);
-            if (!tmp) break;
+            if (new_cap > max_size) { ok = false; break; }
+            uint8_t *tmp = realloc(buf, new_cap + 1);
+            if (!tmp) { ok = false; break; }
             buf = tmp;
             capacity = new_cap;
         }
@@ -279,39 +563,28 @@ bool net_download(const char *url, uint8_t **outBuf, size_t *outSize) {
             svcSleepThread(1 * 1000 * 1000); // 1ms wait
             continue;
         }
-        if (r <= 0) break; // EOF or error
-
-        total += r;
-
-        // look for end of HTTP headers
-        if (header_end == -1) {
-            for (size_t i = 0; i + 3 < total; i++) {
-                if (memcmp(buf + i, "\r\n\r\n", 4) == 0) {
-                    header_end = i + 4;
-                    break;
-                }
-            }
+        if (r <= 0) {
+            // without a length or chunks the body ends with the connection
+            ok = (r == 0 || r == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) &&
+                 http.contentLength < 0 && !http.chunked;
+            break;
         }
+
+        // body bytes are decoded in place (chunked framing removed)
+        int n = http_parser_feed(&http, buf + total, r);
+        if (n < 0) { ok = false; break; }
+        total += n;
     }
 
     cleanup_ssl(&ctx);
 
-    if (header_end != -1 && total > (size_t)header_end) {
-        size_t body_size = total - header_end;
-        uint8_t *body = malloc(body_size + 1);
-        if (!body) {
-            free(buf);
-            return false;
-        }
-        memcpy(body, buf + header_end, body_size);
-        body[body_size] = 0; // null-terminate
+    if (!ok || total == 0) {
         free(buf);
-
-        *outBuf = body;
-        *outSize = body_size;
-        return true;
+        return false;
     }
 
-    free(buf);
-    return false;
+    buf[total] = 0; // null-terminate
+    *outBuf = buf;
+    *outSize = total;
+    return true;
 }
\ No newline at end of file
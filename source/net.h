@@ -13,13 +13,16 @@
 #define NET_TIMEOUT_MS   5000
 #define HTTP_USER_AGENT  "3DS_Tripletail_FM/1.0"
 
+#define NET_SESSION_CACHE 4 // hosts whose tls session is kept for resumption
+#define NET_MAX_SUITES 16 // preferred ones, the rest follow in mbedtls' order
+#define NET_MAX_CURVES 8
+
+// one connection. the ssl config, rng and ca chain are shared by all of
+// them and built once in net_init.
 typedef struct {
     mbedtls_net_context fd;
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
     mbedtls_ssl_context ssl;
-    mbedtls_ssl_config conf;
-    mbedtls_x509_crt cacert;
+    uint32_t readTimeoutMs; // see net_set_read_timeout
 
     // for stream only (http partial reads)
     uint8_t *pushBuf;
@@ -27,15 +30,37 @@ typedef struct {
     size_t pushPos;
 } SecureCtx;
 
+typedef struct {
+    uint32_t fullHandshakes;
+    uint32_t resumedHandshakes;
+    uint64_t fullMs; // total time spent in each kind
+    uint64_t resumedMs;
+    uint32_t lastMs;
+} NetStats;
+
 int net_init(void);
+
+// the tls_ciphersuites and tls_curves settings
+void net_register_settings(void);
+
+// apply them to the shared tls config, before the first connection
+void net_configure_tls(void);
 void net_exit(void);
 bool connect_ssl(SecureCtx *ctx, const char *host, const char *port);
 void cleanup_ssl(SecureCtx *ctx);
+// reads on the connection give up with MBEDTLS_ERR_SSL_TIMEOUT after ms
+void net_set_read_timeout(SecureCtx *ctx, uint32_t ms);
 int read_exact(SecureCtx *ctx, uint8_t *buf, int len);
 void net_send_ws(SecureCtx *ctx, const char *text);
 void net_send_ws_frame(SecureCtx *ctx, int opcode, const uint8_t *data,
                        size_t len);
 
+// snapshot of the handshake counters
+void net_get_stats(NetStats *out);
+
+// write the counters to the debug log
+void net_log_stats(void);
+
 // buffer is null-terminated (size+1) just in case it's text, but outSize is
 // actual data size
 bool net_download(const char *url, uint8_t **outBuf, size_t *outSize);
@@ -0,0 +1,101 @@
+#ifndef OGG_H
+#define OGG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// minimal ogg demuxer, just enough for a live opus stream.
+// pages are pulled with exactly sized reads so a blocking source never has
+// to produce more bytes than the page it is currently delivering.
+
+#define OGG_HEADER_SIZE 27
+#define OGG_MAX_PAGE_SIZE (OGG_HEADER_SIZE + 255 + 255 * 255)
+
+#define OGG_FLAG_CONTINUED 0x01
+#define OGG_FLAG_BOS 0x02
+#define OGG_FLAG_EOS 0x04
+
+// same contract as the opusfile read callback: returns bytes read, 0 on eof
+// and a negative value on error. OGG_READ_STALLED means no data arrived in
+// time, the reader keeps what it has and the call can be repeated later.
+// OGG_READ_BOUNDARY means the source switched to a new physical stream
+// (reconnect), whatever was partially read before it is dropped.
+#define OGG_READ_STALLED -2
+#define OGG_READ_BOUNDARY -3
+
+typedef int (*OggReadFunc)(void *user, unsigned char *ptr, int nbytes);
+
+typedef struct {
+    const uint8_t *data; // valid until the next call into the reader
+    size_t len;
+    uint32_t serial;
+    int64_t granule; // granule of the page if this packet ends it, else -1
+    bool bos;        // first packet of a logical stream
+    bool eos;
+    bool hole; // data was lost right before this packet
+} OggPacket;
+
+typedef struct {
+    const uint8_t *data; // whole page, valid until the next call
+    size_t len;
+    uint32_t serial;
+    uint32_t seq;
+    int64_t granule;
+    uint8_t flags;
+} OggPage;
+
+typedef struct {
+    OggReadFunc read;
+    void *user;
+
+    // current page
+    uint8_t *page;
+    size_t pageFill; // bytes of the next page read so far
+    size_t spare;    // bytes read past the current page while resyncing
+    size_t headerLen; // header + lacing table
+    size_t pageLen;   // header + lacing table + body
+    int nsegs;
+    int seg;        // next lacing entry
+    size_t bodyPos; // offset of the next segment in page
+    bool havePage;
+    uint8_t flags;
+    int64_t granule;
+    uint32_t serial;
+    uint32_t seq;
+
+    // continuity
+    bool haveLast;
+    uint32_t lastSerial;
+    uint32_t lastSeq;
+    bool hole;
+
+    // packets spanning pages are assembled here
+    uint8_t *packet;
+    size_t packetLen;
+    size_t packetCap;
+    bool packetPartial;
+
+    uint32_t badPages; // crc or version mismatch
+} OggReader;
+
+bool ogg_reader_init(OggReader *r, OggReadFunc read, void *user);
+void ogg_reader_free(OggReader *r);
+
+// forget the current page and any partial packet
+void ogg_reader_reset(OggReader *r);
+
+// returns 1 when pkt was filled, 0 on end of stream, OGG_READ_STALLED when
+// the source ran dry mid-page (call again to resume), OGG_READ_BOUNDARY
+// once when a new physical stream starts or another negative value on
+// error
+int ogg_reader_next_packet(OggReader *r, OggPacket *pkt);
+
+// raw pages with a valid checksum instead of packets, same return values.
+// a reader is used for one or the other, never both.
+int ogg_reader_next_page(OggReader *r, OggPage *page);
+
+// crc used by ogg page checksums
+uint32_t ogg_crc(uint32_t crc, const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,246 @@
+#include "opus_stream.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define OPUS_HEAD_SIZE 19
+
+bool opus_stream_rate_valid(int rate) {
+    return rate == 48000 || rate == 24000 || rate == 16000 || rate == 12000 ||
+           rate == 8000;
+}
+
+static bool is_head(const OggPacket *pkt) {
+    return pkt->len >= 8 && memcmp(pkt->data, "OpusHead", 8) == 0;
+}
+
+static bool is_tags(const OggPacket *pkt) {
+    return pkt->len >= 8 && memcmp(pkt->data, "OpusTags", 8) == 0;
+}
+
+// parse OpusHead and (re)create the decoder for a new logical stream
+static bool setup_stream(OpusStream *os, const OggPacket *pkt) {
+    const uint8_t *h = pkt->data;
+
+    if (pkt->len < OPUS_HEAD_SIZE || (h[8] & 0xF0) != 0) {
+        log_debug("opus: bad OpusHead");
+        return false;
+    }
+
+    int channels  = h[9];
+    int preSkip   = h[10] | (h[11] << 8);
+    int16_t gain  = (int16_t) (h[16] | (h[17] << 8));
+    int mapFamily = h[18];
+
+    // family 0 only (mono/stereo), enough for the radio
+    if (mapFamily != 0 || channels < 1 || channels > 2) {
+        log_debug("opus: unsupported mapping %d, %d channels", mapFamily,
+                  channels);
+        return false;
+    }
+
+    int err = OPUS_OK;
+    if (os->dec) {
+        err = opus_decoder_init(os->dec, os->rate, 2);
+    } else {
+        // a stereo decoder upmixes mono streams on its own
+        os->dec = opus_decoder_create(os->rate, 2, &err);
+    }
+    if (err != OPUS_OK || !os->dec) {
+        log_debug("opus: decoder init failed (%d)", err);
+        return false;
+    }
+
+    opus_decoder_ctl(os->dec, OPUS_SET_GAIN(gain));
+
+    os->channels   = channels;
+    os->serial     = pkt->serial;
+    os->preSkip    = preSkip / (48000 / os->rate); // pre-skip is at 48 kHz
+    os->granule    = -1;
+    os->pcmLen     = 0;
+    os->pcmPos     = 0;
+    os->haveHead   = true;
+    os->expectTags = true;
+    return true;
+}
+
+bool opus_stream_open(OpusStream *os, OggReadFunc read, void *user, int rate) {
+    memset(os, 0, sizeof(OpusStream));
+
+    if (!opus_stream_rate_valid(rate))
+        rate = 48000;
+    os->rate      = rate;
+    os->maxFrames = rate / 1000 * OPUS_STREAM_MAX_FRAME_MS;
+
+    if (!ogg_reader_init(&os->ogg, read, user))
+        return false;
+
+    os->xfadeFrames = rate / 1000 * OPUS_STREAM_XFADE_MS; // 2.5ms multiple
+
+    os->pcm   = malloc(os->maxFrames * 2 * sizeof(int16_t));
+    os->xfade = malloc(os->xfadeFrames * 2 * sizeof(int16_t));
+    if (!os->pcm || !os->xfade) {
+        opus_stream_close(os);
+        return false;
+    }
+
+    // the first OpusHead we see starts the stream
+    OggPacket pkt;
+    while (!os->haveHead) {
+        int rc = ogg_reader_next_packet(&os->ogg, &pkt);
+        if (rc == OGG_READ_STALLED || rc == OGG_READ_BOUNDARY)
+            continue; // nothing to conceal or blend yet, keep waiting
+        if (rc <= 0 ||
+            (pkt.bos && is_head(&pkt) && !setup_stream(os, &pkt))) {
+            opus_stream_close(os);
+            return false;
+        }
+    }
+
+    log_debug("opus: decoding at %d Hz, %d channel(s)", os->rate,
+              os->channels);
+    return true;
+}
+
+void opus_stream_close(OpusStream *os) {
+    if (os->dec) {
+        opus_decoder_destroy(os->dec);
+        os->dec = NULL;
+    }
+    if (os->pcm) {
+        free(os->pcm);
+        os->pcm = NULL;
+    }
+    if (os->xfade) {
+        free(os->xfade);
+        os->xfade = NULL;
+    }
+    ogg_reader_free(&os->ogg);
+}
+
+// continue the current signal with plc into xfade, to fade out of later
+static void save_tail(OpusStream *os) {
+    os->blend = os->dec && opus_decode(os->dec, NULL, 0, os->xfade,
+                                       os->xfadeFrames, 0) > 0;
+}
+
+// linear blend from the saved tail into freshly decoded pcm
+static void crossfade(OpusStream *os, int16_t *pcm, int n) {
+    int len = os->xfadeFrames < n ? os->xfadeFrames : n;
+    for (int i = 0; i < len; i++) {
+        int w = (i << 15) / len; // Q15 weight of the new signal
+        for (int c = 0; c < 2; c++) {
+            int32_t from = os->xfade[i * 2 + c];
+            int32_t to   = pcm[i * 2 + c];
+            pcm[i * 2 + c] = (int16_t) ((to * w + from * (32768 - w)) >> 15);
+        }
+    }
+
+    // only used once per tail
+    os->blend = false;
+}
+
+int opus_stream_conceal(OpusStream *os, int16_t *pcm, int frames) {
+    int quantum = os->rate / 400; // 2.5ms, the opus frame granularity
+    frames      = frames / quantum * quantum;
+    if (frames <= 0 || !os->dec || !os->haveHead)
+        return 0;
+
+    int n = opus_decode(os->dec, NULL, 0, pcm, frames, 0);
+    if (n <= 0)
+        return 0;
+
+    os->concealed = true;
+    return n;
+}
+
+// hand out frames left over from the last packet
+static int drain_pcm(OpusStream *os, int16_t *pcm, int maxFrames) {
+    int n = os->pcmLen < maxFrames ? os->pcmLen : maxFrames;
+    memcpy(pcm, os->pcm + os->pcmPos * 2, n * 2 * sizeof(int16_t));
+    os->pcmPos += n;
+    os->pcmLen -= n;
+    return n;
+}
+
+int opus_stream_read(OpusStream *os, int16_t *pcm, int maxFrames) {
+    if (maxFrames <= 0)
+        return 0;
+
+    if (os->pcmLen > 0)
+        return drain_pcm(os, pcm, maxFrames);
+
+    for (;;) {
+        OggPacket pkt;
+        int rc = ogg_reader_next_packet(&os->ogg, &pkt);
+        if (rc == OGG_READ_STALLED)
+            return OPUS_STREAM_STALLED;
+
+        if (rc == OGG_READ_BOUNDARY) {
+            // reconnected. keep the old signal's tail and wait for the new
+            // chain's OpusHead, even if it reuses the old serial
+            if (os->haveHead && !os->blend)
+                save_tail(os);
+            os->concealed = false;
+            os->haveHead  = false;
+            os->chains++;
+            continue;
+        }
+
+        if (rc <= 0)
+            return OPUS_STREAM_EOF;
+
+        if (!os->haveHead || pkt.serial != os->serial) {
+            // a new chain starts with its own OpusHead, anything else is a
+            // stream we do not care about
+            if (pkt.bos && is_head(&pkt) && !setup_stream(os, &pkt))
+                return OPUS_STREAM_ERROR;
+            continue;
+        }
+
+        if (os->expectTags) {
+            os->expectTags = false;
+            if (is_tags(&pkt))
+                continue;
+        }
+
+        if (pkt.hole)
+            os->holes++;
+        if (pkt.granule >= 0)
+            os->granule = pkt.granule;
+
+        int frames = opus_packet_get_nb_samples(pkt.data, pkt.len, os->rate);
+        if (frames <= 0 || frames > os->maxFrames)
+            return OPUS_STREAM_HOLE;
+
+        if (os->concealed) {
+            // extend the concealment a little to fade out of it
+            save_tail(os);
+            os->concealed = false;
+        }
+
+        // decode straight into the caller's buffer when the whole packet
+        // fits and nothing has to be trimmed or blended
+        if (frames <= maxFrames && os->preSkip == 0 && !os->blend) {
+            int n = opus_decode(os->dec, pkt.data, pkt.len, pcm, maxFrames, 0);
+            return n < 0 ? OPUS_STREAM_HOLE : n;
+        }
+
+        int n = opus_decode(os->dec, pkt.data, pkt.len, os->pcm, os->maxFrames,
+                            0);
+        if (n < 0)
+            return OPUS_STREAM_HOLE;
+
+        int skip = os->preSkip < n ? os->preSkip : n;
+        os->preSkip -= skip;
+        os->pcmPos = skip;
+        os->pcmLen = n - skip;
+
+        // blend into the first audible frames, after the pre-skip
+        if (os->blend && os->pcmLen > 0)
+            crossfade(os, os->pcm + skip * 2, os->pcmLen);
+
+        if (os->pcmLen > 0)
+            return drain_pcm(os, pcm, maxFrames);
+    }
+}
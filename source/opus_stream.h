@@ -0,0 +1,70 @@
+#ifndef OPUS_STREAM_H
+#define OPUS_STREAM_H
+
+#include "ogg.h"
+#include <opus.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// ogg opus decoding on top of libopus, replaces opusfile so the output rate
+// can be picked (opus decodes natively at 48, 24, 16, 12 and 8 kHz) and the
+// decoder state is reachable.
+
+// read results besides a positive frame count
+#define OPUS_STREAM_EOF 0
+#define OPUS_STREAM_HOLE -1  // a packet could not be decoded, keep reading
+#define OPUS_STREAM_ERROR -2 // unsupported stream or out of memory
+#define OPUS_STREAM_STALLED -3 // source ran dry, conceal or retry later
+
+#define OPUS_STREAM_MAX_FRAME_MS 120
+#define OPUS_STREAM_XFADE_MS 5 // blend from concealment or an old chain
+
+typedef struct {
+    OggReader ogg;
+    OpusDecoder *dec;
+
+    int rate;        // output rate
+    int channels;    // channels in the stream, output is always stereo
+    uint32_t serial; // logical stream being decoded
+    bool haveHead;
+    bool expectTags; // next packet of the stream is OpusTags
+    int preSkip;     // output frames still to drop
+    int64_t granule; // end of the last decoded page at 48 kHz, -1 unknown
+
+    // decoded frames that did not fit the caller's buffer
+    int16_t *pcm;
+    int maxFrames;
+    int pcmPos;
+    int pcmLen;
+
+    // concealment, see opus_stream_conceal()
+    bool concealed; // last output was synthesized
+    bool blend;     // xfade holds a tail to fade out of
+    int16_t *xfade;
+    int xfadeFrames;
+
+    uint32_t holes;  // packets lost in transport
+    uint32_t chains; // physical streams switched to after a reconnect
+} OpusStream;
+
+// checks that rate is one opus can decode at
+bool opus_stream_rate_valid(int rate);
+
+// reads and parses the stream headers, blocks until they arrive
+bool opus_stream_open(OpusStream *os, OggReadFunc read, void *user, int rate);
+void opus_stream_close(OpusStream *os);
+
+// decodes interleaved stereo int16 at the output rate. returns frames
+// written (at most maxFrames) or one of the OPUS_STREAM_ codes.
+int opus_stream_read(OpusStream *os, int16_t *pcm, int maxFrames);
+
+// synthesize frames with opus packet loss concealment while no data is
+// available. frames is rounded down to a multiple of 2.5ms. the next real
+// packet is crossfaded in. must be called from the thread that reads.
+//
+// reconnects are handled the same way: at a stream boundary the old
+// decoder's concealment is kept as a tail, the decoder is re-initialized
+// from the next OpusHead and its first output is crossfaded with the tail.
+int opus_stream_conceal(OpusStream *os, int16_t *pcm, int frames);
+
+#endif
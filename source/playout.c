@@ -0,0 +1,98 @@
+#include "playout.h"
+#include <string.h>
+
+// must cover every wavebuf that can be in flight at once
+#define PLAYOUT_HISTORY 16
+
+// version is the submission number + 1, written last by the feeder and
+// checked twice by readers, so a torn entry is never used
+typedef struct {
+    uint32_t version;
+    ndspWaveBuf *buf;
+    uint64_t start; // absolute index of the first frame in buf
+} PlayoutEntry;
+
+static PlayoutEntry s_entries[PLAYOUT_HISTORY];
+static uint32_t s_submitted = 0; // feeder only
+static uint64_t s_nextFrame = 0; // feeder only
+static uint64_t s_decoded   = 0; // decoder adds, feeder drops, anyone reads
+static int s_rate           = 48000;
+
+void playout_reset(int rate) {
+    memset(s_entries, 0, sizeof(s_entries));
+    s_submitted = 0;
+    s_nextFrame = 0;
+    s_decoded   = 0;
+    s_rate      = rate;
+}
+
+void playout_submit(ndspWaveBuf *buf) {
+    PlayoutEntry *e = &s_entries[s_submitted % PLAYOUT_HISTORY];
+
+    // a release store of 0 only orders what came before it, the fence keeps
+    // the new fields from becoming visible while the old version still is
+    __atomic_store_n(&e->version, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->buf, buf, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->start, s_nextFrame, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->version, ++s_submitted, __ATOMIC_RELEASE);
+
+    s_nextFrame += buf->nsamples;
+}
+
+void playout_decoded(uint32_t frames) {
+    __atomic_add_fetch(&s_decoded, frames, __ATOMIC_RELEASE);
+}
+
+void playout_discard(uint32_t frames) {
+    __atomic_sub_fetch(&s_decoded, frames, __ATOMIC_RELEASE);
+}
+
+bool playout_get(PlayoutPos *out) {
+    // find the playing buffer by the sequence id ndsp reports rather than
+    // guessing from submission order
+    u16 seq = ndspChnGetWaveBufSeq(0);
+    u32 pos = ndspChnGetSamplePos(0);
+    if (seq == 0)
+        return false;
+
+    for (int i = 0; i < PLAYOUT_HISTORY; i++) {
+        PlayoutEntry *e = &s_entries[i];
+
+        uint32_t version = __atomic_load_n(&e->version, __ATOMIC_ACQUIRE);
+        if (version == 0)
+            continue;
+
+        ndspWaveBuf *buf = __atomic_load_n(&e->buf, __ATOMIC_RELAXED);
+        uint64_t start   = __atomic_load_n(&e->start, __ATOMIC_RELAXED);
+        u16 bufSeq       = buf->sequence_id;
+        u8 status        = buf->status;
+
+        // the reads above have to finish before the re-check
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->version, __ATOMIC_RELAXED) != version)
+            continue; // recycled while we looked at it
+        if (bufSeq != seq || status != NDSP_WBUF_PLAYING)
+            continue;
+
+        if (pos >= buf->nsamples)
+            pos = buf->nsamples - 1;
+
+        out->frame        = start + pos;
+        out->decoded      = __atomic_load_n(&s_decoded, __ATOMIC_ACQUIRE);
+        out->rate         = s_rate;
+        out->buffer       = buf->data_pcm16;
+        out->bufferFrames = buf->nsamples;
+        out->offset       = pos;
+        return true;
+    }
+
+    return false;
+}
+
+int playout_latency_ms(void) {
+    PlayoutPos pos;
+    if (!playout_get(&pos) || pos.decoded < pos.frame)
+        return 0;
+    return (int) ((pos.decoded - pos.frame) * 1000 / pos.rate);
+}
@@ -0,0 +1,45 @@
+#ifndef PLAYOUT_H
+#define PLAYOUT_H
+
+#include <3ds.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// playout clock. the feeder registers every wavebuf it hands to ndsp along
+// with the absolute index of its first frame, readers combine that with the
+// wavebuf sequence and sample position ndsp reports to find the frame the
+// listener is hearing right now. frame indices count decoder output from
+// the start of playback, so they map 1:1 onto decoded (or concealed) audio
+// that reached ndsp.
+
+typedef struct {
+    uint64_t frame;   // absolute index of the frame being played
+    uint64_t decoded; // frames the decoder has produced so far
+    int rate;
+
+    // wavebuf being played, interleaved stereo
+    int16_t *buffer;
+    uint32_t bufferFrames;
+    uint32_t offset; // position of frame inside buffer
+} PlayoutPos;
+
+// start a new timeline, only while the feeder and decoder are stopped
+void playout_reset(int rate);
+
+// feeder side, right after ndspChnWaveBufAdd()
+void playout_submit(ndspWaveBuf *buf);
+
+// decoder side, before publishing frames to the feeder
+void playout_decoded(uint32_t frames);
+
+// decoded frames that were dropped instead of submitted (flush). they never
+// get a frame index, so the next submitted frame follows the last one played.
+void playout_discard(uint32_t frames);
+
+// any thread. false while nothing is playing (startup or underrun)
+bool playout_get(PlayoutPos *out);
+
+// audio the listener has not heard yet, decoder output to speaker
+int playout_latency_ms(void);
+
+#endif
@@ -0,0 +1,109 @@
+#include "prebuffer.h"
+#include "settings.h"
+#include <3ds.h>
+
+#define PREBUFFER_MARGIN_MS 60     // on top of the gap estimate
+#define PREBUFFER_GROW_MS 60000    // growing phase after the start
+#define PREBUFFER_STEADY_FACTOR 2  // steady cushion in gaps
+
+static int s_minMs     = 100;   // never start with less
+static int s_maxMs     = 1000;  // never wait for more
+static bool s_slowdown = false; // play at PREBUFFER_SLOWDOWN while growing
+
+// written by the download thread, read by the audio threads
+static volatile u64 s_launchMs    = 0;
+static volatile u64 s_firstByteMs = 0;
+static volatile u64 s_lastByteMs  = 0;
+static volatile u64 s_bytes       = 0;
+static volatile int s_gapMs       = 0; // decaying max of arrival gaps
+
+static u64 s_openMs  = 0;
+static u64 s_startMs = 0;
+
+void prebuffer_register_settings(void) {
+    settings_register_int("prebuffer_min_ms", &s_minMs);
+    settings_register_int("prebuffer_max_ms", &s_maxMs);
+    settings_register_bool("prebuffer_slowdown", &s_slowdown);
+}
+
+void prebuffer_reset(void) {
+    s_launchMs    = osGetTime();
+    s_firstByteMs = 0;
+    s_lastByteMs  = 0;
+    s_bytes       = 0;
+    s_gapMs       = 0;
+    s_openMs      = 0;
+    s_startMs     = 0;
+}
+
+void prebuffer_note_arrival(size_t bytes) {
+    u64 now = osGetTime();
+
+    if (s_firstByteMs == 0) {
+        s_firstByteMs = now;
+    } else {
+        // a new longest gap counts right away, old ones fade out slowly
+        int gap = (int) (now - s_lastByteMs);
+        int old = s_gapMs;
+        s_gapMs = gap > old ? gap : old - (old >> 6);
+    }
+
+    s_lastByteMs = now;
+    s_bytes += bytes;
+}
+
+void prebuffer_note_open(void) {
+    s_openMs = osGetTime();
+}
+
+static int clamp_ms(int ms) {
+    if (ms > s_maxMs)
+        ms = s_maxMs;
+    if (ms < s_minMs)
+        ms = s_minMs;
+    return ms;
+}
+
+bool prebuffer_ready(int bufferedMs) {
+    if (bufferedMs >= s_maxMs)
+        return true;
+    if (s_openMs == 0)
+        return false;
+
+    // audio arriving slower than real time needs the full cushion, the
+    // decoder is only limited by the network before playback starts
+    u64 elapsed = osGetTime() - s_openMs;
+    if (elapsed > 0 && (u64) bufferedMs < elapsed)
+        return false;
+
+    return bufferedMs >= clamp_ms(s_gapMs * 3 / 2 + PREBUFFER_MARGIN_MS);
+}
+
+void prebuffer_started(int bufferedMs) {
+    s_startMs = osGetTime();
+
+    u64 bytes   = s_bytes;
+    u64 elapsed = s_lastByteMs - s_firstByteMs;
+    log_debug("startup: first audio after %llu ms (first byte %llu ms, "
+              "headers %llu ms), cushion %d ms, max gap %d ms, %llu kbps",
+              s_startMs - s_launchMs,
+              s_firstByteMs ? s_firstByteMs - s_launchMs : 0,
+              s_openMs ? s_openMs - s_launchMs : 0, bufferedMs, s_gapMs,
+              elapsed ? bytes * 8 / elapsed : 0);
+}
+
+static int steady_ms(void) {
+    return clamp_ms(s_gapMs * PREBUFFER_STEADY_FACTOR + PREBUFFER_MARGIN_MS);
+}
+
+bool prebuffer_refilled(int bufferedMs) {
+    return bufferedMs >= steady_ms();
+}
+
+bool prebuffer_growing(int cushionMs) {
+    if (!s_slowdown || s_startMs == 0 || cushionMs < 0 ||
+        osGetTime() - s_startMs > PREBUFFER_GROW_MS)
+        return false;
+
+    return cushionMs < steady_ms();
+}
@@ -0,0 +1,47 @@
+#ifndef PREBUFFER_H
+#define PREBUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// fast start. playback begins as soon as a small cushion of decoded audio
+// is ready instead of whenever the decoder happens to fill the ring. the
+// cushion is sized from the longest gap between network arrivals seen so
+// far: a connect burst (icecast sends several seconds at once) starts
+// almost right away, a slow or bursty link waits longer. the cushion then
+// grows without touching the output rate: a stall the decoder conceals
+// leaves what arrives after it queued on top, and after an audible underrun
+// playback only resumes once the steady cushion of twice the gap is ready.
+// the prebuffer_slowdown setting additionally plays slightly slow for a
+// while after the start. that drops the pitch by about 17 cents, audible on
+// sustained tones, so it is off by default.
+
+#define PREBUFFER_SLOWDOWN 0.99f // output rate while growing, if enabled
+
+// register settings, call before settings_load()
+void prebuffer_register_settings(void);
+
+// launch time, the start of time to first audio
+void prebuffer_reset(void);
+
+// download thread, for every chunk received
+void prebuffer_note_arrival(size_t bytes);
+
+// decoder thread, the stream headers were parsed
+void prebuffer_note_open(void);
+
+// feeder side, true once bufferedMs of decoded audio is enough to start
+bool prebuffer_ready(int bufferedMs);
+
+// feeder side, the first buffer went out. logs time to first audio.
+void prebuffer_started(int bufferedMs);
+
+// feeder side, true once bufferedMs is enough to resume after an underrun
+bool prebuffer_refilled(int bufferedMs);
+
+// decoder side, output should run at PREBUFFER_SLOWDOWN. cushionMs is
+// the audio received but not heard yet, -1 if unknown. always false unless
+// the prebuffer_slowdown setting is on.
+bool prebuffer_growing(int cushionMs);
+
+#endif
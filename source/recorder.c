@@ -0,0 +1,292 @@
+#include "recorder.h"
+#include "settings.h"
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define RECORD_DIR "sdmc:/tripletail"
+#define RECORD_ALIGN 0x1000  // batch buffer, sd sector and cache friendly
+#define RECORD_IDLE_MS 500   // writer checks for start/stop this often
+
+static int ring_read(void *user, unsigned char *ptr, int nbytes);
+
+bool recorder_init(Recorder *rec) {
+    memset(rec, 0, sizeof(Recorder));
+
+    rec->head  = malloc(RECORD_HEAD_MAX);
+    rec->batch = memalign(RECORD_ALIGN, RECORD_BATCH_SIZE);
+    if (!rec->head || !rec->batch ||
+        !spsc_ring_init(&rec->ring, RECORD_RING_SIZE) ||
+        !spsc_ring_init(&rec->marks, RECORD_MARKS * sizeof(size_t)) ||
+        !ogg_reader_init(&rec->ogg, ring_read, rec)) {
+        recorder_free(rec);
+        return false;
+    }
+
+    LightEvent_Init(&rec->event, RESET_ONESHOT);
+    LightLock_Init(&rec->statsLock);
+    return true;
+}
+
+void recorder_free(Recorder *rec) {
+    if (rec->head) {
+        free(rec->head);
+        rec->head = NULL;
+    }
+    if (rec->batch) {
+        free(rec->batch);
+        rec->batch = NULL;
+    }
+    spsc_ring_free(&rec->ring);
+    spsc_ring_free(&rec->marks);
+    ogg_reader_free(&rec->ogg);
+}
+
+// producer side, mark the current ring position. false if the marks are
+// full, then nothing may be written until one fits.
+static bool push_mark(Recorder *rec) {
+    size_t at = rec->ring.head;
+    if (at == rec->lastMark)
+        return true; // nothing written since the last mark
+
+    if (spsc_ring_space(&rec->marks) < sizeof(size_t))
+        return false;
+
+    spsc_ring_write(&rec->marks, &at, sizeof(size_t));
+    rec->lastMark = at;
+    return true;
+}
+
+void recorder_feed(Recorder *rec, const uint8_t *data, size_t len) {
+    if (rec->mustMark)
+        rec->mustMark = !push_mark(rec);
+
+    if (!rec->mustMark && spsc_ring_space(&rec->ring) >= len) {
+        spsc_ring_write(&rec->ring, data, len);
+        LightEvent_Signal(&rec->event);
+        return;
+    }
+
+    // the card fell behind. the page this cuts into ends at the mark, the
+    // writer drops it and resyncs on the next one.
+    LightLock_Lock(&rec->statsLock);
+    rec->stats.drops++;
+    rec->stats.droppedBytes += len;
+    LightLock_Unlock(&rec->statsLock);
+    if (!push_mark(rec))
+        rec->mustMark = true;
+}
+
+void recorder_mark_boundary(Recorder *rec) {
+    if (!push_mark(rec))
+        rec->mustMark = true;
+}
+
+// OggReadFunc over the ring, returns OGG_READ_BOUNDARY at a mark and
+// OGG_READ_STALLED when idle so the writer can look at start/stop requests
+static int ring_read(void *user, unsigned char *ptr, int nbytes) {
+    Recorder *rec = (Recorder *) user;
+    if (rec->quit)
+        return -1;
+
+    // data first: a mark is always published before the bytes after it
+    size_t avail = spsc_ring_available(&rec->ring);
+    size_t tail  = rec->ring.tail;
+
+    SpscSpan span;
+    if (spsc_ring_read_reserve(&rec->marks, sizeof(size_t), &span) ==
+        sizeof(size_t)) {
+        // entries never wrap, the ring is a multiple of their size
+        size_t at;
+        memcpy(&at, span.ptr[0], sizeof(size_t));
+        if (at == tail) {
+            spsc_ring_read_commit(&rec->marks, sizeof(size_t));
+            return OGG_READ_BOUNDARY;
+        }
+        if (avail > at - tail)
+            avail = at - tail;
+    }
+
+    if (avail == 0) {
+        LightEvent_WaitTimeout(&rec->event, RECORD_IDLE_MS * 1000000LL);
+        return OGG_READ_STALLED;
+    }
+
+    if (avail > (size_t) nbytes)
+        avail = nbytes;
+    return (int) spsc_ring_read(&rec->ring, ptr, avail);
+}
+
+static void flush_batch(Recorder *rec) {
+    if (!rec->fp || rec->batchFill == 0)
+        return;
+
+    u64 start = svcGetSystemTick();
+    size_t n  = fwrite(rec->batch, 1, rec->batchFill, rec->fp);
+    u64 ticks = svcGetSystemTick() - start;
+    bool ok   = n == rec->batchFill;
+
+    LightLock_Lock(&rec->statsLock);
+    rec->stats.writeTicks += ticks;
+    if (ok)
+        rec->stats.bytesWritten += n;
+    else
+        rec->stats.writeErrors++;
+    LightLock_Unlock(&rec->statsLock);
+
+    if (!ok) {
+        // card full or removed, give up on this recording
+        log_debug("recorder: write failed, stopping");
+        fclose(rec->fp);
+        rec->fp         = NULL;
+        rec->wantActive = false;
+    }
+    rec->batchFill = 0;
+}
+
+static void write_bytes(Recorder *rec, const uint8_t *data, size_t len) {
+    while (len > 0 && rec->fp) {
+        size_t n = RECORD_BATCH_SIZE - rec->batchFill;
+        if (n > len)
+            n = len;
+        memcpy(rec->batch + rec->batchFill, data, n);
+        rec->batchFill += n;
+        data += n;
+        len -= n;
+
+        if (rec->batchFill == RECORD_BATCH_SIZE)
+            flush_batch(rec);
+    }
+}
+
+static bool open_file(Recorder *rec) {
+    mkdir(RECORD_DIR, 0777);
+
+    char name[32], path[64];
+    time_t now = time(NULL);
+    strftime(name, sizeof(name), "rec-%Y%m%d-%H%M%S", localtime(&now));
+
+    // never overwrite, a restart within the same second gets a suffix
+    struct stat st;
+    snprintf(path, sizeof(path), RECORD_DIR "/%s.opus", name);
+    for (int i = 1; stat(path, &st) == 0 && i < 100; i++)
+        snprintf(path, sizeof(path), RECORD_DIR "/%s-%d.opus", name, i);
+
+    rec->fp = fopen(path, "wb");
+    if (!rec->fp) {
+        LightLock_Lock(&rec->statsLock);
+        rec->stats.writeErrors++;
+        LightLock_Unlock(&rec->statsLock);
+        rec->wantActive = false;
+        log_debug("recorder: cannot create %s", path);
+        return false;
+    }
+
+    // writes are already batched, skip the stdio copy
+    setvbuf(rec->fp, NULL, _IONBF, 0);
+    LightLock_Lock(&rec->statsLock);
+    rec->stats.files++;
+    LightLock_Unlock(&rec->statsLock);
+    log_debug("recorder: writing %s", path);
+
+    write_bytes(rec, rec->head, rec->headLen);
+    return true;
+}
+
+static void close_file(Recorder *rec) {
+    flush_batch(rec);
+    if (rec->fp) {
+        fclose(rec->fp);
+        rec->fp = NULL;
+    }
+}
+
+static void handle_page(Recorder *rec, const OggPage *pg) {
+    // keep the bos page and everything up to the page that ends OpusTags,
+    // which is the first later page with granule 0
+    bool bos    = (pg->flags & OGG_FLAG_BOS) != 0;
+    bool inHead = bos || rec->headOpen;
+    if (bos) {
+        rec->headLen      = 0;
+        rec->headOpen     = true;
+        rec->headComplete = false;
+    }
+    if (inHead) {
+        if (rec->headLen + pg->len <= RECORD_HEAD_MAX) {
+            memcpy(rec->head + rec->headLen, pg->data, pg->len);
+            rec->headLen += pg->len;
+            if (!bos && pg->granule == 0) {
+                rec->headOpen     = false;
+                rec->headComplete = true;
+            }
+        } else {
+            // tags too large to keep, only the next chain can start a file
+            rec->headOpen = false;
+            rec->headLen  = 0;
+        }
+    }
+
+    if (rec->fp)
+        write_bytes(rec, pg->data, pg->len);
+    else if (rec->wantActive && rec->headComplete && open_file(rec) &&
+             !inHead)
+        write_bytes(rec, pg->data, pg->len);
+}
+
+void recorder_thread(void *arg) {
+    Recorder *rec = (Recorder *) arg;
+
+    while (!rec->quit) {
+        if (!rec->wantActive && rec->fp)
+            close_file(rec);
+
+        OggPage pg;
+        int rc = ogg_reader_next_page(&rec->ogg, &pg);
+        if (rc == OGG_READ_STALLED || rc == OGG_READ_BOUNDARY)
+            continue;
+        if (rc <= 0)
+            break;
+
+        handle_page(rec, &pg);
+    }
+
+    close_file(rec);
+}
+
+void recorder_set_active(Recorder *rec, bool active) {
+    rec->wantActive = active;
+    LightEvent_Signal(&rec->event);
+}
+
+bool recorder_is_active(Recorder *rec) {
+    return rec->wantActive;
+}
+
+void recorder_signal_exit(Recorder *rec) {
+    rec->quit = true;
+    LightEvent_Signal(&rec->event);
+}
+
+void recorder_get_stats(Recorder *rec, RecorderStats *out) {
+    LightLock_Lock(&rec->statsLock);
+    memcpy(out, &rec->stats, sizeof(RecorderStats));
+    LightLock_Unlock(&rec->statsLock);
+}
+
+void recorder_log_stats(Recorder *rec) {
+    RecorderStats st;
+    recorder_get_stats(rec, &st);
+
+    // sustained card throughput, time spent inside fwrite only
+    u64 kbps = st.writeTicks ? st.bytesWritten * SYSCLOCK_ARM11 /
+                                   st.writeTicks / 1024
+                             : 0;
+
+    log_debug("recorder: %s, %lu files, %llu KB written, sd %llu KB/s, "
+              "dropped %lu chunks (%llu KB), %lu write errors",
+              recorder_is_active(rec) ? "recording" : "idle", (unsigned long) st.files,
+              st.bytesWritten / 1024, kbps, (unsigned long) st.drops,
+              st.droppedBytes / 1024, (unsigned long) st.writeErrors);
+}
@@ -0,0 +1,84 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "ogg.h"
+#include "spsc_ring.h"
+#include <3ds.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// records the raw ogg stream to sdmc:/tripletail/. the download thread tees
+// every received chunk into a lock-free ring and never waits on the card:
+// when the ring is full the chunk is dropped and counted. a writer thread
+// pulls whole pages with a valid checksum out of the ring, so a drop or a
+// reconnect only ever loses complete pages, and writes them in large
+// aligned batches. the current chain's header pages are kept around, so a
+// recording started mid-stream still begins with OpusHead and OpusTags.
+
+#define RECORD_RING_SIZE (256 * 1024) // power of two, ~16s at 128 kbps
+#define RECORD_BATCH_SIZE (64 * 1024) // bytes per fwrite
+#define RECORD_HEAD_MAX (64 * 1024)   // header pages of the current chain
+#define RECORD_MARKS 16               // pending discontinuities
+
+typedef struct {
+    uint32_t files;
+    uint64_t bytesWritten;
+    uint64_t writeTicks;   // spent in fwrite
+    uint32_t drops;        // chunks dropped because the ring was full
+    uint64_t droppedBytes;
+    uint32_t writeErrors;  // a failed write stops the recording
+} RecorderStats;
+
+typedef struct {
+    // download thread -> writer
+    SpscRing ring;
+    SpscRing marks;  // ring offsets where the byte stream is discontinuous
+    size_t lastMark; // producer side, avoids repeated marks
+    bool mustMark;   // producer side, a mark did not fit, drop until it does
+
+    // writer side
+    OggReader ogg;
+    uint8_t *head;
+    size_t headLen;
+    bool headOpen;     // collecting the pages after a bos page
+    bool headComplete; // bos page up to the end of OpusTags is in head
+
+    uint8_t *batch;
+    size_t batchFill;
+    FILE *fp;
+
+    volatile bool wantActive;
+    volatile bool quit;
+    LightEvent event;
+
+    // written by both threads, the 64 bit counters would tear without it
+    LightLock statsLock;
+    RecorderStats stats;
+} Recorder;
+
+bool recorder_init(Recorder *rec);
+void recorder_free(Recorder *rec);
+
+// download thread, never blocks
+void recorder_feed(Recorder *rec, const uint8_t *data, size_t len);
+
+// download thread, the bytes fed next belong to a new connection
+void recorder_mark_boundary(Recorder *rec);
+
+// start or stop writing a file, takes effect on the writer thread
+void recorder_set_active(Recorder *rec, bool active);
+bool recorder_is_active(Recorder *rec);
+
+// writer thread
+void recorder_thread(void *arg);
+
+// wake the writer on quit, it closes the file before returning
+void recorder_signal_exit(Recorder *rec);
+
+void recorder_get_stats(Recorder *rec, RecorderStats *out);
+
+// write the counters to the debug log
+void recorder_log_stats(Recorder *rec);
+
+#endif
@@ -89,7 +89,7 @@ void settings_load(void) {
         return;
     }
 
-    char line[128];
+    char line[512]; // fits a tls cipher suite list
     while (fgets(line, sizeof(line), fp)) {
         // trim whitespace
         char *p = line;
@@ -0,0 +1,134 @@
+#include "spsc_ring.h"
+#include <stdlib.h>
+#include <string.h>
+
+// acquire/release pairs: the producer's data stores are visible before the
+// consumer sees the new head, and the consumer is done reading before the
+// producer sees the new tail.
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+
+bool spsc_ring_init(SpscRing *rb, size_t size) {
+    memset(rb, 0, sizeof(SpscRing));
+
+    if (size == 0 || (size & (size - 1)) != 0)
+        return false;
+
+    rb->buffer = malloc(size);
+    if (!rb->buffer)
+        return false;
+    memset(rb->buffer, 0, size);
+
+    rb->size = size;
+    rb->mask = size - 1;
+    return true;
+}
+
+void spsc_ring_free(SpscRing *rb) {
+    if (rb->buffer) {
+        free(rb->buffer);
+        rb->buffer = NULL;
+    }
+    rb->size = 0;
+    rb->mask = 0;
+    rb->head = 0;
+    rb->tail = 0;
+}
+
+void spsc_ring_reset(SpscRing *rb) {
+    STORE_RELEASE(&rb->head, 0);
+    STORE_RELEASE(&rb->tail, 0);
+}
+
+size_t spsc_ring_available(const SpscRing *rb) {
+    size_t tail = LOAD_ACQUIRE(&rb->tail);
+    size_t head = LOAD_ACQUIRE(&rb->head);
+    return head - tail;
+}
+
+size_t spsc_ring_space(const SpscRing *rb) {
+    return rb->size - spsc_ring_available(rb);
+}
+
+// split [pos, pos + len) into at most two regions
+static void make_span(const SpscRing *rb, size_t pos, size_t len,
+                      SpscSpan *span) {
+    size_t offset     = pos & rb->mask;
+    size_t first_part = rb->size - offset;
+
+    if (len > first_part) {
+        span->ptr[0] = rb->buffer + offset;
+        span->len[0] = first_part;
+        span->ptr[1] = rb->buffer;
+        span->len[1] = len - first_part;
+    } else {
+        span->ptr[0] = rb->buffer + offset;
+        span->len[0] = len;
+        span->ptr[1] = NULL;
+        span->len[1] = 0;
+    }
+}
+
+size_t spsc_ring_write_reserve(SpscRing *rb, size_t max, SpscSpan *span) {
+    size_t head  = LOAD_RELAXED(&rb->head); // we own head
+    size_t tail  = LOAD_ACQUIRE(&rb->tail);
+    size_t space = rb->size - (head - tail);
+
+    if (max > space)
+        max = space;
+
+    make_span(rb, head, max, span);
+    return max;
+}
+
+void spsc_ring_write_commit(SpscRing *rb, size_t n) {
+    size_t head = LOAD_RELAXED(&rb->head);
+    STORE_RELEASE(&rb->head, head + n);
+}
+
+size_t spsc_ring_write(SpscRing *rb, const void *data, size_t size) {
+    SpscSpan span;
+    size = spsc_ring_write_reserve(rb, size, &span);
+    if (size == 0)
+        return 0;
+
+    memcpy(span.ptr[0], data, span.len[0]);
+    if (span.len[1])
+        memcpy(span.ptr[1], (const uint8_t *) data + span.len[0],
+               span.len[1]);
+
+    spsc_ring_write_commit(rb, size);
+    return size;
+}
+
+size_t spsc_ring_read_reserve(SpscRing *rb, size_t max, SpscSpan *span) {
+    size_t tail  = LOAD_RELAXED(&rb->tail); // we own tail
+    size_t head  = LOAD_ACQUIRE(&rb->head);
+    size_t avail = head - tail;
+
+    if (max > avail)
+        max = avail;
+
+    make_span(rb, tail, max, span);
+    return max;
+}
+
+void spsc_ring_read_commit(SpscRing *rb, size_t n) {
+    size_t tail = LOAD_RELAXED(&rb->tail);
+    STORE_RELEASE(&rb->tail, tail + n);
+}
+
+size_t spsc_ring_read(SpscRing *rb, void *dest, size_t size) {
+    SpscSpan span;
+    size = spsc_ring_read_reserve(rb, size, &span);
+    if (size == 0)
+        return 0;
+
+    memcpy(dest, span.ptr[0], span.len[0]);
+    if (span.len[1])
+        memcpy((uint8_t *) dest + span.len[0], span.ptr[1], span.len[1]);
+
+    spsc_ring_read_commit(rb, size);
+    return size;
+}
@@ -0,0 +1,51 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// lock-free single-producer/single-consumer byte ring.
+// head is only written by the producer, tail only by the consumer. both are
+// free-running counters and get masked on access, so size must be a power of
+// two. no locks are taken, so a high priority consumer can never block on a
+// lower priority producer (and vice versa).
+
+// up to two contiguous regions (second one is used when the range wraps)
+typedef struct {
+    uint8_t *ptr[2];
+    size_t len[2];
+} SpscSpan;
+
+typedef struct {
+    uint8_t *buffer;
+    size_t size;
+    size_t mask;
+    size_t head; // total bytes written
+    size_t tail; // total bytes read
+} SpscRing;
+
+// size must be a power of two
+bool spsc_ring_init(SpscRing *rb, size_t size);
+void spsc_ring_free(SpscRing *rb);
+
+// only safe while neither side is running
+void spsc_ring_reset(SpscRing *rb);
+
+// callable from either side, the result is a snapshot
+size_t spsc_ring_available(const SpscRing *rb);
+size_t spsc_ring_space(const SpscRing *rb);
+
+// producer side. reserve returns the number of bytes handed out in span
+// (at most max), commit publishes n of them to the consumer.
+size_t spsc_ring_write_reserve(SpscRing *rb, size_t max, SpscSpan *span);
+void spsc_ring_write_commit(SpscRing *rb, size_t n);
+size_t spsc_ring_write(SpscRing *rb, const void *data, size_t size);
+
+// consumer side. reserve returns the number of readable bytes in span
+// (at most max), commit releases n of them back to the producer.
+size_t spsc_ring_read_reserve(SpscRing *rb, size_t max, SpscSpan *span);
+void spsc_ring_read_commit(SpscRing *rb, size_t n);
+size_t spsc_ring_read(SpscRing *rb, void *dest, size_t size);
+
+#endif
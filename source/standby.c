@@ -0,0 +1,271 @@
+#include "standby.h"
+#include "common.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define READ_SIZE (16 * 1024) // one full tls record per read
+
+static bool s_standby = true;
+
+void standby_register_settings(void) {
+    settings_register_bool("stream_standby", &s_standby);
+}
+
+bool standby_enabled(void) {
+    return s_standby;
+}
+
+bool standby_init(Standby *sb, SecureCtx *spare) {
+    memset(sb, 0, sizeof(Standby));
+    sb->buf = malloc(STANDBY_BUF_SIZE);
+    if (!sb->buf)
+        return false;
+    sb->net = spare;
+    return true;
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int64_t page_granule(const uint8_t *p) {
+    return (int64_t) ((uint64_t) le32(p + 6) | ((uint64_t) le32(p + 10) << 32));
+}
+
+// size of the whole page at data, 0 if it has not all arrived, -1 if data
+// does not start with a page
+static int page_size(const uint8_t *data, size_t len) {
+    if (len < 5)
+        return 0;
+    if (memcmp(data, "OggS", 4) != 0 || data[4] != 0)
+        return -1;
+    if (len < 27 || len < 27 + (size_t) data[26])
+        return 0;
+
+    size_t size = 27 + data[26];
+    for (int i = 0; i < data[26]; i++)
+        size += data[27 + i];
+    return size <= len ? (int) size : 0;
+}
+
+// drop len bytes at off
+static void cut(Standby *sb, size_t off, size_t len) {
+    memmove(sb->buf + off, sb->buf + off + len, sb->len - off - len);
+    sb->len -= len;
+}
+
+// account for the whole pages that came in since the last call
+static void walk_pages(Standby *sb) {
+    while (sb->walked < sb->len) {
+        uint8_t *p  = sb->buf + sb->walked;
+        size_t left = sb->len - sb->walked;
+        int size    = page_size(p, left);
+        if (size == 0)
+            break;
+
+        if (size < 0) {
+            // lost sync, skip to the next capture pattern
+            size_t skip = 1;
+            while (skip + 4 <= left && memcmp(p + skip, "OggS", 4) != 0)
+                skip++;
+            cut(sb, sb->walked, skip);
+            continue;
+        }
+
+        if ((p[5] & 0x02) && sb->walked > 0) {
+            // a new chain, its header pages replace the old ones
+            cut(sb, 0, sb->walked);
+            sb->walked      = 0;
+            sb->headLen     = 0;
+            sb->headersDone = false;
+            continue;
+        }
+
+        if (!sb->headersDone && page_granule(p) == 0)
+            sb->headLen = sb->walked + size;
+        else
+            sb->headersDone = true;
+        sb->walked += size;
+    }
+}
+
+// make room by dropping the oldest whole pages after the headers
+static void trim(Standby *sb) {
+    size_t end = sb->headLen;
+    while (end < sb->walked &&
+           sb->len - (end - sb->headLen) > STANDBY_BUF_SIZE / 2)
+        end += page_size(sb->buf + end, sb->walked - end);
+
+    cut(sb, sb->headLen, end - sb->headLen);
+    sb->walked -= end - sb->headLen;
+}
+
+static void standby_thread(void *arg) {
+    Standby *sb = (Standby *) arg;
+    size_t bodyLen;
+
+    memset(&sb->http, 0, sizeof(HttpParser));
+    if (!http_open(sb->net, sb->url, &sb->http, sb->buf, STANDBY_BUF_SIZE,
+                   &bodyLen)) {
+        log_debug("standby: connect failed");
+        sb->state = STANDBY_EXITED;
+        return;
+    }
+
+    net_set_read_timeout(sb->net, STANDBY_READ_MS);
+    sb->alive = true;
+    sb->len   = bodyLen;
+    walk_pages(sb);
+    sb->state = STANDBY_READY;
+    log_debug("standby: ready");
+
+    // keep reading so the server does not drop us, only the newest pages
+    // are kept
+    while (!sb->stop && !s_quit) {
+        if (STANDBY_BUF_SIZE - sb->len < READ_SIZE)
+            trim(sb);
+        if (STANDBY_BUF_SIZE - sb->len < READ_SIZE)
+            break; // the headers alone fill it
+
+        int ret =
+            mbedtls_ssl_read(&sb->net->ssl, sb->buf + sb->len, READ_SIZE);
+        if (ret == MBEDTLS_ERR_SSL_TIMEOUT)
+            continue;
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            svcSleepThread(10 * 1000 * 1000);
+            continue;
+        }
+        if (ret <= 0)
+            break;
+
+        ret = http_parser_feed(&sb->http, sb->buf + sb->len, ret);
+        if (ret < 0)
+            break;
+        sb->len += ret;
+        walk_pages(sb);
+
+        if (http_body_done(&sb->http))
+            break;
+    }
+
+    // on stop the connection is left open for standby_take, a cancel
+    // closes it right away instead of whenever the thread is joined
+    bool stopped = __atomic_load_n(&sb->stop, __ATOMIC_ACQUIRE);
+    if (!stopped || sb->drop) {
+        log_debug("standby: %s", stopped ? "cancelled" : "connection lost");
+        cleanup_ssl(sb->net);
+        sb->alive = false;
+    }
+    sb->state = STANDBY_EXITED;
+}
+
+static void join(Standby *sb) {
+    if (!sb->thread)
+        return;
+    threadJoin(sb->thread, UINT64_MAX);
+    threadFree(sb->thread);
+    sb->thread = NULL;
+    sb->state  = STANDBY_IDLE;
+}
+
+// join an ended thread and close what it left open
+static void reap(Standby *sb) {
+    join(sb);
+    if (sb->alive) {
+        cleanup_ssl(sb->net);
+        sb->alive = false;
+    }
+}
+
+void standby_free(Standby *sb) {
+    sb->stop = true;
+    reap(sb);
+    if (sb->buf) {
+        free(sb->buf);
+        sb->buf = NULL;
+    }
+}
+
+void standby_start(Standby *sb, const char *url) {
+    if (sb->state == STANDBY_EXITED)
+        reap(sb);
+    if (sb->state != STANDBY_IDLE)
+        return;
+
+    sb->url         = url;
+    sb->len         = 0;
+    sb->headLen     = 0;
+    sb->walked      = 0;
+    sb->headersDone = false;
+    sb->stop        = false;
+    sb->drop        = false;
+    sb->alive       = false;
+    sb->state       = STANDBY_CONNECTING;
+
+    sb->thread = threadCreate(standby_thread, sb, STREAM_STACK_SIZE,
+                              THREAD_PRIO_STREAM, -1, false);
+    if (!sb->thread) {
+        sb->state = STANDBY_IDLE;
+        return;
+    }
+    log_debug("standby: connecting to %s", url);
+}
+
+void standby_cancel(Standby *sb) {
+    if (sb->state == STANDBY_IDLE)
+        return;
+    sb->drop = true;
+    __atomic_store_n(&sb->stop, true, __ATOMIC_RELEASE);
+    if (sb->state == STANDBY_EXITED)
+        reap(sb);
+}
+
+bool standby_ready(const Standby *sb) {
+    return sb->state == STANDBY_READY && !sb->stop;
+}
+
+bool standby_take(Standby *sb, const char *url, SecureCtx **net,
+                  HttpParser *http, uint32_t serial, int64_t granule,
+                  uint8_t **out, size_t *outLen) {
+    if (!standby_ready(sb) || sb->url != url)
+        return false;
+
+    sb->stop = true;
+    join(sb);
+    if (!sb->alive)
+        return false;
+    sb->alive = false;
+
+    // skip the pages the live connection already delivered. a page it
+    // only delivered in part is skipped too, the decoder conceals it.
+    size_t pos = sb->headLen;
+    while (pos < sb->walked) {
+        const uint8_t *p = sb->buf + pos;
+        if (le32(p + 14) != serial || page_granule(p) > granule)
+            break;
+        pos += page_size(p, sb->walked - pos);
+    }
+
+    size_t n     = sb->headLen + (sb->len - pos);
+    uint8_t *buf = malloc(n ? n : 1);
+    if (!buf) {
+        cleanup_ssl(sb->net);
+        return false;
+    }
+    memcpy(buf, sb->buf, sb->headLen);
+    memcpy(buf + sb->headLen, sb->buf + pos, sb->len - pos);
+
+    SecureCtx *live = *net;
+    *net            = sb->net;
+    sb->net         = live;
+    *http           = sb->http;
+    *out            = buf;
+    *outLen         = n;
+    sb->takeovers++;
+
+    log_debug("standby: took over, %u bytes already played skipped",
+              (unsigned) (pos - sb->headLen));
+    return true;
+}
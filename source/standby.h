@@ -0,0 +1,70 @@
+#ifndef STANDBY_H
+#define STANDBY_H
+
+#include "http.h"
+#include "net.h"
+#include <3ds.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// a second connection to the stream, set up in the background while the
+// live one looks unhealthy so a drop costs no dns, tcp or tls handshake.
+// it keeps reading to stay alive and holds the current chain's header
+// pages plus the newest whole pages. on takeover the pages the live
+// connection already delivered are skipped and the rest is spliced in.
+
+#define STANDBY_BUF_SIZE (128 * 1024) // ~8s at 128 kbps
+#define STANDBY_READ_MS 500           // reads give up to check for stop
+
+typedef enum {
+    STANDBY_IDLE,       // no connection, no thread
+    STANDBY_CONNECTING, // thread is connecting
+    STANDBY_READY,      // connected, reading into the buffer
+    STANDBY_EXITED,     // thread ended, not joined yet
+} StandbyState;
+
+typedef struct {
+    SecureCtx *net; // spare context, swapped with the live one on takeover
+    HttpParser http;
+    const char *url;
+
+    uint8_t *buf;
+    size_t len;
+    size_t headLen; // header pages of the current chain at the front
+    size_t walked;  // whole pages end here, a partial one may follow
+    bool headersDone;
+
+    Thread thread;
+    volatile StandbyState state;
+    volatile bool stop;
+    volatile bool drop; // close the connection when the thread ends
+    bool alive;         // connection still open after the thread ended
+
+    uint32_t takeovers;
+} Standby;
+
+void standby_register_settings(void);
+
+// the stream_standby setting
+bool standby_enabled(void);
+
+bool standby_init(Standby *sb, SecureCtx *spare);
+void standby_free(Standby *sb);
+
+// start connecting to url in the background, no-op if already running
+void standby_start(Standby *sb, const char *url);
+
+// close the connection. a running thread closes it as it ends and is
+// joined on the next call.
+void standby_cancel(Standby *sb);
+
+bool standby_ready(const Standby *sb);
+
+// hand the standby connection for url over. *net is swapped with the spare,
+// http continues its response and out gets a malloc'd buffer with the chain
+// headers and the pages after granule of serial. false if it is not ready.
+bool standby_take(Standby *sb, const char *url, SecureCtx **net,
+                  HttpParser *http, uint32_t serial, int64_t granule,
+                  uint8_t **out, size_t *outLen);
+
+#endif
@@ -1,18 +1,50 @@
 #include "stream.h"
 #include "common.h"
+#include "http.h"
+#include "ogg.h"
+#include "prebuffer.h"
+#include "settings.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define CONNECT_READ_SIZE 4096 // response headers and the first body bytes
+
+// endpoint selection
+#define RATE_WINDOW_MS 10000 // receive rate is judged per window
+#define SLOW_PCT 90          // of real time, a window below this is slow
+#define SLOW_WINDOWS 3       // in a row before stepping down the list
+#define STARVED_PCT 70       // too slow to wait for a chain boundary
+#define SWITCH_WAIT_MS 60000 // longest wait for a chain boundary
+#define MAX_FAILURES 3       // failed connects or early drops per host
+#define EARLY_DROP_MS 10000  // a connection lost sooner counts as failed
+#define PROBE_UP_MS (10 * 60 * 1000) // retry the preferred endpoint after
+
+// hot standby
+#define READ_POLL_MS 500       // reads give up this often to check health
+#define STANDBY_STALL_MS 1500  // no bytes for this long, warm up a standby
+#define TAKEOVER_STALL_MS 3000 // and hand over to it after this
+#define STANDBY_IDLE_MS 60000  // healthy this long, drop the standby
+
+static char s_extraUrls[STREAM_MAX_URLS - 1][STREAM_URL_LEN];
+
+void stream_register_settings(void) {
+    static const char *keys[STREAM_MAX_URLS - 1] = {
+        "stream_url_2", "stream_url_3", "stream_url_4"};
+    for (int i = 0; i < STREAM_MAX_URLS - 1; i++)
+        settings_register_string(keys[i], s_extraUrls[i], STREAM_URL_LEN);
+}
+
 bool stream_queue_init(StreamQueue *q, size_t capacity) {
     memset(q, 0, sizeof(StreamQueue));
     q->buffer = malloc(capacity);
     if (!q->buffer)
         return false;
 
-    q->capacity = capacity;
-    q->quit     = false;
-    q->eof      = false;
+    q->capacity    = capacity;
+    q->quit        = false;
+    q->eof         = false;
+    q->liveGranule = -1;
 
     LightLock_Init(&q->lock);
     LightEvent_Init(&q->canRead, RESET_ONESHOT);
@@ -35,59 +67,246 @@ void stream_queue_free(StreamQueue *q) {
     }
 }
 
-static int stream_queue_read(void *user_data, unsigned char *ptr, int nbytes) {
-    StreamQueue *q = (StreamQueue *) user_data;
-    int read       = 0;
+bool stream_queue_add_url(StreamQueue *q, const char *url) {
+    if (!url || !url[0] || q->urlCount >= STREAM_MAX_URLS)
+        return false;
+    q->urls[q->urlCount++] = url;
+    return true;
+}
+
+void stream_queue_add_configured_urls(StreamQueue *q) {
+    for (int i = 0; i < STREAM_MAX_URLS - 1; i++)
+        stream_queue_add_url(q, s_extraUrls[i]);
+}
+
+void stream_queue_get_stats(StreamQueue *q, StreamStats *out) {
+    LightLock_Lock(&q->lock);
+    memcpy(out, &q->stats, sizeof(StreamStats));
+    LightLock_Unlock(&q->lock);
+}
+
+void stream_queue_log_stats(StreamQueue *q) {
+    StreamStats st;
+    stream_queue_get_stats(q, &st);
+
+    char hist[STREAM_FILL_BUCKETS * 11 + 1];
+    int len = 0;
+    for (int i = 0; i < STREAM_FILL_BUCKETS; i++)
+        len += snprintf(hist + len, sizeof(hist) - len, " %lu",
+                        (unsigned long) st.fillHistogram[i]);
+
+    log_debug("stream: starvations %lu (%lu ms), reconnects %lu (last %lu ms, "
+              "max %lu ms), fill%s",
+              (unsigned long) st.starvations, (unsigned long) st.starvedMs,
+              (unsigned long) st.reconnects,
+              (unsigned long) st.lastReconnectMs,
+              (unsigned long) st.maxReconnectMs, hist);
+    log_debug("stream: endpoint %d/%d, %lu kbps (%lu%% of real time), "
+              "switches %lu",
+              q->urlIndex + 1, q->urlCount, (unsigned long) st.rateKbps,
+              (unsigned long) st.realtimePct, (unsigned long) st.switches);
+    if (q->standby)
+        log_debug("stream: standby takeovers %lu",
+                  (unsigned long) q->standby->takeovers);
+}
+
+bool stream_queue_live_edge(StreamQueue *q, uint32_t *serial,
+                            int64_t *granule) {
+    LightLock_Lock(&q->lock);
+    *serial  = q->liveSerial;
+    *granule = q->liveGranule;
+    LightLock_Unlock(&q->lock);
+    return *granule >= 0;
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// find the newest page header in data that ends a packet. a header cut
+// by a chunk border is missed, the next page does just as well.
+static bool sniff_pages(const uint8_t *data, size_t len, uint32_t *serial,
+                        int64_t *granule) {
+    bool found = false;
+    if (len < 18)
+        return false;
+
+    const uint8_t *end = data + len - 18; // serial is the last field read
+    for (const uint8_t *h = data; h <= end; h++) {
+        h = memchr(h, 'O', end - h + 1);
+        if (!h)
+            break;
+        if (memcmp(h, "OggS", 4) != 0 || h[4] != 0)
+            continue;
+
+        int64_t g = (int64_t) ((uint64_t) le32(h + 6) |
+                               ((uint64_t) le32(h + 10) << 32));
+        if (g >= 0) { // -1 means no packet ends on the page
+            *granule = g;
+            *serial  = le32(h + 14);
+            found    = true;
+        }
+    }
+    return found;
+}
+
+// offset of the first page header in data that starts a chain, -1 if none
+static int find_chain_start(const uint8_t *data, size_t len) {
+    if (len < 6)
+        return -1;
+
+    const uint8_t *end = data + len - 6; // header type is the last byte read
+    for (const uint8_t *h = data; h <= end; h++) {
+        h = memchr(h, 'O', end - h + 1);
+        if (!h)
+            break;
+        if (memcmp(h, "OggS", 4) == 0 && h[4] == 0 && (h[5] & 0x02))
+            return (int) (h - data);
+    }
+    return -1;
+}
+
+// called with the lock held
+static void set_live_edge(StreamQueue *q, uint32_t serial, int64_t granule) {
+    q->liveSerial  = serial;
+    q->liveGranule = granule;
+}
 
-    while (nbytes > 0) {
+void stream_queue_set_stall_timeout(StreamQueue *q, int ms) {
+    q->stallTimeoutMs = ms;
+}
+
+static void sample_fill(StreamQueue *q) {
+    LightLock_Lock(&q->lock);
+    size_t bucket = q->count * STREAM_FILL_BUCKETS / q->capacity;
+    if (bucket >= STREAM_FILL_BUCKETS)
+        bucket = STREAM_FILL_BUCKETS - 1;
+    q->stats.fillHistogram[bucket]++;
+    LightLock_Unlock(&q->lock);
+}
+
+// the reader reached the oldest boundary and reports it
+static void pop_boundary(StreamQueue *q) {
+    LightLock_Lock(&q->lock);
+    q->boundaryHead = (q->boundaryHead + 1) % STREAM_MAX_BOUNDARIES;
+    q->boundaryCount--;
+    LightLock_Unlock(&q->lock);
+}
+
+// wait for readable bytes and describe up to max of them in span. a
+// boundary is left in place for the caller to pop. a wait is counted once
+// when it starts, even if it spans many stall timeouts.
+static int wait_span(StreamQueue *q, size_t max, StreamSpan *span) {
+    for (;;) {
         if (q->quit)
             return -1;
 
         LightLock_Lock(&q->lock);
 
+        // never hand out bytes across a reconnect, the tail of the old
+        // stream goes out first and the boundary on its own
+        size_t untilBoundary = (size_t) -1;
+        if (q->boundaryCount > 0) {
+            untilBoundary = q->boundaries[q->boundaryHead] - q->consumed;
+            if (untilBoundary == 0) {
+                LightLock_Unlock(&q->lock);
+                return OGG_READ_BOUNDARY;
+            }
+        }
+
         if (q->count == 0) {
             if (q->eof) {
                 LightLock_Unlock(&q->lock);
-                return read; // EOF
+                return 0; // EOF
             }
 
+            if (q->starvedAt == 0) {
+                q->stats.starvations++;
+                q->starvedAt = osGetTime();
+            }
             LightLock_Unlock(&q->lock);
+
             // wait for data
-            LightEvent_Wait(&q->canRead);
+            if (q->stallTimeoutMs <= 0) {
+                LightEvent_Wait(&q->canRead);
+            } else if (LightEvent_WaitTimeout(
+                           &q->canRead, q->stallTimeoutMs * 1000000LL)) {
+                return OGG_READ_STALLED;
+            }
             continue;
         }
 
-        // read chunk
-        size_t available = q->count;
-        size_t chunk =
-            (available > (size_t) nbytes) ? (size_t) nbytes : available;
-
-        // handle wrap around
-        size_t first_part = q->capacity - q->tail;
-        if (chunk > first_part) {
-            memcpy(ptr, q->buffer + q->tail, first_part);
-            memcpy(ptr + first_part, q->buffer, chunk - first_part);
-            q->tail = chunk - first_part;
-        } else {
-            memcpy(ptr, q->buffer + q->tail, chunk);
-            q->tail += chunk;
-            if (q->tail == q->capacity)
-                q->tail = 0;
+        if (q->starvedAt != 0) {
+            q->stats.starvedMs += osGetTime() - q->starvedAt;
+            q->starvedAt = 0;
         }
 
-        q->count -= chunk;
-        if (q->count == 0) {
-            LightEvent_Clear(&q->canRead);
-        }
+        size_t chunk = q->count < max ? q->count : max;
+        if (chunk > untilBoundary)
+            chunk = untilBoundary;
 
-        // signal space available
-        LightEvent_Signal(&q->canWrite);
+        // only the reader moves tail, so the bytes stay put until consumed
+        size_t first_part = q->capacity - q->tail;
+        if (first_part > chunk)
+            first_part = chunk;
+        span->ptr[0] = q->buffer + q->tail;
+        span->len[0] = first_part;
+        span->ptr[1] = q->buffer;
+        span->len[1] = chunk - first_part;
 
         LightLock_Unlock(&q->lock);
+        return (int) chunk;
+    }
+}
+
+int stream_queue_peek(StreamQueue *q, size_t max, StreamSpan *span) {
+    sample_fill(q);
+
+    int rc = wait_span(q, max, span);
+    if (rc == OGG_READ_BOUNDARY)
+        pop_boundary(q);
+    return rc;
+}
+
+void stream_queue_consume(StreamQueue *q, size_t n) {
+    LightLock_Lock(&q->lock);
+
+    q->tail = (q->tail + n) % q->capacity;
+    q->count -= n;
+    q->consumed += n;
+    if (q->count == 0) {
+        LightEvent_Clear(&q->canRead);
+    }
+
+    // signal space available
+    LightEvent_Signal(&q->canWrite);
+
+    LightLock_Unlock(&q->lock);
+}
 
-        ptr += chunk;
-        read += chunk;
-        nbytes -= chunk;
+int stream_queue_read(void *user_data, unsigned char *ptr, int nbytes) {
+    StreamQueue *q = (StreamQueue *) user_data;
+    int read       = 0;
+
+    sample_fill(q);
+
+    while (read < nbytes) {
+        StreamSpan span;
+        int rc = wait_span(q, nbytes - read, &span);
+
+        if (rc <= 0) {
+            // hand out what was read, a boundary is reported on its own
+            if (read > 0)
+                return read;
+            if (rc == OGG_READ_BOUNDARY)
+                pop_boundary(q);
+            return rc;
+        }
+
+        memcpy(ptr + read, span.ptr[0], span.len[0]);
+        memcpy(ptr + read + span.len[0], span.ptr[1], span.len[1]);
+        stream_queue_consume(q, rc);
+        read += rc;
     }
 
     return read;
@@ -95,6 +314,10 @@ static int stream_queue_read(void *user_data, unsigned char *ptr, int nbytes) {
 
 static void stream_queue_push(StreamQueue *q, const uint8_t *data,
                               size_t size) {
+    uint32_t serial;
+    int64_t granule;
+    bool live = sniff_pages(data, size, &serial, &granule);
+
     size_t written = 0;
     while (written < size && !q->quit) {
         LightLock_Lock(&q->lock);
@@ -123,6 +346,9 @@ static void stream_queue_push(StreamQueue *q, const uint8_t *data,
         }
 
         q->count += chunk;
+        q->written += chunk;
+        if (live && written + chunk == size)
+            set_live_edge(q, serial, granule);
         LightEvent_Signal(&q->canRead);
 
         if (q->count == q->capacity) {
@@ -134,105 +360,246 @@ static void stream_queue_push(StreamQueue *q, const uint8_t *data,
     }
 }
 
-static bool internal_connect(SecureCtx *ctx, const char *url, uint8_t **pushBuf,
-                             size_t *pushSize) {
-    if (strncmp(url, "https://", 8) != 0)
-        return false;
+size_t stream_queue_reserve(StreamQueue *q, uint8_t **ptr) {
+    while (!q->quit) {
+        LightLock_Lock(&q->lock);
 
-    const char *p  = url + 8;
-    char host[256] = {0};
-    char path[256] = "/";
-
-    const char *slash = strchr(p, '/');
-    if (slash) {
-        size_t hostLen = slash - p;
-        if (hostLen > 255)
-            hostLen = 255;
-        memcpy(host, p, hostLen);
-        strncpy(path, slash, 255);
-    } else {
-        strncpy(host, p, 255);
-    }
+        size_t space = q->capacity - q->count;
+        if (space == 0) {
+            LightLock_Unlock(&q->lock);
+            q->waited = true;
+            LightEvent_Wait(&q->canWrite);
+            continue;
+        }
 
-    if (!connect_ssl(ctx, host, "443"))
-        return false;
+        // only the writer moves head, the reader never touches free space
+        size_t first_part = q->capacity - q->head;
+        *ptr              = q->buffer + q->head;
+        LightLock_Unlock(&q->lock);
+        return space < first_part ? space : first_part;
+    }
+    return 0;
+}
 
-    char req[512];
-    int len = snprintf(req, sizeof(req),
-                       "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: 3DS\r\n\r\n",
-                       path, host);
+void stream_queue_commit(StreamQueue *q, size_t n) {
+    // the region is still writer-owned, scan it before taking the lock
+    uint32_t serial;
+    int64_t granule;
+    bool live = sniff_pages(q->buffer + q->head, n, &serial, &granule);
 
-    mbedtls_ssl_write(&ctx->ssl, (unsigned char *) req, len);
+    LightLock_Lock(&q->lock);
 
-    // read headers until \r\n\r\n
-    uint8_t buf[1024];
-    uint8_t *full = NULL;
-    int size = 0, head_end = -1;
+    if (live)
+        set_live_edge(q, serial, granule);
+    q->head = (q->head + n) % q->capacity;
+    q->count += n;
+    q->written += n;
+    LightEvent_Signal(&q->canRead);
 
-    while (head_end < 0) {
-        int r = mbedtls_ssl_read(&ctx->ssl, buf, sizeof(buf));
-        if (r <= 0)
-            break;
+    if (q->count == q->capacity) {
+        LightEvent_Clear(&q->canWrite);
+    }
 
-        uint8_t *new_full = realloc(full, size + r);
-        if (!new_full) {
-            free(full);
-            return false;
-        }
-        full = new_full;
+    LightLock_Unlock(&q->lock);
+}
 
-        memcpy(full + size, buf, r);
-        size += r;
+// called before the first byte of a new connection is pushed
+static void mark_boundary(StreamQueue *q, u64 gapMs) {
+    LightLock_Lock(&q->lock);
 
-        for (int i = 0; i < size - 3; i++) {
-            if (memcmp(full + i, "\r\n\r\n", 4) == 0) {
-                head_end = i + 4;
-                break;
-            }
-        }
+    if (q->boundaryCount < STREAM_MAX_BOUNDARIES) {
+        int idx = (q->boundaryHead + q->boundaryCount) % STREAM_MAX_BOUNDARIES;
+        q->boundaries[idx] = q->written;
+        q->boundaryCount++;
+    } else {
+        // the reader is far behind, move the newest boundary up. the ogg
+        // reader resyncs over the stale bytes in between.
+        int idx = (q->boundaryHead + q->boundaryCount - 1) %
+                  STREAM_MAX_BOUNDARIES;
+        q->boundaries[idx] = q->written;
     }
 
-    if (head_end > 0) {
-        // return remaining data
-        if (size > head_end) {
-            *pushSize = size - head_end;
-            *pushBuf  = malloc(*pushSize);
-            if (*pushBuf)
-                memcpy(*pushBuf, full + head_end, *pushSize);
-        } else {
-            *pushBuf  = NULL;
-            *pushSize = 0;
-        }
-        free(full);
-        return true;
+    q->stats.reconnects++;
+    q->stats.lastReconnectMs = (uint32_t) gapMs;
+    if (q->stats.lastReconnectMs > q->stats.maxReconnectMs)
+        q->stats.maxReconnectMs = q->stats.lastReconnectMs;
+
+    // a reader waiting on an empty queue has to see the boundary
+    LightEvent_Signal(&q->canRead);
+    LightLock_Unlock(&q->lock);
+
+    log_debug("stream: reconnected after %llu ms", (unsigned long long) gapMs);
+}
+
+// connect and read the response headers. the body bytes that came with
+// them are handed back in a malloc'd buffer, the rest goes through http.
+static bool internal_connect(SecureCtx *ctx, const char *url,
+                             HttpParser *http, uint8_t **pushBuf,
+                             size_t *pushSize) {
+    uint8_t *buf = malloc(CONNECT_READ_SIZE);
+    if (!buf)
+        return false;
+
+    if (!http_open(ctx, url, http, buf, CONNECT_READ_SIZE, pushSize)) {
+        free(buf);
+        return false;
     }
+    net_set_read_timeout(ctx, READ_POLL_MS);
+
+    *pushBuf = buf;
+    return true;
+}
+
+// receive rate over a fixed window, held against the audio time covered
+// by the pages that came in meanwhile
+typedef struct {
+    u64 startMs; // 0 until the first byte
+    uint64_t bytes;
+    uint32_t serial;
+    int64_t granule; // live edge at the start, -1 unknown
+} RateWindow;
+
+static void rate_start(StreamQueue *q, RateWindow *w, u64 now) {
+    w->startMs = now;
+    w->bytes   = 0;
+    if (!stream_queue_live_edge(q, &w->serial, &w->granule))
+        w->granule = -1;
+    q->waited = false;
+}
+
+// count n received bytes. at the end of a window returns the percentage of
+// real time it delivered, otherwise -1. also -1 when it can't tell: the
+// queue was full so the reader set the pace, or a new chain started.
+static int rate_update(StreamQueue *q, RateWindow *w, size_t n) {
+    u64 now = osGetTime();
+    if (w->startMs == 0)
+        rate_start(q, w, now);
+    w->bytes += n;
+
+    u64 elapsed = now - w->startMs;
+    if (elapsed < RATE_WINDOW_MS)
+        return -1;
+
+    int pct = -1;
+    uint32_t serial;
+    int64_t granule;
+    if (stream_queue_live_edge(q, &serial, &granule) && !q->waited &&
+        w->granule >= 0 && serial == w->serial && granule >= w->granule)
+        pct = (int) ((granule - w->granule) * 100 / (48 * (int64_t) elapsed));
+
+    LightLock_Lock(&q->lock);
+    q->stats.rateKbps = (uint32_t) (w->bytes * 8 / elapsed);
+    if (pct >= 0)
+        q->stats.realtimePct = (uint32_t) pct;
+    LightLock_Unlock(&q->lock);
+
+    rate_start(q, w, now);
+    return pct;
+}
+
+static void switch_endpoint(StreamQueue *q, int idx) {
+    log_debug("stream: switching from %s to %s", q->urls[q->urlIndex],
+              q->urls[idx]);
+    LightLock_Lock(&q->lock);
+    q->urlIndex = idx;
+    q->stats.switches++;
+    LightLock_Unlock(&q->lock);
+}
 
-    if (full)
-        free(full);
-    return false;
+// a host that keeps failing hands over to the next one, wrapping around
+static void note_failure(StreamQueue *q, int *failures) {
+    if (++*failures < MAX_FAILURES || q->urlCount < 2)
+        return;
+    *failures = 0;
+    switch_endpoint(q, (q->urlIndex + 1) % q->urlCount);
 }
 
 void stream_download_thread(void *arg) {
     StreamQueue *q = (StreamQueue *) arg;
-    if (!q || !q->net)
+    if (!q || !q->net || q->urlCount == 0)
         return;
 
+    bool dropped  = false; // a connection was lost, the next one is new
+    u64 droppedAt = 0;
+    int failures  = 0; // on the current endpoint, in a row
+
     while (!s_quit && !q->quit) {
         // connect
         uint8_t *initData = NULL;
         size_t initSize   = 0;
+        HttpParser http   = {0};
+        const char *url   = q->urls[q->urlIndex];
+
+        // a ready standby picks up after the pages already received
+        bool taken = false;
+        if (q->standby) {
+            uint32_t serial;
+            int64_t granule;
+            stream_queue_live_edge(q, &serial, &granule);
+            taken = standby_take(q->standby, url, &q->net, &http, serial,
+                                 granule, &initData, &initSize);
+            if (!taken)
+                standby_cancel(q->standby);
+        }
+
+        if (taken ||
+            internal_connect(q->net, url, &http, &initData, &initSize)) {
+            u64 connectedAt = osGetTime();
+            RateWindow rate = {0};
+            int slow        = 0;  // slow windows in a row
+            int next        = -1; // endpoint to switch to at a chain start
+            bool urgent     = false;
+            u64 switchAt    = 0;
+            u64 stalledAt   = 0; // first read that timed out, 0 if none
+            u64 troubleAt   = 0; // last stall or slow window
+
+            // the decoder resyncs to the new chain at this point
+            if (dropped) {
+                mark_boundary(q, osGetTime() - droppedAt);
+                if (q->recorder)
+                    recorder_mark_boundary(q->recorder);
+                dropped = false;
+            }
 
-        if (internal_connect(q->net, q->url, &initData, &initSize)) {
             // push initial data
             if (initData && initSize > 0) {
+                prebuffer_note_arrival(initSize);
+                if (q->recorder)
+                    recorder_feed(q->recorder, initData, initSize);
                 stream_queue_push(q, initData, initSize);
-                free(initData);
             }
+            free(initData);
 
-            // loop read
-            uint8_t buf[4096];
+            // loop read, decrypting straight into the queue
             while (!s_quit && !q->quit) {
-                int ret = mbedtls_ssl_read(&q->net->ssl, buf, sizeof(buf));
+                uint8_t *dst;
+                size_t room = stream_queue_reserve(q, &dst);
+                if (room == 0)
+                    break; // quit
+                if (room > STREAM_READ_MAX)
+                    room = STREAM_READ_MAX;
+
+                int ret = mbedtls_ssl_read(&q->net->ssl, dst, room);
+
+                if (ret == MBEDTLS_ERR_SSL_TIMEOUT) {
+                    // nothing came in. warm up a standby if it goes on and
+                    // hand over to it once it is ready
+                    u64 now = osGetTime();
+                    if (stalledAt == 0)
+                        stalledAt = now - READ_POLL_MS;
+                    troubleAt = now;
+                    if (q->standby && next < 0 &&
+                        now - stalledAt >= STANDBY_STALL_MS)
+                        standby_start(q->standby, url);
+                    if (q->standby && standby_ready(q->standby) &&
+                        now - stalledAt >= TAKEOVER_STALL_MS) {
+                        log_debug("stream: stalled for %llu ms",
+                                  (unsigned long long) (now - stalledAt));
+                        break;
+                    }
+                    continue;
+                }
+                stalledAt = 0;
 
                 if (ret == MBEDTLS_ERR_SSL_WANT_READ ||
                     ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
@@ -244,19 +611,88 @@ void stream_download_thread(void *arg) {
                 if (ret <= 0)
                     break; // error or eof
 
-                stream_queue_push(q, buf, ret);
+                // strip chunked framing in place
+                ret = http_parser_feed(&http, dst, ret);
+                if (ret < 0)
+                    break;
+
+                // a pending switch cuts the stream right before the next
+                // chain, which the new endpoint starts with its own
+                bool cut = false;
+                if (next >= 0) {
+                    int chain = find_chain_start(dst, ret);
+                    if (chain >= 0 || urgent ||
+                        osGetTime() - switchAt > SWITCH_WAIT_MS) {
+                        if (chain >= 0)
+                            ret = chain;
+                        cut = true;
+                    }
+                }
+
+                if (q->recorder)
+                    recorder_feed(q->recorder, dst, ret);
+                stream_queue_commit(q, ret);
+                prebuffer_note_arrival(ret);
+
+                if (http_body_done(&http))
+                    break; // the server ended the response
+                if (cut)
+                    break;
+
+                // step down the list when the link can't keep up, and back
+                // to the top now and then to see if it recovered
+                int pct = rate_update(q, &rate, ret);
+                if (pct >= 0)
+                    slow = pct < SLOW_PCT ? slow + 1 : 0;
+                if (slow > 0)
+                    troubleAt = osGetTime();
+                if (next < 0 && slow >= SLOW_WINDOWS &&
+                    q->urlIndex + 1 < q->urlCount) {
+                    next   = q->urlIndex + 1;
+                    urgent = pct < STARVED_PCT;
+                    log_debug("stream: %d%% of real time on %s", pct,
+                              q->urls[q->urlIndex]);
+                } else if (next < 0 && q->urlIndex > 0 && slow == 0 &&
+                           osGetTime() - connectedAt > PROBE_UP_MS) {
+                    next = 0;
+                }
+                if (next >= 0 && switchAt == 0)
+                    switchAt = osGetTime();
+
+                // the standby is only worth its bandwidth while the link
+                // is in trouble, and useless for another endpoint
+                if (q->standby) {
+                    if (next >= 0 ||
+                        osGetTime() - troubleAt > STANDBY_IDLE_MS)
+                        standby_cancel(q->standby);
+                    else if (slow > 0)
+                        standby_start(q->standby, url);
+                }
 
                 // yield slightly to let other network threads (cover art) run
                 svcSleepThread(1000 * 1000);
             }
 
             cleanup_ssl(q->net);
+            dropped   = true;
+            droppedAt = osGetTime();
+
+            if (next >= 0) {
+                failures = 0;
+                switch_endpoint(q, next);
+            } else if (droppedAt - connectedAt < EARLY_DROP_MS) {
+                note_failure(q, &failures);
+            } else {
+                failures = 0;
+            }
         } else {
             // connect failed
+            note_failure(q, &failures);
             svcSleepThread(1000 * 1000 * 1000); // 1s retry delay
         }
 
-        if (!s_quit && !q->quit) {
+        if (!s_quit && !q->quit &&
+            !(q->standby && standby_ready(q->standby))) {
             // wait slightly before reconnect
             svcSleepThread(100 * 1000 * 1000);
         }
@@ -265,6 +701,3 @@ void stream_download_thread(void *arg) {
     q->eof = true;
     LightEvent_Signal(&q->canRead);
 }
-
-const OpusFileCallbacks STREAM_CALLBACKS = {
-    .read = stream_queue_read, .seek = NULL, .tell = NULL, .close = NULL};
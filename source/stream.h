@@ -2,11 +2,36 @@
 #define STREAM_H
 
 #include "net.h"
+#include "recorder.h"
+#include "standby.h"
 #include <3ds.h>
-#include <opusfile.h>
 #include <stdbool.h>
 
 #define STREAM_BUF_SIZE (512 * 1024) // 512KB Buffer
+#define STREAM_READ_MAX (16 * 1024)   // one full tls record per read
+
+#define STREAM_FILL_BUCKETS 8
+#define STREAM_MAX_BOUNDARIES 4 // reconnects not yet reached by the reader
+#define STREAM_MAX_URLS 4
+#define STREAM_URL_LEN 256
+
+typedef struct {
+    uint32_t starvations; // reader found the queue empty, once per wait
+    uint32_t starvedMs;   // time the reader spent waiting for data
+    uint32_t fillHistogram[STREAM_FILL_BUCKETS]; // fill on each read, eighths
+    uint32_t reconnects;
+    uint32_t lastReconnectMs; // connection drop to first byte of the new one
+    uint32_t maxReconnectMs;
+    uint32_t rateKbps;    // receive rate over the last window
+    uint32_t realtimePct; // audio received per wall time, last window
+    uint32_t switches;    // endpoint changes
+} StreamStats;
+
+// readable bytes in place, the second region is used when they wrap
+typedef struct {
+    const uint8_t *ptr[2];
+    size_t len[2];
+} StreamSpan;
 
 typedef struct {
     uint8_t *buffer;
@@ -18,20 +43,85 @@ typedef struct {
     bool eof;
     volatile bool quit;
 
+    // byte offsets where a reconnect started a new physical stream, the
+    // reader gets OGG_READ_BOUNDARY when it reaches one
+    uint64_t written;
+    uint64_t consumed;
+    uint64_t boundaries[STREAM_MAX_BOUNDARIES];
+    int boundaryHead;
+    int boundaryCount;
+
+    // newest ogg page header that came in, the live edge
+    uint32_t liveSerial;
+    int64_t liveGranule; // -1 until one was seen
+
     LightLock lock;
     LightEvent canRead;
     LightEvent canWrite;
 
     SecureCtx *net;
-    const char *url;
+
+    // endpoints, most preferred first: mirrors of the stream, then lower
+    // bitrate variants. the download thread moves down the list when the
+    // link can't keep up or a host keeps failing.
+    const char *urls[STREAM_MAX_URLS];
+    int urlCount;
+    int urlIndex; // endpoint in use
+    bool waited;  // reserve blocked on a full queue, download thread only
+    Recorder *recorder; // gets a copy of every received byte, or NULL
+    Standby *standby;   // spare connection for stalls and drops, or NULL
+
+    int stallTimeoutMs; // 0 blocks reads until data arrives
+    u64 starvedAt;      // reader side, start of the current wait, 0 if none
+
+    StreamStats stats;
 } StreamQueue;
 
-extern const OpusFileCallbacks STREAM_CALLBACKS;
+// the stream_url_2.. settings, extra endpoints after the built-in one
+void stream_register_settings(void);
 
 // initialize the queue
 bool stream_queue_init(StreamQueue *q, size_t capacity);
 void stream_queue_free(StreamQueue *q);
 
+// append an endpoint, false when the list is full
+bool stream_queue_add_url(StreamQueue *q, const char *url);
+
+// append the endpoints set in the stream_url_2.. settings
+void stream_queue_add_configured_urls(StreamQueue *q);
+
+// snapshot of the queue counters
+void stream_queue_get_stats(StreamQueue *q, StreamStats *out);
+
+// write the counters to the debug log
+void stream_queue_log_stats(StreamQueue *q);
+
+// give up on a starved read after ms and return OGG_READ_STALLED, so the
+// reader can do something else meanwhile (0 blocks)
+void stream_queue_set_stall_timeout(StreamQueue *q, int ms);
+
+// serial and granule of the newest page received, false before the first
+bool stream_queue_live_edge(StreamQueue *q, uint32_t *serial,
+                            int64_t *granule);
+
+// blocking read for the decoder (OggReadFunc), returns 0 at eof and
+// OGG_READ_BOUNDARY where a reconnect started a new stream
+int stream_queue_read(void *user_data, unsigned char *ptr, int nbytes);
+
+// zero-copy writes for the download thread. reserve waits for free space
+// and returns the largest contiguous run of it at *ptr (0 on quit), commit
+// publishes the first n bytes written there.
+size_t stream_queue_reserve(StreamQueue *q, uint8_t **ptr);
+void stream_queue_commit(StreamQueue *q, size_t n);
+
+// zero-copy reads for parsing in place, reader thread only. peek waits like
+// stream_queue_read and describes up to max (> 0) bytes in span, returning
+// their count, 0 at eof, -1 on quit or OGG_READ_STALLED/OGG_READ_BOUNDARY.
+// the bytes stay valid until consume releases them, n may be less than
+// what was peeked.
+int stream_queue_peek(StreamQueue *q, size_t max, StreamSpan *span);
+void stream_queue_consume(StreamQueue *q, size_t n);
+
 // thread worker that connects and downloads to the queue
 void stream_download_thread(void *arg);
 
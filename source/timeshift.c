@@ -0,0 +1,368 @@
+#include "timeshift.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_PAGE_BYTES 256     // sizes the page index
+#define MIN_BYTES_PER_SEC 2000 // 16 kbps, sizes the time buckets
+#define BUCKET_PROBES 8        // empty seconds to look back over in a lookup
+
+static int s_budgetKb = 2048; // about two minutes at 128 kbps, 0 disables
+
+void timeshift_register_settings(void) {
+    settings_register_int("timeshift_kb", &s_budgetKb);
+}
+
+size_t timeshift_budget(void) {
+    return s_budgetKb > 0 ? (size_t) s_budgetKb * 1024 : 0;
+}
+
+bool timeshift_init(TimeShift *ts, StreamQueue *src, size_t budget) {
+    memset(ts, 0, sizeof(TimeShift));
+
+    // any page has to fit, with room to keep a few
+    if (budget < 4 * OGG_MAX_PAGE_SIZE)
+        budget = 4 * OGG_MAX_PAGE_SIZE;
+
+    ts->src         = src;
+    ts->capacity    = budget;
+    ts->pageCap     = budget / MIN_PAGE_BYTES;
+    ts->bucketCount = budget / MIN_BYTES_PER_SEC;
+    ts->lastGranule = -1;
+
+    ts->data    = malloc(ts->capacity);
+    ts->pages   = malloc(ts->pageCap * sizeof(TimeShiftPage));
+    ts->buckets = calloc(ts->bucketCount, sizeof(TimeShiftBucket));
+    if (!ts->data || !ts->pages || !ts->buckets ||
+        !ogg_reader_init(&ts->ogg, stream_queue_read, src)) {
+        timeshift_free(ts);
+        return false;
+    }
+
+    LightLock_Init(&ts->lock);
+    LightEvent_Init(&ts->canRead, RESET_ONESHOT);
+    return true;
+}
+
+void timeshift_free(TimeShift *ts) {
+    if (ts->data) {
+        free(ts->data);
+        ts->data = NULL;
+    }
+    if (ts->pages) {
+        free(ts->pages);
+        ts->pages = NULL;
+    }
+    if (ts->buckets) {
+        free(ts->buckets);
+        ts->buckets = NULL;
+    }
+    ogg_reader_free(&ts->ogg);
+}
+
+static TimeShiftPage *page_at(TimeShift *ts, uint32_t page) {
+    return &ts->pages[page % ts->pageCap];
+}
+
+static void copy_in(TimeShift *ts, uint64_t off, const uint8_t *src,
+                    size_t len) {
+    size_t pos   = off % ts->capacity;
+    size_t first = ts->capacity - pos;
+    if (first > len)
+        first = len;
+    memcpy(ts->data + pos, src, first);
+    memcpy(ts->data, src + first, len - first);
+}
+
+static void copy_out(TimeShift *ts, uint64_t off, uint8_t *dst, size_t len) {
+    size_t pos   = off % ts->capacity;
+    size_t first = ts->capacity - pos;
+    if (first > len)
+        first = len;
+    memcpy(dst, ts->data + pos, first);
+    memcpy(dst + first, ts->data, len - first);
+}
+
+// ingest side, called with the lock held
+static void store_page(TimeShift *ts, const OggPage *pg, uint64_t timeMs) {
+    if (pg->flags & OGG_FLAG_BOS) {
+        TimeShiftChain *c = &ts->chains[++ts->chain % TIMESHIFT_MAX_CHAINS];
+        c->firstPage      = ts->nextPage;
+        c->headLen        = pg->len <= TIMESHIFT_HEAD_MAX ? pg->len : 0;
+        memcpy(c->head, pg->data, c->headLen);
+    }
+
+    // evict the oldest pages until the new one fits
+    while (ts->nextPage > ts->firstPage &&
+           (ts->nextPage - ts->firstPage >= ts->pageCap ||
+            ts->written + pg->len - page_at(ts, ts->firstPage)->start >
+                ts->capacity))
+        ts->firstPage++;
+
+    TimeShiftPage *p = page_at(ts, ts->nextPage);
+    p->start         = ts->written;
+    p->len           = pg->len;
+    p->chain         = ts->chain;
+    p->timeMs        = timeMs;
+    p->boundary      = ts->boundary;
+    ts->boundary     = false;
+
+    copy_in(ts, ts->written, pg->data, pg->len);
+    ts->written += pg->len;
+
+    // first page starting in each second of stream time
+    uint32_t sec      = (uint32_t) (timeMs / 1000);
+    TimeShiftBucket *b = &ts->buckets[sec % ts->bucketCount];
+    if (b->sec != sec + 1) {
+        b->sec  = sec + 1;
+        b->page = ts->nextPage;
+    }
+
+    ts->nextPage++;
+}
+
+void timeshift_ingest_thread(void *arg) {
+    TimeShift *ts = (TimeShift *) arg;
+
+    while (!ts->quit) {
+        OggPage pg;
+        int rc = ogg_reader_next_page(&ts->ogg, &pg);
+
+        if (rc == OGG_READ_BOUNDARY) {
+            // reconnect, granules of the new connection are unrelated
+            ts->boundary    = true;
+            ts->lastGranule = -1;
+            continue;
+        }
+        if (rc == OGG_READ_STALLED)
+            continue;
+        if (rc <= 0)
+            break; // eof or quit
+
+        // stream time advances by the granule difference of consecutive
+        // pages, a new chain carries on from the time reached so far
+        if (pg.serial != ts->lastSerial || (pg.flags & OGG_FLAG_BOS))
+            ts->lastGranule = -1;
+
+        LightLock_Lock(&ts->lock);
+
+        uint64_t timeMs = ts->timeSamples / 48;
+        if (pg.granule >= 0) {
+            if (ts->lastGranule >= 0 && pg.granule > ts->lastGranule)
+                ts->timeSamples += pg.granule - ts->lastGranule;
+            ts->lastGranule = pg.granule;
+        }
+        ts->lastSerial = pg.serial;
+
+        store_page(ts, &pg, timeMs);
+        LightEvent_Signal(&ts->canRead);
+        LightLock_Unlock(&ts->lock);
+    }
+
+    LightLock_Lock(&ts->lock);
+    ts->eof = true;
+    LightEvent_Signal(&ts->canRead);
+    LightLock_Unlock(&ts->lock);
+}
+
+// move the cursor, called with the lock held. the decoder gets a boundary
+// and, unless the page is the chain's first, its OpusHead page again.
+static void seek_locked(TimeShift *ts, uint32_t page) {
+    if (page < ts->firstPage)
+        page = ts->firstPage;
+    if (page > ts->nextPage)
+        page = ts->nextPage;
+
+    ts->cursorPage        = page;
+    ts->cursorPos         = 0;
+    ts->pendingBoundary   = true;
+    ts->deliveredBoundary = page + 1;
+
+    uint32_t chain =
+        page < ts->nextPage ? page_at(ts, page)->chain : ts->chain;
+    const TimeShiftChain *c = &ts->chains[chain % TIMESHIFT_MAX_CHAINS];
+
+    ts->headPos = 0;
+    ts->headLen = 0;
+    if (chain != 0 && ts->chain - chain < TIMESHIFT_MAX_CHAINS &&
+        c->firstPage != page) {
+        ts->headChain = chain;
+        ts->headLen   = c->headLen;
+    }
+
+    LightEvent_Signal(&ts->canRead);
+}
+
+// the bytes under the cursor are gone: its page was evicted, or newer
+// chains took the slot of the head being replayed
+static bool evicted_locked(TimeShift *ts) {
+    if (ts->cursorPage < ts->firstPage)
+        return true;
+    return ts->headPos < ts->headLen &&
+           ts->chain - ts->headChain >= TIMESHIFT_MAX_CHAINS;
+}
+
+int timeshift_read(void *user, unsigned char *ptr, int nbytes) {
+    TimeShift *ts = (TimeShift *) user;
+    int read      = 0;
+
+    LightLock_Lock(&ts->lock);
+
+    while (read < nbytes) {
+        if (ts->quit) {
+            read = -1;
+            break;
+        }
+
+        // evicted while paused or behind. nothing more of it is handed out,
+        // the boundary cuts off what already was and we carry on from the
+        // oldest page still stored
+        if (evicted_locked(ts)) {
+            ts->evictions++;
+            seek_locked(ts, ts->cursorPage);
+        }
+
+        if (ts->pendingBoundary) {
+            if (read == 0) {
+                ts->pendingBoundary = false;
+                read                = OGG_READ_BOUNDARY;
+            }
+            break;
+        }
+
+        if (ts->headPos < ts->headLen) {
+            const TimeShiftChain *c =
+                &ts->chains[ts->headChain % TIMESHIFT_MAX_CHAINS];
+            int n = ts->headLen - ts->headPos;
+            if (n > nbytes - read)
+                n = nbytes - read;
+            memcpy(ptr + read, c->head + ts->headPos, n);
+            ts->headPos += n;
+            read += n;
+            continue;
+        }
+
+        if (ts->cursorPage == ts->nextPage) {
+            // at the live edge, hand out what we have first
+            if (read > 0 || ts->eof)
+                break;
+
+            LightLock_Unlock(&ts->lock);
+            bool timedOut = false;
+            if (ts->stallTimeoutMs <= 0)
+                LightEvent_Wait(&ts->canRead);
+            else
+                timedOut = LightEvent_WaitTimeout(
+                    &ts->canRead, ts->stallTimeoutMs * 1000000LL);
+            LightLock_Lock(&ts->lock);
+
+            if (timedOut && ts->cursorPage == ts->nextPage) {
+                read = OGG_READ_STALLED;
+                break;
+            }
+            continue;
+        }
+
+        TimeShiftPage *p = page_at(ts, ts->cursorPage);
+        if (p->boundary && ts->cursorPos == 0 &&
+            ts->deliveredBoundary != ts->cursorPage + 1) {
+            if (read == 0) {
+                ts->deliveredBoundary = ts->cursorPage + 1;
+                read                  = OGG_READ_BOUNDARY;
+            }
+            break;
+        }
+
+        int n = p->len - ts->cursorPos;
+        if (n > nbytes - read)
+            n = nbytes - read;
+        copy_out(ts, p->start + ts->cursorPos, ptr + read, n);
+        ts->cursorPos += n;
+        read += n;
+
+        if (ts->cursorPos == p->len) {
+            ts->cursorPage++;
+            ts->cursorPos = 0;
+        }
+    }
+
+    LightLock_Unlock(&ts->lock);
+    return read;
+}
+
+void timeshift_set_stall_timeout(TimeShift *ts, int ms) {
+    ts->stallTimeoutMs = ms;
+}
+
+static uint64_t live_ms(TimeShift *ts) {
+    return ts->timeSamples / 48;
+}
+
+// O(1): the bucket for the second, or one of the few before it when no
+// page started in that second (pages can be longer than a second)
+static uint32_t lookup(TimeShift *ts, uint64_t ms) {
+    if (ts->nextPage == ts->firstPage ||
+        ms < page_at(ts, ts->firstPage)->timeMs)
+        return ts->firstPage;
+
+    uint32_t sec = (uint32_t) (ms / 1000);
+    for (uint32_t i = 0; i < BUCKET_PROBES && i <= sec; i++) {
+        const TimeShiftBucket *b =
+            &ts->buckets[(sec - i) % ts->bucketCount];
+        if (b->sec == sec - i + 1 && b->page >= ts->firstPage &&
+            b->page < ts->nextPage)
+            return b->page;
+    }
+    return ts->nextPage;
+}
+
+void timeshift_seek_behind(TimeShift *ts, uint32_t ms) {
+    LightLock_Lock(&ts->lock);
+    uint64_t live = live_ms(ts);
+    seek_locked(ts, lookup(ts, live > ms ? live - ms : 0));
+    LightLock_Unlock(&ts->lock);
+}
+
+void timeshift_jump_live(TimeShift *ts) {
+    timeshift_seek_behind(ts, TIMESHIFT_LIVE_CUSHION_MS);
+}
+
+static uint32_t behind_locked(TimeShift *ts) {
+    if (ts->cursorPage >= ts->nextPage)
+        return 0;
+
+    uint32_t page = ts->cursorPage < ts->firstPage ? ts->firstPage
+                                                   : ts->cursorPage;
+    return (uint32_t) (live_ms(ts) - page_at(ts, page)->timeMs);
+}
+
+uint32_t timeshift_behind_ms(TimeShift *ts) {
+    LightLock_Lock(&ts->lock);
+    uint32_t ms = behind_locked(ts);
+    LightLock_Unlock(&ts->lock);
+    return ms;
+}
+
+void timeshift_signal_exit(TimeShift *ts) {
+    ts->quit = true;
+    LightEvent_Signal(&ts->canRead);
+}
+
+void timeshift_log_stats(TimeShift *ts) {
+    LightLock_Lock(&ts->lock);
+    uint32_t pages = ts->nextPage - ts->firstPage;
+    uint64_t bytes = pages ? ts->written - page_at(ts, ts->firstPage)->start
+                           : 0;
+    uint64_t window =
+        pages ? live_ms(ts) - page_at(ts, ts->firstPage)->timeMs : 0;
+    uint32_t behind    = behind_locked(ts);
+    uint32_t evictions = ts->evictions;
+    LightLock_Unlock(&ts->lock);
+
+    log_debug("timeshift: %lu pages, %lu/%lu KB, window %lu s, behind %lu ms, "
+              "%lu reads cut by eviction",
+              (unsigned long) pages, (unsigned long) (bytes / 1024),
+              (unsigned long) (ts->capacity / 1024),
+              (unsigned long) (window / 1000), (unsigned long) behind,
+              (unsigned long) evictions);
+}
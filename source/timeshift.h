@@ -0,0 +1,122 @@
+#ifndef TIMESHIFT_H
+#define TIMESHIFT_H
+
+#include "ogg.h"
+#include "stream.h"
+#include <3ds.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// time-shift store between the stream queue and the decoder. an ingest
+// thread keeps pulling whole ogg pages from the live queue into a byte
+// ring with a page index, evicting the oldest pages once the memory budget
+// is used up, so nothing is lost while playback is paused or behind. the
+// decoder reads from a cursor into the store instead of the live queue.
+//
+// every page gets a stream time from its granule, one bucket per second of
+// stream time remembers the first page starting in it, which makes a
+// lookup by time O(1). after a seek the reader reports OGG_READ_BOUNDARY
+// and replays the chain's OpusHead page, the decoder resyncs and
+// crossfades the same way it does after a reconnect.
+
+#define TIMESHIFT_HEAD_MAX 512 // bos page holding OpusHead
+#define TIMESHIFT_MAX_CHAINS 16
+#define TIMESHIFT_LIVE_CUSHION_MS 500 // jump to live lands this far back
+
+typedef struct {
+    uint64_t start; // absolute byte offset in the store
+    uint32_t len;
+    uint32_t chain;  // chain number, see TimeShiftChain
+    uint64_t timeMs; // stream time at the start of the page
+    bool boundary;   // first page after a reconnect
+} TimeShiftPage;
+
+typedef struct {
+    uint32_t firstPage;
+    uint32_t headLen; // 0 if the bos page did not fit
+    uint8_t head[TIMESHIFT_HEAD_MAX];
+} TimeShiftChain;
+
+typedef struct {
+    uint32_t sec; // stream second + 1, 0 when unused
+    uint32_t page;
+} TimeShiftBucket;
+
+typedef struct {
+    StreamQueue *src;
+    OggReader ogg; // ingest side, pages only
+
+    // page bytes, absolute offsets masked by capacity
+    uint8_t *data;
+    size_t capacity;
+    uint64_t written;
+
+    // page numbers count up forever, [firstPage, nextPage) is stored
+    TimeShiftPage *pages;
+    uint32_t pageCap;
+    uint32_t firstPage;
+    uint32_t nextPage;
+
+    TimeShiftBucket *buckets;
+    uint32_t bucketCount;
+
+    TimeShiftChain chains[TIMESHIFT_MAX_CHAINS];
+    uint32_t chain; // current chain number, index is mod MAX_CHAINS
+
+    // ingest-owned stream time
+    uint64_t timeSamples; // 48 kHz, the ogg opus granule rate
+    int64_t lastGranule;
+    uint32_t lastSerial;
+    bool boundary; // mark the next stored page
+
+    // reader cursor
+    uint32_t cursorPage;
+    uint32_t cursorPos;
+    uint32_t headChain; // chain whose head is being replayed
+    uint32_t headPos;
+    uint32_t headLen;
+    bool pendingBoundary;
+    uint32_t deliveredBoundary; // page whose boundary went out, + 1
+    uint32_t evictions;         // times the cursor's bytes were evicted
+
+    int stallTimeoutMs;
+    bool eof; // ingest stopped, nothing new will arrive
+    volatile bool quit;
+
+    LightLock lock;
+    LightEvent canRead;
+} TimeShift;
+
+// register settings, call before settings_load()
+void timeshift_register_settings(void);
+
+// configured size of the page store in bytes, 0 when disabled
+size_t timeshift_budget(void);
+
+// budget is the byte size of the page store
+bool timeshift_init(TimeShift *ts, StreamQueue *src, size_t budget);
+void timeshift_free(TimeShift *ts);
+
+// thread worker moving pages from the stream queue into the store
+void timeshift_ingest_thread(void *arg);
+
+// OggReadFunc for the decoder, reads at the cursor
+int timeshift_read(void *user, unsigned char *ptr, int nbytes);
+
+// like stream_queue_set_stall_timeout(), for reads at the live edge
+void timeshift_set_stall_timeout(TimeShift *ts, int ms);
+
+// cursor movement, from any thread
+void timeshift_seek_behind(TimeShift *ts, uint32_t ms); // ms behind live
+void timeshift_jump_live(TimeShift *ts);
+
+// how far the cursor is behind the newest page
+uint32_t timeshift_behind_ms(TimeShift *ts);
+
+// wake the reader and the ingest thread on quit
+void timeshift_signal_exit(TimeShift *ts);
+
+// write the store state to the debug log
+void timeshift_log_stats(TimeShift *ts);
+
+#endif
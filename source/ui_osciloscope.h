@@ -5,7 +5,7 @@
 // INCLUDES ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-#include "audio.h"
+#include "playout.h"
 #include "render_types.h"
 #include "ring_buffer.h"
 #include <3ds.h>
@@ -33,10 +33,12 @@ void UI_Osciloscope_Init(void) {
 }
 
 void UI_Osciloscope_Draw(float x, float y, float w, float h) {
-    if (g_audio_buffer == NULL || g_audio_buffer_num_samples == 0)
+    // draw what is audible, not what was last queued
+    PlayoutPos pos;
+    if (!playout_get(&pos))
         return;
 
-    CB_PushSamples(&osc_cb, g_audio_buffer, g_audio_buffer_num_samples);
+    CB_PushSamples(&osc_cb, pos.buffer, pos.bufferFrames);
 
     // TODO: get rid of the divisions here
     const int16_t BAR_WIDTH = CB_SIZE;
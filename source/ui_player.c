@@ -50,6 +50,8 @@ void UI_Player_Draw(float x, float y, float w, float h) {
 
     // controls (bottom)
     Text_Draw(ID_INFO, FONT_REGULAR,
-              "Controls:\nY: Username  A: Message\nStart: Exit", x + 20,
-              y + 180, 0.6f, COLOR_TEXT_MUTED, C2D_WithColor);
+              "Controls:\nY: Username  A: Message  X: Record\nUp/Down: Volume  "
+              "Right: EQ  Select: Mute\nB: Pause  L: -10s  R: Live  "
+              "Start: Exit",
+              x + 20, y + 180, 0.6f, COLOR_TEXT_MUTED, C2D_WithColor);
 }
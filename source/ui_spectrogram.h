@@ -5,7 +5,7 @@
 // INCLUDES ////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 
-#include "audio.h"
+#include "playout.h"
 #include "render_types.h"
 #include "ring_buffer.h"
 #include <3ds.h>
@@ -69,10 +69,12 @@ float fast_sqrt(float x) {
 }
 
 void UI_Spectrogram_Draw(float x, float y, float w, float h) {
-    if (g_audio_buffer == NULL || g_audio_buffer_num_samples == 0)
+    // draw what is audible, not what was last queued
+    PlayoutPos pos;
+    if (!playout_get(&pos))
         return;
 
-    CB_PushSamples(&osc_cb, g_audio_buffer, g_audio_buffer_num_samples);
+    CB_PushSamples(&osc_cb, pos.buffer, pos.bufferFrames);
 
     if (cfg == NULL) {
         cfg = kiss_fftr_alloc(CB_SIZE, 0, NULL, NULL);
@@ -0,0 +1,162 @@
+// host test for eq.c: magnitude response of each band type at its centre
+// frequency and one octave either side. a sine goes through eq_process()
+// until it settles, its amplitude is compared with the rbj cookbook design
+// evaluated in double precision, and the centre gains with the nominal ones
+// (full gain for a peak, half for a shelf).
+
+#include "eq.h"
+#include "stubs.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define RATE 48000
+#define BLOCK 1024
+#define SETTLE_BLOCKS 24  // half a second
+#define MEASURE_BLOCKS 24 // then measure for half a second
+#define AMPLITUDE 4000.0  // +12 dB stays clear of clipping
+#define TOLERANCE_DB 0.05
+#define PI 3.14159265358979323846
+#define Q 0.9 // EQ_Q in eq.c
+
+typedef enum { LOW_SHELF, PEAK, HIGH_SHELF } Type;
+
+static int s_failures = 0;
+
+// gain in dB of the cookbook design at freq
+static double design_db(Type type, double hz, double db, double freq) {
+    double A     = pow(10.0, db / 40.0);
+    double w0    = 2 * PI * hz / RATE;
+    double cw    = cos(w0);
+    double alpha = sin(w0) / (2 * Q);
+    double b0, b1, b2, a0, a1, a2;
+
+    if (type == PEAK) {
+        b0 = 1 + alpha * A;
+        b1 = -2 * cw;
+        b2 = 1 - alpha * A;
+        a0 = 1 + alpha / A;
+        a1 = -2 * cw;
+        a2 = 1 - alpha / A;
+    } else {
+        double sa = 2 * sqrt(A) * alpha;
+        double s  = type == LOW_SHELF ? -1 : 1;
+        b0        = A * ((A + 1) + s * (A - 1) * cw + sa);
+        b1        = -2 * s * A * ((A - 1) + s * (A + 1) * cw);
+        b2        = A * ((A + 1) + s * (A - 1) * cw - sa);
+        a0        = (A + 1) - s * (A - 1) * cw + sa;
+        a1        = 2 * s * ((A - 1) - s * (A + 1) * cw);
+        a2        = (A + 1) - s * (A - 1) * cw - sa;
+    }
+
+    // |H(e^jw)| with z^-1 = e^-jw
+    double w  = 2 * PI * freq / RATE;
+    double nr = b0 + b1 * cos(w) + b2 * cos(2 * w);
+    double ni = -b1 * sin(w) - b2 * sin(2 * w);
+    double dr = a0 + a1 * cos(w) + a2 * cos(2 * w);
+    double di = -a1 * sin(w) - a2 * sin(2 * w);
+    return 10 * log10((nr * nr + ni * ni) / (dr * dr + di * di));
+}
+
+// gain in dB eq_process() applies to a sine at freq, per channel
+static void measure_db(double freq, double out[2]) {
+    int16_t pcm[BLOCK * 2];
+    double re[2] = {0, 0}, im[2] = {0, 0};
+    double w     = 2 * PI * freq / RATE;
+    long n       = 0;
+
+    for (int b = 0; b < SETTLE_BLOCKS + MEASURE_BLOCKS; b++) {
+        for (int i = 0; i < BLOCK; i++) {
+            int16_t x      = (int16_t) lround(AMPLITUDE * sin(w * (n + i)));
+            pcm[i * 2]     = x;
+            pcm[i * 2 + 1] = (int16_t) -x;
+        }
+        eq_process(pcm, BLOCK);
+
+        for (int i = 0; b >= SETTLE_BLOCKS && i < BLOCK; i++) {
+            for (int c = 0; c < 2; c++) {
+                re[c] += pcm[i * 2 + c] * cos(w * (n + i));
+                im[c] += pcm[i * 2 + c] * sin(w * (n + i));
+            }
+        }
+        n += BLOCK;
+    }
+
+    long count = (long) MEASURE_BLOCKS * BLOCK;
+    for (int c = 0; c < 2; c++) {
+        double amp = 2 * sqrt(re[c] * re[c] + im[c] * im[c]) / count;
+        out[c]     = 20 * log10(amp / AMPLITUDE);
+    }
+}
+
+// only band is active, at hz and db
+static void setup(int band, int hz, int db) {
+    char key[32];
+    *(bool *) stub_setting("eq_enabled") = true;
+    for (int i = 0; i < EQ_BANDS; i++) {
+        snprintf(key, sizeof(key), "eq_band%d_db", i + 1);
+        *(int *) stub_setting(key) = i == band ? db : 0;
+    }
+    snprintf(key, sizeof(key), "eq_band%d_hz", band + 1);
+    *(int *) stub_setting(key) = hz;
+    eq_init(RATE);
+}
+
+static void check(const char *name, Type type, int band, int hz, int db) {
+    setup(band, hz, db);
+
+    static const double octaves[] = {-1, 0, 1};
+    for (int o = 0; o < 3; o++) {
+        double freq   = hz * pow(2.0, octaves[o]);
+        double expect = design_db(type, hz, db, freq);
+        double got[2];
+        measure_db(freq, got);
+
+        for (int c = 0; c < 2; c++) {
+            if (fabs(got[c] - expect) > TOLERANCE_DB) {
+                printf("FAIL %s %d Hz %+d dB at %.0f Hz ch%d: %.3f dB, "
+                       "design %.3f dB\n",
+                       name, hz, db, freq, c, got[c], expect);
+                s_failures++;
+            }
+        }
+        printf("%-10s %5d Hz %+3d dB: %6.0f Hz %+7.3f dB (design %+7.3f)\n",
+               name, hz, db, freq, got[0], expect);
+    }
+
+    // the design itself: a peak has its full gain at the centre, a shelf
+    // half of it at the centre frequency
+    double nominal = type == PEAK ? db : db / 2.0;
+    double centre  = design_db(type, hz, db, hz);
+    if (fabs(centre - nominal) > TOLERANCE_DB) {
+        printf("FAIL %s %d Hz %+d dB: design %.3f dB at the centre, "
+               "want %.1f dB\n",
+               name, hz, db, centre, nominal);
+        s_failures++;
+    }
+}
+
+int main(void) {
+    eq_register_settings();
+
+    static const int gains[] = {-12, -6, 6, 12};
+    for (int g = 0; g < 4; g++) {
+        check("low shelf", LOW_SHELF, 0, 200, gains[g]);
+        check("peak", PEAK, 2, 1000, gains[g]);
+        check("high shelf", HIGH_SHELF, 4, 6000, gains[g]);
+    }
+
+    // a disabled eq leaves the signal alone
+    setup(2, 1000, 12);
+    *(bool *) stub_setting("eq_enabled") = false;
+    eq_init(RATE);
+    double got[2];
+    measure_db(1000, got);
+    if (fabs(got[0]) > 0.01 || fabs(got[1]) > 0.01) {
+        printf("FAIL disabled eq: %.3f %.3f dB\n", got[0], got[1]);
+        s_failures++;
+    }
+
+    printf("eq_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
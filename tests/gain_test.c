@@ -0,0 +1,203 @@
+// host test for gain.c: Q16 scaling and saturation of both kernels against
+// a double precision reference, and the limiter ceiling on loud tones with
+// their peaks between samples. "gain_test bench" times the kernels instead.
+
+#include "gain.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RATE 48000
+#define FRAMES 1024
+#define PI 3.14159265358979323846
+
+static int s_failures = 0;
+
+#define EXPECT(cond, ...)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            s_failures++;                                                      \
+        }                                                                      \
+    } while (0)
+
+static int16_t reference(int16_t x, int32_t gain) {
+    double v = floor((double) x * gain / 65536.0);
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : (int16_t) v;
+}
+
+static void fill_noise(int16_t *pcm, int frames, uint32_t seed) {
+    for (int i = 0; i < frames * 2; i++) {
+        seed    = seed * 1664525u + 1013904223u;
+        pcm[i]  = (int16_t) (seed >> 16);
+    }
+    // the extremes have to be covered too
+    pcm[0] = 32767;
+    pcm[1] = -32768;
+    pcm[2] = -1;
+    pcm[3] = 1;
+}
+
+static void test_scale(void) {
+    static const int32_t gains[] = {0,          1,          GAIN_UNITY / 3,
+                                    GAIN_UNITY / 2,         GAIN_UNITY - 1,
+                                    GAIN_UNITY, GAIN_UNITY + 1,
+                                    GAIN_UNITY * 2,         GAIN_MAX};
+    int16_t in[FRAMES * 2], out[FRAMES * 2];
+    fill_noise(in, FRAMES, 12345);
+
+    for (size_t g = 0; g < sizeof(gains) / sizeof(gains[0]); g++) {
+        for (int k = 0; k < 2; k++) {
+            memcpy(out, in, sizeof(in));
+            if (k == 0)
+                gain_scale_c(out, FRAMES, gains[g]);
+            else
+                gain_scale(out, FRAMES, gains[g]);
+
+            int bad = 0;
+            for (int i = 0; i < FRAMES * 2; i++)
+                bad += out[i] != reference(in[i], gains[g]);
+            EXPECT(bad == 0, "%s kernel, gain %d: %d samples off",
+                   k ? "fast" : "c", (int) gains[g], bad);
+        }
+    }
+}
+
+static void test_saturation(void) {
+    int16_t pcm[8] = {32767, -32768, 16384, -16385, 8192, -8193, 100, -100};
+    gain_scale_c(pcm, 4, GAIN_MAX);
+
+    EXPECT(pcm[0] == 32767 && pcm[1] == -32768, "full scale %d %d", pcm[0],
+           pcm[1]);
+    EXPECT(pcm[2] == 32767 && pcm[3] == -32768, "half scale %d %d", pcm[2],
+           pcm[3]);
+    EXPECT(pcm[4] == reference(8192, GAIN_MAX) &&
+               pcm[5] == reference(-8193, GAIN_MAX),
+           "quarter scale %d %d", pcm[4], pcm[5]);
+    EXPECT(pcm[6] == 399 && pcm[7] == -400, "small %d %d", pcm[6], pcm[7]);
+}
+
+// peak of the signal between samples, from a windowed sinc at 16x. reads
+// at most 0.2% low for the tones below.
+static double true_peak(const int16_t *pcm, int frames, int c) {
+    double peak = 0;
+    for (int i = 16; i < frames - 16; i++) {
+        for (int f = 0; f < 16; f++) {
+            double t = f / 16.0, v = 0;
+            for (int k = -16; k <= 16; k++) {
+                double x = t - k;
+                double s = x == 0 ? 1 : sin(PI * x) / (PI * x);
+                double w = 0.5 + 0.5 * cos(PI * x / 17);
+                v += pcm[(i + k) * 2 + c] * s * w;
+            }
+            if (fabs(v) > peak)
+                peak = fabs(v);
+        }
+    }
+    return peak;
+}
+
+// block b of a continuous tone. offset is where the peaks fall, in samples
+// past the nearest one.
+static void fill_tone(int16_t *pcm, int frames, int b, double freq,
+                      double offset, double amp) {
+    double w = 2 * PI * freq / RATE;
+    for (int i = 0; i < frames; i++) {
+        double t       = (double) b * frames + i - offset;
+        double v       = amp * sin(w * t + PI / 2);
+        pcm[i * 2]     = (int16_t) lround(v);
+        pcm[i * 2 + 1] = (int16_t) lround(-v);
+    }
+}
+
+static void limiter_start(void) {
+    gain_init(RATE);
+    gain_set_volume(100);
+    gain_set_mute(false);
+    gain_set_trim_db(GAIN_TRIM_MAX_DB);
+}
+
+// returns the worst true peak over blocks of a loud tone at freq
+static double limit_tone(double freq, double offset) {
+    int16_t pcm[FRAMES * 2];
+    double worst = 0;
+
+    limiter_start();
+    for (int b = 0; b < 8; b++) {
+        fill_tone(pcm, FRAMES, b, freq, offset, 30000);
+        gain_apply(pcm, FRAMES);
+        for (int c = 0; c < 2; c++) {
+            double tp = true_peak(pcm, FRAMES, c);
+            if (tp > worst)
+                worst = tp;
+        }
+    }
+    return worst;
+}
+
+static void test_limiter(void) {
+    // loud from the first block on, the attack is instant. whatever the
+    // frequency and wherever the peaks fall between samples, the true peak
+    // stays under the ceiling.
+    static const double freqs[]   = {100, 1000, 3000, 6000, 12000, 16000};
+    static const double offsets[] = {0, 0.125, 0.3, 0.5};
+    for (size_t f = 0; f < sizeof(freqs) / sizeof(freqs[0]); f++) {
+        double worst = 0;
+        for (size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+            uint32_t before = gain_limited_blocks();
+            double tp       = limit_tone(freqs[f], offsets[o]);
+
+            EXPECT(gain_limited_blocks() > before,
+                   "%.0f Hz, offset %.3f: limiter idle", freqs[f],
+                   offsets[o]);
+            EXPECT(tp <= GAIN_CEILING,
+                   "%.0f Hz, offset %.3f: true peak %.0f over %d", freqs[f],
+                   offsets[o], tp, GAIN_CEILING);
+            if (tp > worst)
+                worst = tp;
+        }
+        printf("limiter: %5.0f Hz, true peak %.0f, ceiling %d\n", freqs[f],
+               worst, GAIN_CEILING);
+    }
+
+    // quiet material is left alone once the limiter has released
+    int16_t pcm[FRAMES * 2], expect[FRAMES * 2];
+    limiter_start();
+    for (int b = 0; b < 5; b++) {
+        fill_tone(pcm, FRAMES, b, 1000, 0.5, 30000);
+        gain_apply(pcm, FRAMES);
+    }
+    for (int b = 0; b < 200; b++) {
+        fill_tone(pcm, FRAMES, b, 1000, 0.5, 1000);
+        gain_apply(pcm, FRAMES);
+    }
+    fill_tone(pcm, FRAMES, 200, 1000, 0.5, 1000);
+    memcpy(expect, pcm, sizeof(pcm));
+    gain_apply(pcm, FRAMES);
+
+    int32_t trim = (int32_t) lround(GAIN_UNITY *
+                                    pow(10.0, GAIN_TRIM_MAX_DB / 20.0));
+    int bad      = 0;
+    for (int i = 0; i < FRAMES * 2; i++)
+        bad += abs(pcm[i] - reference(expect[i], trim)) > 1;
+    EXPECT(bad == 0, "%d samples not at the full trim after release", bad);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        gain_benchmark(256);
+        gain_benchmark(FRAMES);
+        gain_benchmark(4096);
+        return 0;
+    }
+
+    test_scale();
+    test_saturation();
+    test_limiter();
+
+    printf("gain_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+#ifndef HOST_3DS_H
+#define HOST_3DS_H
+
+// the few libctru types and calls the portable modules use, on pthreads,
+// so they build for host tests. only on the include path of those tests.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define SYSCLOCK_ARM11 268111856
+
+static inline u64 svcGetSystemTick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * SYSCLOCK_ARM11 +
+           (u64) ts.tv_nsec * SYSCLOCK_ARM11 / 1000000000u;
+}
+
+// milliseconds, any epoch will do
+static inline u64 osGetTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline void svcSleepThread(s64 ns) {
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    nanosleep(&ts, NULL);
+}
+
+// the host has its sockets already
+static inline int socInit(u32 *buffer, u32 size) {
+    (void) buffer;
+    (void) size;
+    return 0;
+}
+
+static inline void socExit(void) {
+}
+
+// priority, core and stack size mean nothing here
+typedef void (*ThreadFunc)(void *);
+
+typedef struct {
+    pthread_t id;
+    ThreadFunc entry;
+    void *arg;
+} HostThread;
+
+typedef HostThread *Thread;
+
+static inline void *host_thread_entry(void *arg) {
+    HostThread *t = (HostThread *) arg;
+    t->entry(t->arg);
+    return NULL;
+}
+
+static inline Thread threadCreate(ThreadFunc entry, void *arg,
+                                  size_t stackSize, int prio, int core,
+                                  bool detached) {
+    (void) stackSize;
+    (void) prio;
+    (void) core;
+    (void) detached;
+    Thread t = (Thread) malloc(sizeof(HostThread));
+    if (!t)
+        return NULL;
+    t->entry = entry;
+    t->arg   = arg;
+    if (pthread_create(&t->id, NULL, host_thread_entry, t) != 0) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// waits for good, the timeout is not used by the modules under test
+static inline s32 threadJoin(Thread t, u64 timeoutNs) {
+    (void) timeoutNs;
+    return pthread_join(t->id, NULL);
+}
+
+static inline void threadFree(Thread t) {
+    free(t);
+}
+
+typedef pthread_mutex_t LightLock;
+
+static inline void LightLock_Init(LightLock *lock) {
+    pthread_mutex_init(lock, NULL);
+}
+
+static inline void LightLock_Lock(LightLock *lock) {
+    pthread_mutex_lock(lock);
+}
+
+static inline void LightLock_Unlock(LightLock *lock) {
+    pthread_mutex_unlock(lock);
+}
+
+typedef enum { RESET_ONESHOT, RESET_STICKY, RESET_PULSE } ResetType;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ResetType type;
+    bool signalled;
+} LightEvent;
+
+static inline void LightEvent_Init(LightEvent *ev, ResetType type) {
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+    ev->type      = type;
+    ev->signalled = false;
+}
+
+static inline void LightEvent_Signal(LightEvent *ev) {
+    pthread_mutex_lock(&ev->lock);
+    ev->signalled = true;
+    pthread_cond_broadcast(&ev->cond);
+    pthread_mutex_unlock(&ev->lock);
+}
+
+static inline void LightEvent_Clear(LightEvent *ev) {
+    pthread_mutex_lock(&ev->lock);
+    ev->signalled = false;
+    pthread_mutex_unlock(&ev->lock);
+}
+
+// 0 when signalled, 1 on timeout
+static inline int LightEvent_WaitTimeout(LightEvent *ev, s64 ns) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec += ns % 1000000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    int ret = 0;
+    pthread_mutex_lock(&ev->lock);
+    while (!ev->signalled && ret == 0)
+        ret = pthread_cond_timedwait(&ev->cond, &ev->lock, &ts);
+    bool got = ev->signalled;
+    if (got && ev->type == RESET_ONESHOT)
+        ev->signalled = false;
+    pthread_mutex_unlock(&ev->lock);
+    return got ? 0 : 1;
+}
+
+static inline void LightEvent_Wait(LightEvent *ev) {
+    while (LightEvent_WaitTimeout(ev, 1000000000) != 0)
+        ;
+}
+
+#endif
@@ -0,0 +1,230 @@
+// host test for the http parser in http.c: every response is fed split at
+// every position, and one byte at a time, so headers, chunk sizes with
+// extensions and the crlf after a chunk all get cut between reads. then
+// trailers, 1xx responses ahead of the real one and the redirect forms.
+
+#include "http.h"
+#include <stdio.h>
+#include <string.h>
+
+static int s_failures = 0;
+
+#define EXPECT(cond, ...)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            s_failures++;                                                      \
+        }                                                                      \
+    } while (0)
+
+typedef struct {
+    int headers;
+    char server[64];
+} Seen;
+
+static void on_header(void *user, const char *name, const char *value) {
+    Seen *seen = (Seen *) user;
+    seen->headers++;
+    if (strcmp(name, "Server") == 0)
+        snprintf(seen->server, sizeof(seen->server), "%s", value);
+}
+
+typedef struct {
+    char body[256];
+    size_t bodyLen;
+    Seen seen;
+    bool ok;
+} Result;
+
+// feed resp in reads of the given sizes, the last one repeats
+static void feed(HttpParser *p, const char *resp, const size_t *reads,
+                 int count, Result *r) {
+    memset(r, 0, sizeof(Result));
+    memset(p, 0, sizeof(HttpParser));
+    p->onHeader = on_header;
+    p->user     = &r->seen;
+    http_parser_init(p);
+    r->ok = true;
+
+    size_t len = strlen(resp), pos = 0;
+    for (int i = 0; pos < len; i++) {
+        size_t n = reads[i < count ? i : count - 1];
+        if (n > len - pos)
+            n = len - pos;
+
+        uint8_t buf[512];
+        memcpy(buf, resp + pos, n);
+        pos += n;
+
+        int out = http_parser_feed(p, buf, n);
+        if (out < 0) {
+            r->ok = false;
+            return;
+        }
+        if (r->bodyLen + out < sizeof(r->body)) {
+            memcpy(r->body + r->bodyLen, buf, out);
+            r->bodyLen += out;
+        }
+    }
+    r->body[r->bodyLen] = '\0';
+}
+
+// resp split once at every position and fed byte by byte, each time the
+// status and body have to come out the same
+static void check_splits(const char *name, const char *resp, int status,
+                         const char *body, int headers) {
+    size_t len = strlen(resp);
+    for (size_t split = 0; split <= len; split++) {
+        size_t reads[2] = {split, len};
+        int count       = 2;
+        if (split == len) {
+            reads[0] = 1; // byte by byte
+            count    = 1;
+        }
+
+        HttpParser p;
+        Result r;
+        feed(&p, resp, reads, count, &r);
+        const char *how = count == 1 ? "byte by byte" : "split";
+
+        EXPECT(r.ok, "%s: %s at %zu, parse error", name, how, split);
+        if (!r.ok)
+            continue;
+        EXPECT(p.status == status, "%s: %s at %zu, status %d", name, how,
+               split, p.status);
+        EXPECT(http_body_done(&p), "%s: %s at %zu, body not done", name, how,
+               split);
+        EXPECT(strcmp(r.body, body) == 0, "%s: %s at %zu, body \"%s\"", name,
+               how, split, r.body);
+        EXPECT(r.seen.headers == headers, "%s: %s at %zu, %d headers", name,
+               how, split, r.seen.headers);
+    }
+    printf("http: %s, fed in %zu ways\n", name, len + 1);
+}
+
+static void test_content_length(void) {
+    const char *resp = "HTTP/1.1 200 OK\r\n"
+                       "Server: Icecast 2.4.4\r\n"
+                       "Content-Type: audio/ogg\r\n"
+                       "Content-Length: 11\r\n"
+                       "\r\n"
+                       "hello world"
+                       "trailing junk after the body";
+    check_splits("content-length", resp, 200, "hello world", 3);
+
+    size_t one = 1;
+    HttpParser p;
+    Result r;
+    feed(&p, resp, &one, 1, &r);
+    EXPECT(strcmp(r.seen.server, "Icecast 2.4.4") == 0, "server \"%s\"",
+           r.seen.server);
+    EXPECT(p.contentLength == 11, "content length %lld",
+           (long long) p.contentLength);
+}
+
+static void test_chunked(void) {
+    // extensions, a size with leading zeros and upper case hex, a trailer
+    const char *resp = "HTTP/1.1 200 OK\r\n"
+                       "Transfer-Encoding: chunked\r\n"
+                       "\r\n"
+                       "4;name=value\r\n"
+                       "Wiki\r\n"
+                       "5 ; quoted=\"a;b\"\r\n"
+                       "pedia\r\n"
+                       "000E\r\n"
+                       " in\r\n\r\nchunks.\r\n"
+                       "0;last\r\n"
+                       "Expires: never\r\n"
+                       "X-Trailer: 1\r\n"
+                       "\r\n";
+    check_splits("chunked", resp, 200, "Wikipedia in\r\n\r\nchunks.", 1);
+
+    const char *noTrailer = "HTTP/1.1 200 OK\r\n"
+                            "Transfer-Encoding: chunked\r\n"
+                            "\r\n"
+                            "3\r\nabc\r\n0\r\n\r\n";
+    check_splits("chunked, no trailer", noTrailer, 200, "abc", 1);
+
+    // data where the crlf after a chunk belongs
+    size_t all = 64;
+    HttpParser p;
+    Result r;
+    feed(&p,
+         "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+         "3\r\nabcdef\r\n0\r\n\r\n",
+         &all, 1, &r);
+    EXPECT(!r.ok, "overlong chunk accepted");
+}
+
+static void test_informational(void) {
+    const char *resp = "HTTP/1.1 100 Continue\r\n"
+                       "\r\n"
+                       "HTTP/1.1 103 Early Hints\r\n"
+                       "Link: </style.css>; rel=preload\r\n"
+                       "\r\n"
+                       "HTTP/1.1 302 Found\r\n"
+                       "Location: //cdn.example.com/live.opus\r\n"
+                       "Content-Length: 0\r\n"
+                       "\r\n";
+    check_splits("1xx", resp, 302, "", 3);
+
+    size_t one = 1;
+    HttpParser p;
+    Result r;
+    feed(&p, resp, &one, 1, &r);
+    EXPECT(strcmp(p.location, "//cdn.example.com/live.opus") == 0,
+           "location \"%s\"", p.location);
+}
+
+static void check_redirect(const char *from, const char *location,
+                           const char *expect) {
+    char url[HTTP_URL_MAX];
+    snprintf(url, sizeof(url), "%s", from);
+    bool ok = http_redirect_url(url, sizeof(url), location);
+
+    if (expect) {
+        EXPECT(ok && strcmp(url, expect) == 0, "%s -> \"%s\": got \"%s\"",
+               location, expect, ok ? url : "(rejected)");
+    } else {
+        EXPECT(!ok, "%s: accepted as \"%s\"", location, url);
+        EXPECT(strcmp(url, from) == 0, "%s: url changed to \"%s\"", location,
+               url);
+    }
+}
+
+static void test_redirects(void) {
+    const char *from = "https://radio.example.com/stream/low";
+
+    check_redirect(from, "https://other.example.net/high",
+                   "https://other.example.net/high");
+    check_redirect(from, "//cdn.example.com/live.opus",
+                   "https://cdn.example.com/live.opus");
+    check_redirect(from, "/stream/high",
+                   "https://radio.example.com/stream/high");
+    check_redirect("https://radio.example.com", "/live",
+                   "https://radio.example.com/live");
+
+    check_redirect(from, "http://radio.example.com/stream/high", NULL);
+    check_redirect(from, "high", NULL);
+    check_redirect(from, "", NULL);
+
+    char longPath[HTTP_URL_MAX];
+    memset(longPath, 'a', sizeof(longPath) - 1);
+    longPath[0]                    = '/';
+    longPath[sizeof(longPath) - 1] = '\0';
+    check_redirect(from, longPath, NULL);
+
+    printf("http: redirect forms\n");
+}
+
+int main(void) {
+    test_content_length();
+    test_chunked();
+    test_informational();
+    test_redirects();
+
+    printf("http_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
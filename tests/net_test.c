@@ -0,0 +1,110 @@
+// host test for the tls setup in net.c: connects twice to a local server
+// that resumes by ticket, by session id or not at all, and checks that
+// net.c counts the second handshake the way the server did it. then
+// servers limited to suites outside the preferred list have to work too.
+
+#include "net.h"
+#include "tls_server.h"
+#include <stdio.h>
+
+static int s_failures = 0;
+
+#define EXPECT(cond, ...)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            s_failures++;                                                      \
+        }                                                                      \
+    } while (0)
+
+static const char *const s_names[] = {"no resumption", "session id",
+                                      "session ticket"};
+
+static void test_resume(TlsResume resume) {
+    const char *name = s_names[resume];
+    TlsServer *srv   = tls_server_start(resume, NULL, NULL);
+    EXPECT(srv, "%s: server did not start", name);
+    if (!srv)
+        return;
+
+    char port[8];
+    snprintf(port, sizeof(port), "%d", tls_server_port(srv));
+
+    NetStats before, after;
+    net_get_stats(&before);
+    for (int i = 0; i < 2; i++) {
+        SecureCtx ctx;
+        bool ok = connect_ssl(&ctx, "127.0.0.1", port);
+        EXPECT(ok, "%s: connect %d failed", name, i);
+        if (ok)
+            cleanup_ssl(&ctx);
+    }
+    net_get_stats(&after);
+
+    // the server may still be reading the client's finished
+    int resumed;
+    tls_server_idle(srv);
+    int handshakes = tls_server_handshakes(srv, &resumed);
+    tls_server_stop(srv);
+
+    uint32_t full = after.fullHandshakes - before.fullHandshakes;
+    uint32_t res  = after.resumedHandshakes - before.resumedHandshakes;
+    int expect    = resume == TLS_RESUME_NONE ? 0 : 1;
+    EXPECT(handshakes == 2 && resumed == expect,
+           "%s: server did %d handshakes, %d resumed", name, handshakes,
+           resumed);
+    EXPECT(full == (uint32_t) (2 - expect) && res == (uint32_t) expect,
+           "%s: counted %u full and %u resumed, server resumed %d", name,
+           (unsigned) full, (unsigned) res, resumed);
+    printf("net: %s, %u full, %u resumed\n", name, (unsigned) full,
+           (unsigned) res);
+}
+
+// a server that only speaks suites outside the preferred list
+static void test_fallback(const char *suite) {
+    int suites[2] = {mbedtls_ssl_get_ciphersuite_id(suite), 0};
+    EXPECT(suites[0], "%s: not in this mbedtls build", suite);
+    if (!suites[0])
+        return;
+
+    TlsServer *srv = tls_server_start(TLS_RESUME_NONE, NULL, NULL);
+    EXPECT(srv, "%s: server did not start", suite);
+    if (!srv)
+        return;
+    tls_server_suites(srv, suites);
+
+    char port[8];
+    snprintf(port, sizeof(port), "%d", tls_server_port(srv));
+
+    SecureCtx ctx;
+    bool ok = connect_ssl(&ctx, "127.0.0.1", port);
+    EXPECT(ok, "%s: no handshake", suite);
+    if (ok) {
+        printf("net: %s, fallback ok\n", mbedtls_ssl_get_ciphersuite(&ctx.ssl));
+        cleanup_ssl(&ctx);
+    }
+    tls_server_stop(srv);
+}
+
+int main(void) {
+    if (net_init() != 0) {
+        printf("net_test: net_init failed\n");
+        return 1;
+    }
+    net_configure_tls();
+
+    // each server listens on a new port, so no session carries over
+    test_resume(TLS_RESUME_NONE);
+    test_resume(TLS_RESUME_CACHE);
+    test_resume(TLS_RESUME_TICKETS);
+
+    test_fallback("TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384");
+    test_fallback("TLS-ECDHE-RSA-WITH-AES-256-CBC-SHA384");
+    test_fallback("TLS-RSA-WITH-AES-256-CBC-SHA256");
+
+    net_exit();
+    printf("net_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
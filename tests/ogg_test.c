@@ -0,0 +1,350 @@
+// host test for ogg.c page sync: a false capture pattern whose declared
+// length swallows the real pages behind it must only cost the bytes up to
+// the next real page, read in chunks of every size from 1 byte up.
+// "ogg_test bench" times the decode path around libopus instead, see
+// bench() below.
+
+#define _POSIX_C_SOURCE 199309L // clock_gettime for the bench
+
+#include "eq.h"
+#include "gain.h"
+#include "loudness.h"
+#include "ogg.h"
+#include "spsc_ring.h"
+#include "stubs.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int s_failures = 0;
+
+static uint8_t s_stream[8192];
+static size_t s_len, s_pos, s_chunk;
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t) (v >> (8 * i));
+}
+
+static void add_page(uint32_t seq, int len) {
+    uint8_t *h = s_stream + s_len;
+    memset(h, 0, 27);
+    memcpy(h, "OggS", 4);
+    put_le32(h + 6, seq * 960);
+    put_le32(h + 14, 1);
+    put_le32(h + 18, seq);
+    h[26] = 1;
+    h[27] = (uint8_t) len;
+    memset(h + 28, 'a' + seq, len);
+    put_le32(h + 22, ogg_crc(0, h, 28 + len));
+    s_len += 28 + len;
+}
+
+// "OggS" inside other data, its lacing claims more than follows before
+// the next real page
+static void add_false_capture(void) {
+    uint8_t *h = s_stream + s_len;
+    memset(h, 0, 29);
+    memcpy(h, "OggS", 4);
+    h[26] = 2;
+    h[27] = 255;
+    h[28] = 255;
+    s_len += 29;
+}
+
+static int chunk_read(void *user, unsigned char *ptr, int nbytes) {
+    (void) user;
+    if (s_pos == s_len)
+        return 0;
+    size_t n = s_len - s_pos;
+    if (n > s_chunk)
+        n = s_chunk;
+    if (n > (size_t) nbytes)
+        n = nbytes;
+    memcpy(ptr, s_stream + s_pos, n);
+    s_pos += n;
+    return (int) n;
+}
+
+// the decode path of audio.c minus libopus, per second of audio: ogg
+// demux, the processing chain (loudness meter, eq with every band active,
+// gain with the limiter) and the pcm copies of ring mode, which zero-copy
+// mode does not make. a stand-in copies a tone where opus_decode would
+// write, it is not timed. the gain kernel is timed on its own as well, the
+// portable one against the one this build uses.
+
+#define BENCH_SECONDS 60
+#define BENCH_PACKET 160     // bytes, 64 kbps at 20 ms
+#define BENCH_PAGE_PACKETS 5 // 100 ms pages
+#define BENCH_READ 4096      // source reads, like a tls record
+#define BENCH_RING (256 * 1024)
+#define BENCH_BUF_MS 20
+
+#if defined(__ARM_FEATURE_DSP)
+#define BENCH_KERNEL "dsp"
+#else
+#define BENCH_KERNEL "portable"
+#endif
+
+static uint8_t *s_bench;
+static size_t s_benchLen, s_benchPos;
+
+static uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static size_t bench_page(uint8_t *h, uint32_t seq, int64_t granule,
+                         uint8_t flags, int packets, size_t size) {
+    memset(h, 0, OGG_HEADER_SIZE);
+    memcpy(h, "OggS", 4);
+    h[5] = flags;
+    put_le32(h + 6, (uint32_t) granule);
+    put_le32(h + 14, 1);
+    put_le32(h + 18, seq);
+    h[26] = (uint8_t) packets;
+    size_t len = OGG_HEADER_SIZE + packets;
+    for (int i = 0; i < packets; i++) {
+        h[OGG_HEADER_SIZE + i] = (uint8_t) size;
+        for (size_t j = 0; j < size; j++)
+            h[len + j] = (uint8_t) (seq * 31 + i * 7 + j);
+        len += size;
+    }
+    put_le32(h + 22, ogg_crc(0, h, len));
+    return len;
+}
+
+static bool bench_stream(void) {
+    int pages  = BENCH_SECONDS * 50 / BENCH_PAGE_PACKETS;
+    size_t max = (size_t) (pages + 2) *
+                 (OGG_HEADER_SIZE + BENCH_PAGE_PACKETS * (1 + BENCH_PACKET));
+    s_bench = malloc(max);
+    if (!s_bench)
+        return false;
+
+    // the header packets only have to be there, nothing parses them
+    s_benchLen = bench_page(s_bench, 0, 0, OGG_FLAG_BOS, 1, 19);
+    s_benchLen += bench_page(s_bench + s_benchLen, 1, 0, 0, 1, 20);
+    for (int p = 0; p < pages; p++)
+        s_benchLen += bench_page(s_bench + s_benchLen, p + 2,
+                                 (int64_t) (p + 1) * BENCH_PAGE_PACKETS * 960,
+                                 0, BENCH_PAGE_PACKETS, BENCH_PACKET);
+    return true;
+}
+
+static int bench_read(void *user, unsigned char *ptr, int nbytes) {
+    (void) user;
+    size_t n = s_benchLen - s_benchPos;
+    if (n > BENCH_READ)
+        n = BENCH_READ;
+    if (n > (size_t) nbytes)
+        n = nbytes;
+    memcpy(ptr, s_bench + s_benchPos, n);
+    s_benchPos += n;
+    return (int) n;
+}
+
+typedef struct {
+    uint64_t demux, meter, eq, gain, copy, scaleC, scaleKernel;
+} BenchTimes;
+
+// the processing decode_ring/decode_slot do on freshly decoded frames
+static void bench_process(int16_t *pcm, int frames, BenchTimes *t) {
+    uint64_t start = bench_now();
+    loudness_feed(pcm, frames);
+    uint64_t meter = bench_now();
+    eq_process(pcm, frames);
+    uint64_t eq = bench_now();
+    gain_apply(pcm, frames);
+    uint64_t mid = bench_now();
+    t->meter += meter - start;
+    t->eq += eq - meter;
+    t->gain += mid - eq;
+
+    gain_scale_c(pcm, frames, GAIN_UNITY * 3 / 4);
+    uint64_t c = bench_now();
+    gain_scale(pcm, frames, GAIN_UNITY * 3 / 4);
+    t->scaleC += c - mid;
+    t->scaleKernel += bench_now() - c;
+}
+
+static void bench_run(int rate, bool zeroCopy, const int16_t *tone) {
+    int packetFrames = rate / 50;
+    int bufFrames    = rate / 1000 * BENCH_BUF_MS;
+    size_t bufBytes  = (size_t) bufFrames * 4;
+
+    loudness_init(rate);
+    eq_init(rate);
+    gain_init(rate);
+
+    SpscRing ring;
+    int16_t *slot   = malloc(bufBytes);
+    int16_t *bounce = malloc((size_t) packetFrames * 4);
+    if (!slot || !bounce || !spsc_ring_init(&ring, BENCH_RING)) {
+        free(slot);
+        free(bounce);
+        return;
+    }
+
+    OggReader r;
+    ogg_reader_init(&r, bench_read, NULL);
+    s_benchPos = 0;
+
+    BenchTimes t = {0};
+    int toneFrame = 0, fill = 0;
+    for (;;) {
+        OggPacket pkt;
+        uint64_t start = bench_now();
+        int rc         = ogg_reader_next_packet(&r, &pkt);
+        t.demux += bench_now() - start;
+        if (rc != 1)
+            break;
+        if (pkt.granule == 0)
+            continue; // headers
+
+        // the stand-in for opus_decode, one packet of tone
+        int left = packetFrames;
+        while (left > 0) {
+            int16_t *dst;
+            int n = left;
+            SpscSpan span;
+            if (zeroCopy) {
+                if (n > bufFrames - fill)
+                    n = bufFrames - fill;
+                dst = slot + fill * 2;
+            } else {
+                start = bench_now();
+                spsc_ring_write_reserve(&ring, (size_t) n * 4, &span);
+                t.copy += bench_now() - start;
+                dst = span.len[0] >= (size_t) n * 4 ? (int16_t *) span.ptr[0]
+                                                    : bounce;
+            }
+            if (toneFrame + n > rate)
+                toneFrame = 0;
+            memcpy(dst, tone + toneFrame * 2, (size_t) n * 4);
+            toneFrame += n;
+
+            bench_process(dst, n, &t);
+
+            if (zeroCopy) {
+                fill = (fill + n) % bufFrames;
+            } else {
+                // near the wrap point the chunk goes out in two parts, then
+                // the feeder copies whole wavebufs out
+                start = bench_now();
+                if (dst == bounce) {
+                    size_t first = span.len[0];
+                    memcpy(span.ptr[0], bounce, first);
+                    memcpy(span.ptr[1], (uint8_t *) bounce + first,
+                           (size_t) n * 4 - first);
+                }
+                spsc_ring_write_commit(&ring, (size_t) n * 4);
+                while (spsc_ring_available(&ring) >= bufBytes)
+                    spsc_ring_read(&ring, slot, bufBytes);
+                t.copy += bench_now() - start;
+            }
+            left -= n;
+        }
+    }
+    ogg_reader_free(&r);
+    spsc_ring_free(&ring);
+    free(bounce);
+    free(slot);
+
+    uint64_t total = t.demux + t.meter + t.eq + t.gain + t.copy;
+    printf("bench: %5d Hz %-9s demux %5llu, meter %6llu, eq %7llu, gain "
+           "%6llu, copy %5llu, total %7llu ns/s\n",
+           rate, zeroCopy ? "zero-copy" : "ring",
+           (unsigned long long) (t.demux / BENCH_SECONDS),
+           (unsigned long long) (t.meter / BENCH_SECONDS),
+           (unsigned long long) (t.eq / BENCH_SECONDS),
+           (unsigned long long) (t.gain / BENCH_SECONDS),
+           (unsigned long long) (t.copy / BENCH_SECONDS),
+           (unsigned long long) (total / BENCH_SECONDS));
+    printf("bench: %5d Hz %-9s gain kernel alone, c %6llu, " BENCH_KERNEL
+           " %6llu ns/s\n",
+           rate, zeroCopy ? "zero-copy" : "ring",
+           (unsigned long long) (t.scaleC / BENCH_SECONDS),
+           (unsigned long long) (t.scaleKernel / BENCH_SECONDS));
+}
+
+static int bench(void) {
+    if (!bench_stream())
+        return 1;
+
+    // every eq band active and the meter on, as in eq_benchmark()
+    eq_register_settings();
+    loudness_register_settings();
+    gain_register_settings();
+    *(bool *) stub_setting("eq_enabled") = true;
+    static const char *dbKeys[EQ_BANDS] = {"eq_band1_db", "eq_band2_db",
+                                           "eq_band3_db", "eq_band4_db",
+                                           "eq_band5_db"};
+    for (int i = 0; i < EQ_BANDS; i++)
+        *(int *) stub_setting(dbKeys[i]) = (i & 1) ? -6 : 6;
+
+    static const int rates[] = {48000, 24000, 16000};
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        int rate      = rates[i];
+        int16_t *tone = malloc((size_t) rate * 4);
+        if (!tone)
+            return 1;
+        double w = 2 * 3.14159265358979 * 440 / rate;
+        for (int f = 0; f < rate; f++) {
+            int16_t x       = (int16_t) (12000 * sin(w * f));
+            tone[f * 2]     = x;
+            tone[f * 2 + 1] = (int16_t) -x;
+        }
+        bench_run(rate, false, tone);
+        bench_run(rate, true, tone);
+        free(tone);
+    }
+    free(s_bench);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench();
+
+    add_page(0, 100);
+    add_false_capture();
+    for (uint32_t seq = 1; seq <= 3; seq++)
+        add_page(seq, 100);
+
+    // junk right after a page that was read ahead during the resync
+    memcpy(s_stream + s_len, "xxOgg", 5);
+    s_len += 5;
+    for (uint32_t seq = 4; seq <= 6; seq++)
+        add_page(seq, 100);
+
+    for (s_chunk = 1; s_chunk <= 1024; s_chunk *= 2) {
+        OggReader r;
+        OggPage pg;
+        uint32_t want = 0;
+        s_pos         = 0;
+        ogg_reader_init(&r, chunk_read, NULL);
+
+        int rc;
+        while ((rc = ogg_reader_next_page(&r, &pg)) == 1) {
+            if (pg.seq != want) {
+                printf("FAIL chunk %zu: page %u, want %u\n", s_chunk,
+                       (unsigned) pg.seq, (unsigned) want);
+                s_failures++;
+            }
+            want = pg.seq + 1;
+        }
+        if (rc != 0 || want != 7 || r.badPages != 1) {
+            printf("FAIL chunk %zu: rc %d, %u pages, %u bad\n", s_chunk, rc,
+                   (unsigned) want, (unsigned) r.badPages);
+            s_failures++;
+        }
+        ogg_reader_free(&r);
+    }
+
+    printf("ogg_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,314 @@
+// host test for recorder.c with the writer on its own thread, writing into
+// a temporary directory: a recording started mid-stream begins with the
+// header pages, a page cut by a reconnect is dropped, ring overflow drops
+// whole pages and is counted, and the batched writes keep up with a
+// producer that never stops. every file is read back page by page.
+
+#include "recorder.h"
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SERIAL 7
+#define AUDIO_PAGE 300 // body bytes, about 20ms of 128 kbps
+
+static int s_failures = 0;
+
+#define EXPECT(cond, ...)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            s_failures++;                                                      \
+        }                                                                      \
+    } while (0)
+
+static Recorder s_rec;
+static pthread_t s_writer;
+static uint8_t s_page[70000];
+static uint32_t s_seq;
+static int64_t s_granule;
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t) (v >> (8 * i));
+}
+
+// one page into s_page, the body is filled with fill
+static size_t make_page(int flags, int64_t granule, int len, int fill) {
+    uint8_t *h = s_page;
+    memcpy(h, "OggS", 4);
+    h[4] = 0;
+    h[5] = (uint8_t) flags;
+    put_le32(h + 6, (uint32_t) granule);
+    put_le32(h + 10, (uint32_t) ((uint64_t) granule >> 32));
+    put_le32(h + 14, SERIAL);
+    put_le32(h + 18, s_seq++);
+    put_le32(h + 22, 0);
+
+    int segs = len / 255 + 1;
+    h[26]    = (uint8_t) segs;
+    for (int i = 0, left = len; i < segs; i++, left -= 255)
+        h[27 + i] = (uint8_t) (left > 255 ? 255 : left);
+
+    memset(h + 27 + segs, fill, len);
+    size_t size = 27 + segs + len;
+    put_le32(h + 22, ogg_crc(0, h, size));
+    return size;
+}
+
+static size_t feed_headers(void) {
+    s_seq     = 0;
+    s_granule = 0;
+    size_t n  = make_page(OGG_FLAG_BOS, 0, 19, 'H');
+    recorder_feed(&s_rec, s_page, n);
+    size_t total = n;
+    n            = make_page(0, 0, 600, 'T');
+    recorder_feed(&s_rec, s_page, n);
+    return total + n;
+}
+
+// waits for room instead of dropping when wait is set
+static size_t feed_audio(int pages, bool wait) {
+    size_t total = 0;
+    for (int i = 0; i < pages; i++) {
+        size_t n = make_page(0, s_granule += 960, AUDIO_PAGE, 'a');
+        while (wait && spsc_ring_space(&s_rec.ring) < n)
+            sched_yield();
+        recorder_feed(&s_rec, s_page, n);
+        total += n;
+    }
+    return total;
+}
+
+static void *writer(void *arg) {
+    recorder_thread(arg);
+    return NULL;
+}
+
+static void start(void) {
+    if (!recorder_init(&s_rec)) {
+        printf("recorder_init failed\n");
+        exit(1);
+    }
+}
+
+static void run_writer(void) {
+    pthread_create(&s_writer, NULL, writer, &s_rec);
+}
+
+// let the writer drain the ring, then stop it
+static void drain(void) {
+    while (spsc_ring_available(&s_rec.ring) > 0)
+        sched_yield();
+    usleep(50 * 1000);
+}
+
+static void finish(void) {
+    recorder_signal_exit(&s_rec);
+    pthread_join(s_writer, NULL);
+    recorder_log_stats(&s_rec);
+}
+
+typedef struct {
+    size_t bytes;
+    int pages;
+    int headers;     // 'H' and 'T' pages at the start
+    uint32_t gaps;   // breaks in the sequence between audio pages
+    uint32_t bad;    // pages the reader rejected
+    uint32_t cut;    // pages whose body is not what was fed
+    uint32_t lastSeq;
+} FileInfo;
+
+static const uint8_t *s_file;
+static size_t s_fileLen, s_filePos;
+
+static int file_read(void *user, unsigned char *ptr, int nbytes) {
+    (void) user;
+    if (s_filePos >= s_fileLen)
+        return 0;
+    if ((size_t) nbytes > s_fileLen - s_filePos)
+        nbytes = (int) (s_fileLen - s_filePos);
+    memcpy(ptr, s_file + s_filePos, nbytes);
+    s_filePos += nbytes;
+    return nbytes;
+}
+
+// read back the only recording and delete it
+static bool check_file(FileInfo *info) {
+    memset(info, 0, sizeof(FileInfo));
+
+    DIR *dir = opendir("sdmc:/tripletail");
+    struct dirent *e;
+    char path[512] = "";
+    int files      = 0;
+    while (dir && (e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "sdmc:/tripletail/%s", e->d_name);
+        files++;
+    }
+    if (dir)
+        closedir(dir);
+    if (files != 1) {
+        printf("FAIL: %d recordings, want 1\n", files);
+        s_failures++;
+        return false;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    fseek(fp, 0, SEEK_END);
+    s_fileLen = (size_t) ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *data = malloc(s_fileLen ? s_fileLen : 1);
+    if (fread(data, 1, s_fileLen, fp) != s_fileLen)
+        s_fileLen = 0;
+    fclose(fp);
+    remove(path);
+
+    s_file      = data;
+    s_filePos   = 0;
+    info->bytes = s_fileLen;
+
+    OggReader r;
+    OggPage pg;
+    ogg_reader_init(&r, file_read, NULL);
+    while (ogg_reader_next_page(&r, &pg) == 1) {
+        uint8_t tag = pg.data[pg.len - 1];
+        if (info->pages == info->headers && (tag == 'H' || tag == 'T'))
+            info->headers++;
+        else if (info->pages > info->headers && pg.seq != info->lastSeq + 1)
+            info->gaps++;
+        if (tag == 'a' && pg.len != 27 + AUDIO_PAGE / 255 + 1 + AUDIO_PAGE)
+            info->cut++;
+        info->lastSeq = pg.seq;
+        info->pages++;
+    }
+    info->bad = r.badPages;
+    ogg_reader_free(&r);
+    free(data);
+    return true;
+}
+
+static void test_cut_page(void) {
+    FileInfo f;
+    start();
+    run_writer();
+
+    // the stream is already running when recording starts
+    feed_headers();
+    feed_audio(3, true);
+    drain();
+
+    recorder_set_active(&s_rec, true);
+    feed_audio(2, true);
+
+    // a reconnect cuts a page in half
+    size_t n = make_page(0, s_granule += 960, AUDIO_PAGE, 'a');
+    recorder_feed(&s_rec, s_page, n / 2);
+    recorder_mark_boundary(&s_rec);
+    feed_audio(2, true);
+    drain();
+    finish();
+
+    if (check_file(&f)) {
+        EXPECT(f.headers == 2, "file starts with %d header pages", f.headers);
+        EXPECT(f.pages == 6, "%d pages, want 2 headers + 4 audio", f.pages);
+        EXPECT(f.bad == 0 && f.cut == 0, "%u bad, %u cut pages in the file",
+               (unsigned) f.bad, (unsigned) f.cut);
+        EXPECT(f.gaps == 1, "%u sequence gaps, want only the cut page",
+               (unsigned) f.gaps);
+    }
+    recorder_free(&s_rec);
+}
+
+static void test_overflow(void) {
+    FileInfo f;
+    start();
+
+    // the writer is stuck (card busy) while the stream keeps coming
+    recorder_set_active(&s_rec, true);
+    feed_headers();
+    int pages = 2 * RECORD_RING_SIZE / AUDIO_PAGE;
+    feed_audio(pages, false);
+
+    RecorderStats st;
+    recorder_get_stats(&s_rec, &st);
+    EXPECT(st.drops > 0, "ring never overflowed");
+
+    run_writer();
+    drain();
+    finish();
+
+    if (check_file(&f)) {
+        EXPECT(f.headers == 2, "file starts with %d header pages", f.headers);
+        EXPECT(f.bad == 0 && f.cut == 0, "%u bad, %u cut pages in the file",
+               (unsigned) f.bad, (unsigned) f.cut);
+        EXPECT(f.pages - 2 + (int) st.drops == pages,
+               "%d audio pages written, %lu dropped, %d fed", f.pages - 2,
+               (unsigned long) st.drops, pages);
+        EXPECT(f.gaps == 0, "%u gaps, drops only lose the tail",
+               (unsigned) f.gaps);
+    }
+    recorder_free(&s_rec);
+}
+
+static void test_throughput(size_t megabytes) {
+    FileInfo f;
+    start();
+    run_writer();
+    recorder_set_active(&s_rec, true);
+
+    u64 begin    = svcGetSystemTick();
+    size_t bytes = feed_headers();
+    int pages    = (int) (megabytes * 1024 * 1024 / (AUDIO_PAGE + 29));
+    bytes += feed_audio(pages, true);
+    drain();
+    finish();
+    double sec = (double) (svcGetSystemTick() - begin) / SYSCLOCK_ARM11;
+
+    RecorderStats st;
+    recorder_get_stats(&s_rec, &st);
+    if (check_file(&f)) {
+        EXPECT(f.bytes == bytes && st.bytesWritten == bytes,
+               "%zu bytes in the file, %llu counted, %zu fed", f.bytes,
+               (unsigned long long) st.bytesWritten, bytes);
+        EXPECT(st.drops == 0 && f.bad == 0 && f.gaps == 0,
+               "%lu drops, %u bad pages, %u gaps", (unsigned long) st.drops,
+               (unsigned) f.bad, (unsigned) f.gaps);
+    }
+    printf("throughput: %zu KB in %.2f s end to end, fwrite %.0f MB/s\n",
+           bytes / 1024, sec,
+           st.writeTicks ? (double) st.bytesWritten * SYSCLOCK_ARM11 /
+                               st.writeTicks / (1024 * 1024)
+                         : 0.0);
+    recorder_free(&s_rec);
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = argc > 1 ? (size_t) atoi(argv[1]) : 64;
+
+    // the recorder writes to sdmc:/tripletail relative to here
+    char dir[] = "/tmp/recorder_test.XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0 || mkdir("sdmc:", 0777) != 0) {
+        printf("cannot set up %s\n", dir);
+        return 1;
+    }
+
+    test_cut_page();
+    test_overflow();
+    test_throughput(megabytes);
+
+    rmdir("sdmc:/tripletail");
+    rmdir("sdmc:");
+    if (chdir("/") == 0)
+        rmdir(dir);
+
+    printf("recorder_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
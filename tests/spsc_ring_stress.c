@@ -0,0 +1,161 @@
+// host stress test for the spsc ring. one producer and one consumer thread
+// move a position-derived byte stream through a small ring in random chunk
+// sizes, mixing the copy and the reserve/commit apis and committing less
+// than was reserved. the consumer checks every byte and both sides keep a
+// checksum that has to match at the end.
+//
+//   make -C tests check
+//   make -C tests check SANITIZE=thread
+
+#include "spsc_ring.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_SIZE 4096
+#define MAX_CHUNK (RING_SIZE + RING_SIZE / 2) // asks for more than fits too
+
+static SpscRing s_ring;
+static uint64_t s_total = 64ull * 1024 * 1024;
+
+typedef struct {
+    uint32_t seed;
+    uint64_t checksum;
+    uint64_t bytes;
+    uint64_t errors;
+} Side;
+
+static uint32_t next_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// byte at stream position pos, dropped or repeated bytes shift the pattern
+static uint8_t pattern(uint64_t pos) {
+    uint64_t x = pos * 0x9e3779b97f4a7c15ull;
+    return (uint8_t) (x >> 56);
+}
+
+static uint64_t fnv_add(uint64_t hash, uint8_t byte) {
+    return (hash ^ byte) * 0x100000001b3ull;
+}
+
+static void *producer(void *arg) {
+    Side *side = (Side *) arg;
+    uint8_t chunk[MAX_CHUNK];
+
+    while (side->bytes < s_total) {
+        size_t want = 1 + next_rand(&side->seed) % MAX_CHUNK;
+        if (want > s_total - side->bytes)
+            want = s_total - side->bytes;
+
+        size_t n;
+        if (next_rand(&side->seed) & 1) {
+            for (size_t i = 0; i < want; i++)
+                chunk[i] = pattern(side->bytes + i);
+            n = spsc_ring_write(&s_ring, chunk, want);
+        } else {
+            SpscSpan span;
+            size_t got = spsc_ring_write_reserve(&s_ring, want, &span);
+
+            // commit only part of the reservation now and then
+            n = got;
+            if (got > 1 && (next_rand(&side->seed) & 3) == 0)
+                n = 1 + next_rand(&side->seed) % got;
+
+            for (size_t i = 0; i < n; i++) {
+                uint8_t *p = i < span.len[0] ? span.ptr[0] + i
+                                             : span.ptr[1] + i - span.len[0];
+                *p         = pattern(side->bytes + i);
+            }
+            spsc_ring_write_commit(&s_ring, n);
+        }
+
+        for (size_t i = 0; i < n; i++)
+            side->checksum = fnv_add(side->checksum, pattern(side->bytes + i));
+        side->bytes += n;
+        if (n == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void check(Side *side, uint8_t byte) {
+    if (byte != pattern(side->bytes) && side->errors++ < 10)
+        fprintf(stderr, "mismatch at %llu: got %02x, want %02x\n",
+                (unsigned long long) side->bytes, byte,
+                pattern(side->bytes));
+    side->checksum = fnv_add(side->checksum, byte);
+    side->bytes++;
+}
+
+static void *consumer(void *arg) {
+    Side *side = (Side *) arg;
+    uint8_t chunk[MAX_CHUNK];
+
+    while (side->bytes < s_total) {
+        size_t want = 1 + next_rand(&side->seed) % MAX_CHUNK;
+
+        size_t n;
+        if (next_rand(&side->seed) & 1) {
+            n = spsc_ring_read(&s_ring, chunk, want);
+            for (size_t i = 0; i < n; i++)
+                check(side, chunk[i]);
+        } else {
+            SpscSpan span;
+            size_t got = spsc_ring_read_reserve(&s_ring, want, &span);
+
+            n = got;
+            if (got > 1 && (next_rand(&side->seed) & 3) == 0)
+                n = 1 + next_rand(&side->seed) % got;
+
+            for (size_t i = 0; i < n; i++)
+                check(side, i < span.len[0] ? span.ptr[0][i]
+                                            : span.ptr[1][i - span.len[0]]);
+            spsc_ring_read_commit(&s_ring, n);
+        }
+
+        if (n == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    uint32_t seed = 0x2545f491;
+    if (argc > 1)
+        s_total = strtoull(argv[1], NULL, 0);
+    if (argc > 2)
+        seed = (uint32_t) strtoul(argv[2], NULL, 0);
+
+    if (!spsc_ring_init(&s_ring, RING_SIZE)) {
+        fprintf(stderr, "ring init failed\n");
+        return 1;
+    }
+
+    Side prod = {.seed = seed};
+    Side cons = {.seed = seed * 2 + 1};
+    pthread_t tp, tc;
+    pthread_create(&tp, NULL, producer, &prod);
+    pthread_create(&tc, NULL, consumer, &cons);
+    pthread_join(tp, NULL);
+    pthread_join(tc, NULL);
+
+    bool ok = cons.errors == 0 && prod.checksum == cons.checksum &&
+              spsc_ring_available(&s_ring) == 0;
+    printf("spsc_ring_stress: %llu bytes, %llu wraps, checksum %016llx/%016llx"
+           ", %llu errors: %s\n",
+           (unsigned long long) cons.bytes,
+           (unsigned long long) (cons.bytes / RING_SIZE),
+           (unsigned long long) prod.checksum,
+           (unsigned long long) cons.checksum,
+           (unsigned long long) cons.errors, ok ? "ok" : "FAILED");
+
+    spsc_ring_free(&s_ring);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,421 @@
+// host test for reconnects in stream.c against stand-in servers on
+// loopback. each plays a live stream the way icecast does: a connection
+// gets the chain headers and a burst of recent pages, then every page as it
+// is produced. three scenarios, each with its measurement:
+//
+//   drop      the server closes every connection after a second. recovery
+//             is the time from the drop to the first byte of the next one.
+//   failover  the first mirror only sends half of real time, the download
+//             thread has to move on to the second. measures how long that
+//             takes.
+//   handover  the server stops sending, then drops the connection. a
+//             standby has to take over without losing or repeating a page.
+//             the gap is the time from the drop to the standby's first byte.
+//
+// these are host numbers: the tls handshake that dominates a plain
+// reconnect takes milliseconds here and seconds on the 3ds. only the
+// stream layer is covered, the decoder's resync and crossfade are not.
+
+#include "common.h"
+#include "ogg.h"
+#include "standby.h"
+#include "stream.h"
+#include "tls_server.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE_MS 20
+#define PAGE_FRAMES 960
+#define PAGE_BODY 250   // ~100 kbps
+#define BURST_PAGES 200 // on connect, icecast's default 64 KB is ~4s
+
+// the pcm ring in audio.c, 256 KB of 48 kHz stereo
+#define PCM_RING_MS (256 * 1024 * 1000 / (48000 * 4))
+
+volatile bool s_quit = false;
+
+static int s_failures = 0;
+
+#define EXPECT(cond, ...)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            s_failures++;                                                      \
+        }                                                                      \
+    } while (0)
+
+// one stand-in server and the live stream it plays
+typedef struct {
+    TlsServer *srv;
+    uint32_t serial;
+    u64 startMs; // page k is produced at startMs + (k + 1) * PAGE_MS
+    int pct;     // send rate in percent of real time, 0 unlimited
+    int dropMs;  // close every connection after this long, 0 never
+    int stallMs; // the first connection stops sending after this long
+    int killMs;  // and is closed this long after that
+    char url[64];
+
+    pthread_mutex_t lock;
+    int conns;
+} Live;
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t) (v >> (8 * i));
+}
+
+static size_t make_page(uint8_t *out, uint32_t serial, uint32_t seq,
+                        int64_t granule, uint8_t flags, const uint8_t *body,
+                        size_t len) {
+    memset(out, 0, OGG_HEADER_SIZE);
+    memcpy(out, "OggS", 4);
+    out[5] = flags;
+    put_le32(out + 6, (uint32_t) granule);
+    put_le32(out + 10, (uint32_t) ((uint64_t) granule >> 32));
+    put_le32(out + 14, serial);
+    put_le32(out + 18, seq);
+    out[26] = 1;
+    out[27] = (uint8_t) len;
+    memcpy(out + 28, body, len);
+    put_le32(out + 22, ogg_crc(0, out, 28 + len));
+    return 28 + len;
+}
+
+static bool send_headers(mbedtls_ssl_context *ssl, uint32_t serial) {
+    static const uint8_t head[19] = {'O', 'p', 'u', 's', 'H', 'e', 'a',
+                                     'd', 1,   2,   0x38, 1,  0x80, 0xbb};
+    static const uint8_t tags[20] = {'O', 'p', 'u', 's', 'T', 'a', 'g',
+                                     's', 4,   0,   0,   0,   't', 'e',
+                                     's', 't'};
+    uint8_t page[64];
+    size_t n = make_page(page, serial, 0, 0, OGG_FLAG_BOS, head, sizeof(head));
+    if (!tls_server_write(ssl, page, n))
+        return false;
+    n = make_page(page, serial, 1, 0, 0, tags, sizeof(tags));
+    return tls_server_write(ssl, page, n);
+}
+
+static bool send_audio(mbedtls_ssl_context *ssl, uint32_t serial,
+                       int64_t k) {
+    uint8_t body[PAGE_BODY], page[OGG_HEADER_SIZE + 1 + PAGE_BODY];
+    memset(body, (int) (k & 0xff), sizeof(body));
+    size_t n = make_page(page, serial, (uint32_t) (k + 2),
+                         (k + 1) * PAGE_FRAMES, 0, body, sizeof(body));
+    return tls_server_write(ssl, page, n);
+}
+
+static void serve(void *user, mbedtls_ssl_context *ssl) {
+    Live *lv = (Live *) user;
+
+    char line[256];
+    if (!tls_server_read_request(ssl, line, sizeof(line)))
+        return;
+    pthread_mutex_lock(&lv->lock);
+    int conn = lv->conns++;
+    pthread_mutex_unlock(&lv->lock);
+
+    static const char resp[] = "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/ogg\r\n\r\n";
+    if (!tls_server_write(ssl, resp, sizeof(resp) - 1) ||
+        !send_headers(ssl, lv->serial))
+        return;
+
+    u64 connMs = osGetTime();
+    int64_t k  = (int64_t) (connMs - lv->startMs) / PAGE_MS - BURST_PAGES;
+    if (k < 0)
+        k = 0;
+
+    for (int64_t sent = 0;; sent++) {
+        u64 now = osGetTime();
+        if (lv->dropMs && now - connMs >= (u64) lv->dropMs)
+            return;
+        if (conn == 0 && lv->stallMs && now - connMs >= (u64) lv->stallMs) {
+            usleep(lv->killMs * 1000);
+            return;
+        }
+
+        // page k is out once produced, and once the rate limit allows
+        u64 due = lv->startMs + (u64) (k + 1) * PAGE_MS;
+        if (lv->pct) {
+            u64 paced = connMs + (u64) sent * PAGE_MS * 100 / lv->pct;
+            if (paced > due)
+                due = paced;
+        }
+        if (due > now)
+            usleep((due - now) * 1000);
+
+        if (!send_audio(ssl, lv->serial, k++))
+            return;
+    }
+}
+
+static bool live_start(Live *lv, uint32_t serial, int pct) {
+    memset(lv, 0, sizeof(Live));
+    pthread_mutex_init(&lv->lock, NULL);
+    lv->serial = serial;
+    lv->pct    = pct;
+
+    // some audio was produced before anyone listened
+    lv->startMs = osGetTime() - 5000;
+    lv->srv     = tls_server_start(TLS_RESUME_CACHE, serve, lv);
+    if (!lv->srv)
+        return false;
+    snprintf(lv->url, sizeof(lv->url), "https://127.0.0.1:%d/live.ogg",
+             tls_server_port(lv->srv));
+    return true;
+}
+
+static void live_stop(Live *lv) {
+    tls_server_stop(lv->srv);
+    pthread_mutex_destroy(&lv->lock);
+}
+
+// what the reader saw
+typedef struct {
+    uint32_t serial;
+    int64_t granule; // last audio page, -1 before the first
+    u64 lastMs;      // when it came in
+    bool boundary;   // a boundary came after it
+    int boundaries;
+    int repeated; // audio pages across boundaries
+    int lost;
+    u64 maxGapMs; // between audio pages across a boundary
+    int skips;    // within a connection, should never happen
+    uint32_t firstSerial;
+    u64 switchMs; // first page of another serial, 0 if none
+} Track;
+
+typedef struct {
+    StreamQueue q;
+    SecureCtx net;
+    SecureCtx spare;
+    Standby standby;
+    Thread thread;
+    OggReader reader;
+    Track track;
+    u64 startMs;
+} Client;
+
+static bool client_start(Client *c, Live *const *lives, int count,
+                         bool standby) {
+    memset(c, 0, sizeof(Client));
+    c->net.fd.fd   = -1;
+    c->spare.fd.fd = -1;
+    if (!stream_queue_init(&c->q, STREAM_BUF_SIZE))
+        return false;
+    c->q.net = &c->net;
+    for (int i = 0; i < count; i++)
+        stream_queue_add_url(&c->q, lives[i]->url);
+    if (standby && standby_init(&c->standby, &c->spare))
+        c->q.standby = &c->standby;
+
+    // like the decoder, starved reads come back to be tried again
+    stream_queue_set_stall_timeout(&c->q, STREAM_STALL_TIMEOUT_MS);
+    ogg_reader_init(&c->reader, stream_queue_read, &c->q);
+    c->track.granule = -1;
+    c->startMs       = osGetTime();
+
+    c->thread = threadCreate(stream_download_thread, &c->q, STREAM_STACK_SIZE,
+                             THREAD_PRIO_STREAM, -1, false);
+    return c->thread != NULL;
+}
+
+static void track_page(Client *c, const OggPage *pg) {
+    Track *t = &c->track;
+    u64 now  = osGetTime();
+    if (pg->granule == 0)
+        return; // headers
+
+    if (t->granule < 0) {
+        t->firstSerial = pg->serial;
+    } else if (pg->serial != t->serial) {
+        if (!t->switchMs && pg->serial != t->firstSerial)
+            t->switchMs = now - c->startMs;
+    } else if (t->boundary) {
+        int64_t step = (pg->granule - t->granule) / PAGE_FRAMES;
+        if (step <= 0)
+            t->repeated += (int) (1 - step);
+        else
+            t->lost += (int) (step - 1);
+        if (now - t->lastMs > t->maxGapMs)
+            t->maxGapMs = now - t->lastMs;
+    } else if (pg->granule != t->granule + PAGE_FRAMES) {
+        t->skips++;
+    }
+
+    t->serial   = pg->serial;
+    t->granule  = pg->granule;
+    t->lastMs   = now;
+    t->boundary = false;
+}
+
+// read pages until done says so or ms ran out, false on timeout
+static bool client_run(Client *c, int ms, bool (*done)(Client *)) {
+    u64 end = osGetTime() + ms;
+    while (osGetTime() < end) {
+        if (done(c))
+            return true;
+
+        OggPage pg;
+        int ret = ogg_reader_next_page(&c->reader, &pg);
+        if (ret == 1) {
+            track_page(c, &pg);
+        } else if (ret == OGG_READ_BOUNDARY) {
+            c->track.boundary = true;
+            c->track.boundaries++;
+        } else if (ret != OGG_READ_STALLED) {
+            return false;
+        }
+    }
+    return done(c);
+}
+
+static void client_stop(Client *c) {
+    c->q.quit = true;
+    LightEvent_Signal(&c->q.canRead);
+    LightEvent_Signal(&c->q.canWrite);
+    threadJoin(c->thread, UINT64_MAX);
+    threadFree(c->thread);
+
+    if (c->q.standby)
+        standby_free(&c->standby);
+    cleanup_ssl(&c->net);
+    cleanup_ssl(&c->spare);
+    ogg_reader_free(&c->reader);
+    stream_queue_free(&c->q);
+}
+
+static Client s_client;
+
+static bool three_reconnects(Client *c) {
+    return c->track.boundaries >= 3 && !c->track.boundary;
+}
+
+static void test_drop(void) {
+    Live lv;
+    bool up = live_start(&lv, 0x1234, 0);
+    EXPECT(up, "drop: server did not start");
+    if (!up)
+        return;
+    lv.dropMs = 1000;
+
+    Live *lives[] = {&lv};
+    Client *c     = &s_client;
+    EXPECT(client_start(c, lives, 1, false), "drop: client did not start");
+    bool ok = client_run(c, 15000, three_reconnects);
+
+    StreamStats st;
+    stream_queue_get_stats(&c->q, &st);
+    client_stop(c);
+    live_stop(&lv);
+
+    Track *t = &c->track;
+    EXPECT(ok, "drop: %d reconnects seen", t->boundaries);
+    EXPECT(t->lost == 0 && t->skips == 0, "drop: %d pages lost, %d skipped",
+           t->lost, t->skips);
+    EXPECT(st.maxReconnectMs < PCM_RING_MS,
+           "drop: recovery took %lu ms, the pcm ring holds %d ms",
+           (unsigned long) st.maxReconnectMs, PCM_RING_MS);
+    printf("stream: drop, %lu reconnects, recovery last %lu ms, max %lu ms, "
+           "longest gap %llu ms, %d pages repeated\n",
+           (unsigned long) st.reconnects, (unsigned long) st.lastReconnectMs,
+           (unsigned long) st.maxReconnectMs,
+           (unsigned long long) t->maxGapMs, t->repeated);
+}
+
+static bool switched(Client *c) {
+    return c->track.switchMs != 0;
+}
+
+static void test_failover(void) {
+    Live slow, fast;
+    bool up = live_start(&slow, 0x1111, 50) && live_start(&fast, 0x2222, 0);
+    EXPECT(up, "failover: servers did not start");
+    if (!up)
+        return;
+
+    Live *lives[] = {&slow, &fast};
+    Client *c     = &s_client;
+    EXPECT(client_start(c, lives, 2, false),
+           "failover: client did not start");
+    bool ok = client_run(c, 60000, switched);
+
+    StreamStats st;
+    stream_queue_get_stats(&c->q, &st);
+    int endpoint = c->q.urlIndex;
+    client_stop(c);
+    live_stop(&slow);
+    live_stop(&fast);
+
+    EXPECT(ok && endpoint == 1 && c->track.serial == fast.serial,
+           "failover: still on endpoint %d", endpoint + 1);
+    EXPECT(c->track.skips == 0, "failover: %d pages skipped",
+           c->track.skips);
+    printf("stream: failover, on the second mirror after %llu ms at %lu%% of "
+           "real time, %lu switches\n",
+           (unsigned long long) c->track.switchMs,
+           (unsigned long) st.realtimePct, (unsigned long) st.switches);
+}
+
+static bool one_takeover(Client *c) {
+    return c->track.boundaries >= 1 && !c->track.boundary;
+}
+
+static void test_handover(void) {
+    Live lv;
+    bool up = live_start(&lv, 0x3333, 0);
+    EXPECT(up, "handover: server did not start");
+    if (!up)
+        return;
+    lv.stallMs = 2000;
+    lv.killMs  = 2500; // after the standby is up, before a stall takeover
+
+    Live *lives[] = {&lv};
+    Client *c     = &s_client;
+    EXPECT(client_start(c, lives, 1, true), "handover: client did not start");
+    bool ok = client_run(c, 15000, one_takeover);
+
+    StreamStats st;
+    stream_queue_get_stats(&c->q, &st);
+    uint32_t takeovers = c->standby.takeovers;
+    client_stop(c);
+    live_stop(&lv);
+
+    Track *t = &c->track;
+    EXPECT(ok && takeovers == 1, "handover: %lu takeovers",
+           (unsigned long) takeovers);
+    EXPECT(t->lost == 0 && t->repeated == 0 && t->skips == 0,
+           "handover: %d pages lost, %d repeated, %d skipped", t->lost,
+           t->repeated, t->skips);
+    EXPECT(st.lastReconnectMs < PCM_RING_MS / 4,
+           "handover: gap %lu ms, the pcm ring holds %d ms",
+           (unsigned long) st.lastReconnectMs, PCM_RING_MS);
+    printf("stream: handover, gap %lu ms (pcm ring %d ms), %lu takeovers, "
+           "%d pages lost, %d repeated\n",
+           (unsigned long) st.lastReconnectMs, PCM_RING_MS,
+           (unsigned long) takeovers, t->lost, t->repeated);
+}
+
+int main(int argc, char **argv) {
+    if (net_init() != 0) {
+        printf("stream_test: net_init failed\n");
+        return 1;
+    }
+    net_configure_tls();
+
+    // one scenario by name, or all of them
+    const char *only = argc > 1 ? argv[1] : NULL;
+    if (!only || strcmp(only, "drop") == 0)
+        test_drop();
+    if (!only || strcmp(only, "handover") == 0)
+        test_handover();
+    if (!only || strcmp(only, "failover") == 0)
+        test_failover();
+
+    net_exit();
+    printf("stream_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
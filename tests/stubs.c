@@ -0,0 +1,53 @@
+// settings and logging for host builds of the portable modules. settings
+// keep their compiled-in defaults unless a test changes them through
+// stub_setting(), log_debug prints to stdout.
+
+#include "stubs.h"
+#include "settings.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_SETTINGS 64
+
+static struct {
+    const char *key;
+    void *value;
+} s_settings[MAX_SETTINGS];
+static int s_count = 0;
+
+static void add(const char *key, void *value) {
+    if (s_count < MAX_SETTINGS) {
+        s_settings[s_count].key     = key;
+        s_settings[s_count++].value = value;
+    }
+}
+
+void *stub_setting(const char *key) {
+    for (int i = 0; i < s_count; i++)
+        if (strcmp(s_settings[i].key, key) == 0)
+            return s_settings[i].value;
+    return NULL;
+}
+
+void settings_register_string(const char *key, char *buffer,
+                              size_t buffer_size) {
+    (void) buffer_size;
+    add(key, buffer);
+}
+
+void settings_register_int(const char *key, int *value) {
+    add(key, value);
+}
+
+void settings_register_bool(const char *key, bool *value) {
+    add(key, value);
+}
+
+void log_debug(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    putchar('\n');
+}
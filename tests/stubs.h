@@ -0,0 +1,8 @@
+#ifndef STUBS_H
+#define STUBS_H
+
+// the variable registered under key, NULL if the module did not register
+// it. set it before the module's init like settings_load() would.
+void *stub_setting(const char *key);
+
+#endif
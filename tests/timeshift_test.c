@@ -0,0 +1,433 @@
+// host test for the time-shift store in timeshift.c, fed through a stream
+// queue like the download thread would. the ingest thread runs as in the
+// player, the test reads at the cursor the way the decoder does:
+//
+//   evict     the page being read is evicted halfway through, the next
+//             read has to be a boundary and no byte of it may follow
+//   head      the same for the OpusHead being replayed after a seek, when
+//             newer chains take its slot
+//   lapped    a reader far slower than ingest gets lapped over and over,
+//             every page it sees must be whole, the crc never fails
+//   lookup    seeks by time against a scan of every stored page, with
+//             pages longer than a second, an evicted window and buckets
+//             that wrapped around
+
+#include "common.h"
+#include "ogg.h"
+#include "stream.h"
+#include "timeshift.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_PAGES 4096
+#define BIG_BODY (16 * 255) // page of 4123 bytes, the minimum store holds 63
+#define SMALL_BODY 255
+#define LAPPED_PAGES 3000
+
+volatile bool s_quit = false;
+
+static int s_failures = 0;
+
+#define EXPECT(cond, ...)                                                      \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__);                        \
+            printf(__VA_ARGS__);                                               \
+            printf("\n");                                                      \
+            s_failures++;                                                      \
+        }                                                                      \
+    } while (0)
+
+// a store and the stream fed into it. pages are numbered in the order they
+// were fed, which is also their sequence number and the byte filling their
+// body.
+typedef struct {
+    StreamQueue q;
+    TimeShift ts;
+    Thread ingest;
+
+    uint32_t pages;
+    uint32_t serial;
+    uint64_t granule;     // of the current chain
+    uint64_t liveSamples; // stream time as the store counts it
+    uint64_t timeMs[MAX_PAGES];
+} Store;
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        p[i] = (uint8_t) (v >> (8 * i));
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+static bool store_open(Store *s, size_t budget) {
+    memset(s, 0, sizeof(Store));
+    if (!stream_queue_init(&s->q, 1024 * 1024))
+        return false;
+    if (!timeshift_init(&s->ts, &s->q, budget)) {
+        stream_queue_free(&s->q);
+        return false;
+    }
+    timeshift_set_stall_timeout(&s->ts, 20);
+    s->ingest = threadCreate(timeshift_ingest_thread, &s->ts, 0, 0, 0, false);
+    return s->ingest != NULL;
+}
+
+static void store_close(Store *s) {
+    s->q.quit = true;
+    LightEvent_Signal(&s->q.canRead);
+    LightEvent_Signal(&s->q.canWrite);
+    timeshift_signal_exit(&s->ts);
+    threadJoin(s->ingest, UINT64_MAX);
+    threadFree(s->ingest);
+    timeshift_free(&s->ts);
+    stream_queue_free(&s->q);
+}
+
+// a bos page starts a chain with a new serial and carries its OpusHead,
+// any other page lasts ms of stream time
+static void store_add(Store *s, bool bos, uint32_t ms, int body) {
+    uint8_t page[OGG_HEADER_SIZE + 255 + 255 * 255];
+    int nsegs = (body + 254) / 255;
+
+    if (bos) {
+        s->serial++;
+        s->granule = 0;
+        body       = 19;
+        nsegs      = 1;
+    } else {
+        s->granule += (uint64_t) ms * 48;
+    }
+
+    memset(page, 0, OGG_HEADER_SIZE);
+    memcpy(page, "OggS", 4);
+    page[5] = bos ? OGG_FLAG_BOS : 0;
+    put_le32(page + 6, (uint32_t) s->granule);
+    put_le32(page + 10, (uint32_t) (s->granule >> 32));
+    put_le32(page + 14, s->serial);
+    put_le32(page + 18, s->pages);
+    page[26] = (uint8_t) nsegs;
+    for (int i = 0; i < nsegs; i++)
+        page[OGG_HEADER_SIZE + i] = i < nsegs - 1 ? 255 : body - i * 255;
+
+    uint8_t *data = page + OGG_HEADER_SIZE + nsegs;
+    memset(data, s->pages & 0xff, body);
+    if (bos)
+        memcpy(data, "OpusHead", 8);
+    int len = OGG_HEADER_SIZE + nsegs + body;
+    put_le32(page + 22, ogg_crc(0, page, len));
+
+    s->timeMs[s->pages % MAX_PAGES] = s->liveSamples / 48;
+    if (!bos)
+        s->liveSamples += (uint64_t) ms * 48;
+    s->pages++;
+
+    const uint8_t *p = page;
+    while (len > 0) {
+        uint8_t *ptr;
+        int n = (int) stream_queue_reserve(&s->q, &ptr);
+        if (n > len)
+            n = len;
+        memcpy(ptr, p, n);
+        stream_queue_commit(&s->q, n);
+        p += n;
+        len -= n;
+    }
+}
+
+// wait for ingest to store everything fed so far, returns the oldest page
+static uint32_t store_sync(Store *s) {
+    for (;;) {
+        LightLock_Lock(&s->ts.lock);
+        uint32_t next  = s->ts.nextPage;
+        uint32_t first = s->ts.firstPage;
+        LightLock_Unlock(&s->ts.lock);
+        if (next == s->pages)
+            return first;
+        usleep(1000);
+    }
+}
+
+// exactly n bytes at the cursor, or the first negative read
+static int read_bytes(Store *s, uint8_t *buf, int n) {
+    int got = 0;
+    while (got < n) {
+        int rc = timeshift_read(&s->ts, buf + got, n - got);
+        if (rc == OGG_READ_STALLED)
+            continue;
+        if (rc <= 0)
+            return got ? got : rc;
+        got += rc;
+    }
+    return got;
+}
+
+// the page at the cursor, checked whole: its crc and, for a data page, a
+// body filled with its own number. returns the number, -1 for a bos page
+// or a negative read.
+static int read_page(Store *s, int *rc) {
+    uint8_t page[OGG_HEADER_SIZE + 255 + 255 * 255];
+    *rc = read_bytes(s, page, OGG_HEADER_SIZE);
+    if (*rc != OGG_HEADER_SIZE)
+        return -1;
+    int nsegs = page[26];
+    if ((*rc = read_bytes(s, page + OGG_HEADER_SIZE, nsegs)) != nsegs)
+        return -1;
+
+    int body = 0;
+    for (int i = 0; i < nsegs; i++)
+        body += page[OGG_HEADER_SIZE + i];
+    uint8_t *data = page + OGG_HEADER_SIZE + nsegs;
+    if ((*rc = read_bytes(s, data, body)) != body)
+        return -1;
+
+    int len         = OGG_HEADER_SIZE + nsegs + body;
+    uint32_t stored = get_le32(page + 22);
+    memset(page + 22, 0, 4);
+    EXPECT(ogg_crc(0, page, len) == stored, "page %u: bad crc",
+           get_le32(page + 18));
+
+    uint32_t seq = get_le32(page + 18);
+    if (page[5] & OGG_FLAG_BOS) {
+        EXPECT(memcmp(data, "OpusHead", 8) == 0, "page %u: bos without head",
+               seq);
+        return -1;
+    }
+    for (int i = 0; i < body; i++) {
+        if (data[i] != (seq & 0xff)) {
+            EXPECT(false, "page %u: byte %d is from page %d", seq, i, data[i]);
+            break;
+        }
+    }
+    return (int) seq;
+}
+
+static uint32_t evictions(Store *s) {
+    LightLock_Lock(&s->ts.lock);
+    uint32_t n = s->ts.evictions;
+    LightLock_Unlock(&s->ts.lock);
+    return n;
+}
+
+static void test_evict(void) {
+    Store s;
+    EXPECT(store_open(&s, 0), "evict: no store");
+
+    store_add(&s, true, 0, 0);
+    for (int i = 0; i < 20; i++)
+        store_add(&s, false, 20, BIG_BODY);
+    store_sync(&s);
+
+    // the head, then part of the first data page
+    int rc;
+    EXPECT(read_page(&s, &rc) == -1 && rc > 0, "evict: no head first");
+    uint8_t buf[BIG_BODY];
+    EXPECT(read_bytes(&s, buf, 100) == 100, "evict: short read");
+
+    // push it and the head out of the store
+    for (int i = 0; i < 80; i++)
+        store_add(&s, false, 20, BIG_BODY);
+    uint32_t first = store_sync(&s);
+    EXPECT(first > 1, "evict: page 1 still stored");
+
+    rc = timeshift_read(&s.ts, buf, sizeof(buf));
+    EXPECT(rc == OGG_READ_BOUNDARY, "evict: read %d after eviction", rc);
+
+    // the chain's head again, then the oldest page
+    int seq = read_page(&s, &rc);
+    EXPECT(seq == -1 && rc > 0, "evict: head not replayed, got page %d", seq);
+    seq = read_page(&s, &rc);
+    EXPECT(seq == (int) first, "evict: went on at page %d, oldest is %u", seq,
+           first);
+    EXPECT(evictions(&s) == 1, "evict: %u evictions", evictions(&s));
+
+    printf("timeshift: evict, page 1 cut off, on at page %d\n", seq);
+    store_close(&s);
+}
+
+static void test_head(void) {
+    Store s;
+    EXPECT(store_open(&s, 0), "head: no store");
+
+    store_add(&s, true, 0, 0);
+    for (int i = 0; i < 5; i++)
+        store_add(&s, false, 1000, SMALL_BODY);
+    store_sync(&s);
+
+    // 3 s into the chain, the head is replayed before page 4
+    timeshift_seek_behind(&s.ts, 2000);
+    uint8_t buf[64];
+    int rc = timeshift_read(&s.ts, buf, sizeof(buf));
+    EXPECT(rc == OGG_READ_BOUNDARY, "head: read %d after seek", rc);
+    EXPECT(read_bytes(&s, buf, 10) == 10 && memcmp(buf, "OggS", 4) == 0,
+           "head: no head replayed");
+
+    // enough new chains to reuse the head's slot
+    for (int i = 0; i < TIMESHIFT_MAX_CHAINS; i++) {
+        store_add(&s, true, 0, 0);
+        store_add(&s, false, 20, SMALL_BODY);
+    }
+    store_sync(&s);
+
+    rc = timeshift_read(&s.ts, buf, sizeof(buf));
+    EXPECT(rc == OGG_READ_BOUNDARY, "head: read %d after its slot went", rc);
+    int seq = read_page(&s, &rc);
+    EXPECT(seq == 4, "head: went on at page %d, not 4", seq);
+    EXPECT(evictions(&s) == 1, "head: %u evictions", evictions(&s));
+
+    printf("timeshift: head, replay cut off, on at page %d without it\n", seq);
+    store_close(&s);
+}
+
+static void feed_thread(void *arg) {
+    Store *s = (Store *) arg;
+    store_add(s, true, 0, 0);
+    for (int i = 1; i < LAPPED_PAGES; i++)
+        store_add(s, false, 20, BIG_BODY);
+}
+
+static void test_lapped(void) {
+    Store s;
+    EXPECT(store_open(&s, 0), "lapped: no store");
+
+    OggReader ogg;
+    EXPECT(ogg_reader_init(&ogg, timeshift_read, &s.ts), "lapped: no reader");
+    Thread feeder = threadCreate(feed_thread, &s, 0, 0, 0, false);
+
+    // the decoder's view, a page at a time, much slower than ingest
+    int pages = 0, boundaries = 0, last = -1;
+    while (last < LAPPED_PAGES - 1) {
+        OggPage pg;
+        int rc = ogg_reader_next_page(&ogg, &pg);
+        if (rc == OGG_READ_STALLED)
+            continue;
+        if (rc == OGG_READ_BOUNDARY) {
+            boundaries++;
+            last = -1;
+            continue;
+        }
+        if (rc <= 0) {
+            EXPECT(false, "lapped: read %d", rc);
+            break;
+        }
+        if (pg.flags & OGG_FLAG_BOS)
+            continue;
+
+        const uint8_t *body = pg.data + OGG_HEADER_SIZE + pg.data[26];
+        size_t bodyLen      = pg.len - OGG_HEADER_SIZE - pg.data[26];
+        EXPECT(last < 0 || pg.seq == (uint32_t) last + 1,
+               "lapped: page %u after %d without a boundary", pg.seq, last);
+        for (size_t i = 0; i < bodyLen; i++) {
+            if (body[i] != (pg.seq & 0xff)) {
+                EXPECT(false, "lapped: page %u has bytes of page %d", pg.seq,
+                       body[i]);
+                break;
+            }
+        }
+        last = (int) pg.seq;
+        pages++;
+        usleep(200);
+    }
+
+    threadJoin(feeder, UINT64_MAX);
+    threadFree(feeder);
+    EXPECT(ogg.badPages == 0, "lapped: %u bad pages", (unsigned) ogg.badPages);
+    EXPECT(boundaries > 0, "lapped: never lapped");
+    EXPECT((uint32_t) boundaries == evictions(&s),
+           "lapped: %d boundaries, %u evictions", boundaries, evictions(&s));
+
+    printf("timeshift: lapped, %d of %d pages read, %d boundaries, %u bad "
+           "pages\n",
+           pages, LAPPED_PAGES, boundaries, (unsigned) ogg.badPages);
+    ogg_reader_free(&ogg);
+    store_close(&s);
+}
+
+// where a seek to ms should land, by scanning every stored page: the first
+// page starting in that second or, when none did, in one of the few
+// before it
+static uint32_t scan(Store *s, uint32_t first, uint64_t ms) {
+    if (ms < s->timeMs[first % MAX_PAGES])
+        return first;
+    uint64_t sec = ms / 1000;
+    for (uint64_t back = 0; back < 8 && back <= sec; back++) {
+        for (uint32_t p = first; p < s->pages; p++) {
+            if (s->timeMs[p % MAX_PAGES] / 1000 == sec - back)
+                return p;
+        }
+    }
+    return s->pages;
+}
+
+// every 100 ms of the window and a little before it
+static void check_lookups(Store *s, const char *name) {
+    uint32_t first = store_sync(s);
+    uint64_t live  = s->liveSamples / 48;
+    int checked    = 0;
+
+    for (uint64_t behind = 0; behind <= live; behind += 100) {
+        uint64_t ms = live - behind;
+        if (ms + 5000 < s->timeMs[first % MAX_PAGES])
+            break;
+        uint32_t expect = scan(s, first, ms);
+        if (expect == 0)
+            expect = 1; // the bos page, read_page() goes past it
+
+        timeshift_seek_behind(&s->ts, (uint32_t) behind);
+        uint8_t buf[64];
+        int rc = timeshift_read(&s->ts, buf, sizeof(buf));
+        EXPECT(rc == OGG_READ_BOUNDARY, "%s: read %d after seek", name, rc);
+
+        int seq = -1;
+        if (expect < s->pages) {
+            while ((seq = read_page(s, &rc)) == -1 && rc > 0)
+                ;
+        }
+        EXPECT(expect == s->pages ? timeshift_behind_ms(&s->ts) == 0
+                                  : seq == (int) expect,
+               "%s: %llu ms landed on page %d, not %u", name,
+               (unsigned long long) ms, seq, expect);
+        checked++;
+    }
+    printf("timeshift: %s, %d seeks, pages %u to %u\n", name, checked, first,
+           s->pages - 1);
+}
+
+static void test_lookup(void) {
+    // 20 ms pages, three of 2.5 s that leave seconds without a page
+    // starting in them, then 20 ms pages again
+    Store s;
+    EXPECT(store_open(&s, 1024 * 1024), "lookup: no store");
+    store_add(&s, true, 0, 0);
+    for (int i = 0; i < 200; i++)
+        store_add(&s, false, 20, SMALL_BODY);
+    for (int i = 0; i < 3; i++)
+        store_add(&s, false, 2500, SMALL_BODY);
+    for (int i = 0; i < 100; i++)
+        store_add(&s, false, 20, SMALL_BODY);
+    check_lookups(&s, "lookup");
+    store_close(&s);
+
+    // 200 s of 1 s pages in the smallest store: the window is the last 63
+    // and the buckets, one per second of 130 s, have wrapped around
+    EXPECT(store_open(&s, 0), "lookup, wrapped: no store");
+    store_add(&s, true, 0, 0);
+    for (int i = 0; i < 200; i++)
+        store_add(&s, false, 1000, BIG_BODY);
+    check_lookups(&s, "lookup, wrapped");
+    store_close(&s);
+}
+
+int main(void) {
+    test_evict();
+    test_head();
+    test_lapped();
+    test_lookup();
+
+    printf("timeshift_test: %s\n", s_failures ? "FAILED" : "ok");
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+#include "tls_server.h"
+#include <arpa/inet.h>
+#include <mbedtls/certs.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
+#include <mbedtls/x509_crt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+typedef struct {
+    TlsServer *srv;
+    mbedtls_net_context fd;
+    pthread_t thread;
+    bool used; // thread started, not joined yet
+    bool done; // thread finished
+} Conn;
+
+struct TlsServer {
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt cert[2]; // rsa and ec, for either kind of suite
+    mbedtls_pk_context key[2];
+    mbedtls_ssl_cache_context cache;
+    mbedtls_ssl_ticket_context ticket;
+    pthread_mutex_t lock; // drbg, counters and conns
+
+    int listenFd;
+    int port;
+    pthread_t acceptThread;
+    bool stop;
+
+    TlsHandler handler;
+    void *user;
+
+    int handshakes;
+    int resumed;
+    Conn conns[TLS_SERVER_MAX_CONNS];
+};
+
+static int locked_random(void *p, unsigned char *out, size_t len) {
+    TlsServer *srv = (TlsServer *) p;
+    pthread_mutex_lock(&srv->lock);
+    int ret = mbedtls_ctr_drbg_random(&srv->drbg, out, len);
+    pthread_mutex_unlock(&srv->lock);
+    return ret;
+}
+
+static void *conn_thread(void *arg) {
+    Conn *c        = (Conn *) arg;
+    TlsServer *srv = c->srv;
+
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_init(&ssl);
+    if (mbedtls_ssl_setup(&ssl, &srv->conf) != 0)
+        goto done;
+    mbedtls_ssl_set_bio(&ssl, &c->fd, mbedtls_net_send, mbedtls_net_recv,
+                        NULL);
+
+    // a resumed handshake skips the certificate, same test as net.c
+    bool full = false;
+    while (ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER) {
+        if (ssl.state == MBEDTLS_SSL_SERVER_CERTIFICATE)
+            full = true;
+        if (mbedtls_ssl_handshake_step(&ssl) != 0)
+            goto done;
+    }
+
+    pthread_mutex_lock(&srv->lock);
+    srv->handshakes++;
+    srv->resumed += !full;
+    pthread_mutex_unlock(&srv->lock);
+
+    if (srv->handler) {
+        srv->handler(srv->user, &ssl);
+    } else {
+        // wait for the client to hang up
+        unsigned char buf[256];
+        while (mbedtls_ssl_read(&ssl, buf, sizeof(buf)) > 0)
+            ;
+    }
+    mbedtls_ssl_close_notify(&ssl);
+
+done:
+    mbedtls_ssl_free(&ssl);
+    pthread_mutex_lock(&srv->lock);
+    mbedtls_net_free(&c->fd);
+    c->done = true;
+    pthread_mutex_unlock(&srv->lock);
+    return NULL;
+}
+
+static void *accept_thread(void *arg) {
+    TlsServer *srv = (TlsServer *) arg;
+
+    while (!__atomic_load_n(&srv->stop, __ATOMIC_RELAXED)) {
+        int fd = accept(srv->listenFd, NULL, NULL);
+        if (fd < 0)
+            break;
+
+        // a slot that was never used or whose thread is finished
+        pthread_mutex_lock(&srv->lock);
+        Conn *c = NULL;
+        for (int i = 0; !c && i < TLS_SERVER_MAX_CONNS; i++) {
+            if (!srv->conns[i].used || srv->conns[i].done)
+                c = &srv->conns[i];
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        if (c) {
+            if (c->used)
+                pthread_join(c->thread, NULL);
+            pthread_mutex_lock(&srv->lock);
+            c->srv   = srv;
+            c->fd.fd = fd;
+            c->used  = true;
+            c->done  = false;
+            pthread_mutex_unlock(&srv->lock);
+
+            if (pthread_create(&c->thread, NULL, conn_thread, c) != 0) {
+                pthread_mutex_lock(&srv->lock);
+                c->used = false;
+                pthread_mutex_unlock(&srv->lock);
+                c = NULL;
+            }
+        }
+        if (!c)
+            close(fd);
+    }
+    return NULL;
+}
+
+static bool own_cert(TlsServer *srv, int i, const char *crt, size_t crtLen,
+                     const char *key, size_t keyLen) {
+    return mbedtls_x509_crt_parse(&srv->cert[i], (const unsigned char *) crt,
+                                  crtLen) == 0 &&
+           mbedtls_pk_parse_key(&srv->key[i], (const unsigned char *) key,
+                                keyLen, NULL, 0) == 0 &&
+           mbedtls_ssl_conf_own_cert(&srv->conf, &srv->cert[i],
+                                     &srv->key[i]) == 0;
+}
+
+static bool setup(TlsServer *srv, TlsResume resume) {
+    const char *pers = "tls_server";
+    if (mbedtls_ctr_drbg_seed(&srv->drbg, mbedtls_entropy_func,
+                              &srv->entropy, (const unsigned char *) pers,
+                              strlen(pers)) != 0 ||
+        mbedtls_ssl_config_defaults(&srv->conf, MBEDTLS_SSL_IS_SERVER,
+                                    MBEDTLS_SSL_TRANSPORT_STREAM,
+                                    MBEDTLS_SSL_PRESET_DEFAULT) != 0 ||
+        !own_cert(srv, 0, mbedtls_test_srv_crt_rsa,
+                  mbedtls_test_srv_crt_rsa_len, mbedtls_test_srv_key_rsa,
+                  mbedtls_test_srv_key_rsa_len) ||
+        !own_cert(srv, 1, mbedtls_test_srv_crt_ec, mbedtls_test_srv_crt_ec_len,
+                  mbedtls_test_srv_key_ec, mbedtls_test_srv_key_ec_len))
+        return false;
+
+    mbedtls_ssl_conf_rng(&srv->conf, locked_random, srv);
+    if (resume == TLS_RESUME_CACHE)
+        mbedtls_ssl_conf_session_cache(&srv->conf, &srv->cache,
+                                       mbedtls_ssl_cache_get,
+                                       mbedtls_ssl_cache_set);
+    if (resume == TLS_RESUME_TICKETS) {
+        if (mbedtls_ssl_ticket_setup(&srv->ticket, locked_random, srv,
+                                     MBEDTLS_CIPHER_AES_256_GCM, 3600) != 0)
+            return false;
+        mbedtls_ssl_conf_session_tickets_cb(&srv->conf,
+                                            mbedtls_ssl_ticket_write,
+                                            mbedtls_ssl_ticket_parse,
+                                            &srv->ticket);
+    }
+
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    srv->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (srv->listenFd < 0 ||
+        bind(srv->listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(srv->listenFd, TLS_SERVER_MAX_CONNS) != 0 ||
+        getsockname(srv->listenFd, (struct sockaddr *) &addr, &addrLen) != 0)
+        return false;
+    srv->port = ntohs(addr.sin_port);
+
+    return pthread_create(&srv->acceptThread, NULL, accept_thread, srv) == 0;
+}
+
+static void release(TlsServer *srv) {
+    if (srv->listenFd >= 0)
+        close(srv->listenFd);
+    mbedtls_ssl_ticket_free(&srv->ticket);
+    mbedtls_ssl_cache_free(&srv->cache);
+    mbedtls_ssl_config_free(&srv->conf);
+    for (int i = 0; i < 2; i++) {
+        mbedtls_pk_free(&srv->key[i]);
+        mbedtls_x509_crt_free(&srv->cert[i]);
+    }
+    mbedtls_ctr_drbg_free(&srv->drbg);
+    mbedtls_entropy_free(&srv->entropy);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv);
+}
+
+TlsServer *tls_server_start(TlsResume resume, TlsHandler handler,
+                            void *user) {
+    TlsServer *srv = calloc(1, sizeof(TlsServer));
+    if (!srv)
+        return NULL;
+
+    pthread_mutex_init(&srv->lock, NULL);
+    mbedtls_entropy_init(&srv->entropy);
+    mbedtls_ctr_drbg_init(&srv->drbg);
+    mbedtls_ssl_config_init(&srv->conf);
+    for (int i = 0; i < 2; i++) {
+        mbedtls_x509_crt_init(&srv->cert[i]);
+        mbedtls_pk_init(&srv->key[i]);
+    }
+    mbedtls_ssl_cache_init(&srv->cache);
+    mbedtls_ssl_ticket_init(&srv->ticket);
+    srv->listenFd = -1;
+    srv->handler  = handler;
+    srv->user     = user;
+
+    if (!setup(srv, resume)) {
+        release(srv);
+        return NULL;
+    }
+    return srv;
+}
+
+void tls_server_suites(TlsServer *srv, const int *suites) {
+    mbedtls_ssl_conf_ciphersuites(&srv->conf, suites);
+}
+
+void tls_server_stop(TlsServer *srv) {
+    __atomic_store_n(&srv->stop, true, __ATOMIC_RELAXED);
+    shutdown(srv->listenFd, SHUT_RDWR);
+    pthread_join(srv->acceptThread, NULL);
+
+    // unblock whatever the handlers are waiting for
+    for (int i = 0; i < TLS_SERVER_MAX_CONNS; i++) {
+        Conn *c = &srv->conns[i];
+        if (!c->used)
+            continue;
+        pthread_mutex_lock(&srv->lock);
+        if (!c->done)
+            shutdown(c->fd.fd, SHUT_RDWR);
+        pthread_mutex_unlock(&srv->lock);
+        pthread_join(c->thread, NULL);
+    }
+    release(srv);
+}
+
+int tls_server_port(const TlsServer *srv) {
+    return srv->port;
+}
+
+void tls_server_idle(TlsServer *srv) {
+    for (;;) {
+        bool busy = false;
+        pthread_mutex_lock(&srv->lock);
+        for (int i = 0; i < TLS_SERVER_MAX_CONNS; i++)
+            busy |= srv->conns[i].used && !srv->conns[i].done;
+        pthread_mutex_unlock(&srv->lock);
+        if (!busy)
+            return;
+        usleep(1000);
+    }
+}
+
+int tls_server_handshakes(const TlsServer *srv, int *resumed) {
+    TlsServer *s = (TlsServer *) srv;
+    pthread_mutex_lock(&s->lock);
+    int n = s->handshakes;
+    if (resumed)
+        *resumed = s->resumed;
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+bool tls_server_write(mbedtls_ssl_context *ssl, const void *data,
+                      size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    while (len > 0) {
+        int ret = mbedtls_ssl_write(ssl, p, len);
+        if (ret <= 0)
+            return false;
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+bool tls_server_read_request(mbedtls_ssl_context *ssl, char *line,
+                             size_t size) {
+    char buf[2048];
+    size_t len = 0;
+    while (len < sizeof(buf) - 1) {
+        int ret =
+            mbedtls_ssl_read(ssl, (unsigned char *) buf + len,
+                             sizeof(buf) - 1 - len);
+        if (ret <= 0)
+            return false;
+        len += ret;
+        buf[len] = 0;
+        if (strstr(buf, "\r\n\r\n"))
+            break;
+    }
+
+    size_t n = strcspn(buf, "\r\n");
+    if (n >= size)
+        n = size - 1;
+    memcpy(line, buf, n);
+    line[n] = 0;
+    return true;
+}
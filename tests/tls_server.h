@@ -0,0 +1,54 @@
+#ifndef TLS_SERVER_H
+#define TLS_SERVER_H
+
+// a tls server on loopback for the network tests. every connection gets a
+// thread that runs the handshake and then the handler. uses mbedtls'
+// rsa and ec test certificates, clients have to skip verification like
+// net.c does.
+
+#include <mbedtls/ssl.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TLS_SERVER_MAX_CONNS 16
+
+// how the server lets clients resume
+typedef enum {
+    TLS_RESUME_NONE,    // every handshake is a full one
+    TLS_RESUME_CACHE,   // by session id, no tickets
+    TLS_RESUME_TICKETS, // by session ticket only
+} TlsResume;
+
+typedef struct TlsServer TlsServer;
+
+// runs on the connection's thread once the handshake is done, the
+// connection is closed when it returns
+typedef void (*TlsHandler)(void *user, mbedtls_ssl_context *ssl);
+
+// NULL on failure, handler may be NULL to just close after the handshake
+TlsServer *tls_server_start(TlsResume resume, TlsHandler handler, void *user);
+
+// only accept the zero terminated suites from now on, call before clients
+// connect. the array has to stay around.
+void tls_server_suites(TlsServer *srv, const int *suites);
+
+// joins every connection thread
+void tls_server_stop(TlsServer *srv);
+
+int tls_server_port(const TlsServer *srv);
+
+// wait until every connection so far has ended
+void tls_server_idle(TlsServer *srv);
+
+// handshakes done so far, and how many of them resumed a session
+int tls_server_handshakes(const TlsServer *srv, int *resumed);
+
+// write all of data, false once the client is gone
+bool tls_server_write(mbedtls_ssl_context *ssl, const void *data, size_t len);
+
+// read up to the end of the request headers, false if the client closed
+// first. the request line goes to line.
+bool tls_server_read_request(mbedtls_ssl_context *ssl, char *line,
+                             size_t size);
+
+#endif
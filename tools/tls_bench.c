@@ -0,0 +1,380 @@
+// host benchmark for the tls cipher suite and curve preferences in
+// source/net.c. a client and an mbedtls test server run in one process over
+// an in-memory link, so only the crypto is measured. for every suite and
+// curve it times the client's share of a full and of a resumed handshake,
+// and per suite the client's decrypt rate on a continuous stream of full
+// records, which is what the download thread does all day. handshake times
+// are the best of HANDSHAKE_RUNS.
+//
+//   make -C tools tls_bench tls_bench_noaesni
+//   ./tools/tls_bench_noaesni [megabytes per suite, default 16]
+//
+// written against mbedtls 2.28 like the devkitpro port, with its test
+// certificates (MBEDTLS_CERTS_C). the ranking only carries over to the
+// arm11 from a cpu without aes instructions. tls_bench_noaesni overrides
+// mbedtls_aesni_has_support() so a shared x86 mbedtls takes its portable
+// aes and gcm code, like the 3ds does.
+
+#define _POSIX_C_SOURCE 199309L // clock_gettime
+
+#include <mbedtls/certs.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/ssl_cache.h>
+#include <mbedtls/x509_crt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RECORD_SIZE 16384 // the stream reads one full record at a time
+#define HANDSHAKE_RUNS 5
+
+#ifdef BENCH_NO_AESNI
+// takes the place of the library's own through the plt, shared builds only
+int mbedtls_aesni_has_support(unsigned int what) {
+    (void) what;
+    return 0;
+}
+#endif
+
+static const char *SUITES[] = {
+    "TLS-ECDHE-ECDSA-WITH-CHACHA20-POLY1305-SHA256",
+    "TLS-ECDHE-RSA-WITH-CHACHA20-POLY1305-SHA256",
+    "TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256",
+    "TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256",
+    "TLS-ECDHE-ECDSA-WITH-AES-256-GCM-SHA384",
+    "TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384",
+    "TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256",
+    "TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA",
+    "TLS-RSA-WITH-AES-128-GCM-SHA256",
+    "TLS-RSA-WITH-AES-128-CBC-SHA",
+};
+
+static const char *CURVES[] = {"x25519", "secp256r1", "secp384r1"};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+// one direction of the link, a growing byte buffer
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+} Pipe;
+
+typedef struct {
+    Pipe *in;
+    Pipe *out;
+} Link;
+
+static int link_send(void *ctx, const unsigned char *data, size_t len) {
+    Pipe *p = ((Link *) ctx)->out;
+    if (p->len + len > p->cap) {
+        size_t cap = p->cap ? p->cap : 65536;
+        while (cap < p->len + len)
+            cap *= 2;
+        unsigned char *buf = realloc(p->buf, cap);
+        if (!buf)
+            return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        p->buf = buf;
+        p->cap = cap;
+    }
+    memcpy(p->buf + p->len, data, len);
+    p->len += len;
+    return (int) len;
+}
+
+static int link_recv(void *ctx, unsigned char *data, size_t len) {
+    Pipe *p = ((Link *) ctx)->in;
+    if (p->pos == p->len) {
+        p->pos = p->len = 0;
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    if (len > p->len - p->pos)
+        len = p->len - p->pos;
+    memcpy(data, p->buf + p->pos, len);
+    p->pos += len;
+    return (int) len;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_ssl_config cli;
+    mbedtls_ssl_config srv;
+    mbedtls_x509_crt ecCrt;
+    mbedtls_x509_crt rsaCrt;
+    mbedtls_pk_context ecKey;
+    mbedtls_pk_context rsaKey;
+    mbedtls_ssl_cache_context cache;
+
+    // the configs point into these. the client also offers secp256r1, the
+    // curve of the ecdsa test certificate, the server only the one tested.
+    int suite[2];
+    mbedtls_ecp_group_id cliCurves[3];
+    mbedtls_ecp_group_id srvCurves[2];
+
+    // a client and server pair
+    mbedtls_ssl_context c;
+    mbedtls_ssl_context s;
+    Pipe toSrv;
+    Pipe toCli;
+    Link cliLink;
+    Link srvLink;
+} Bench;
+
+static int setup(Bench *b) {
+    const char *pers = "tls_bench";
+    int ret;
+
+    mbedtls_entropy_init(&b->entropy);
+    mbedtls_ctr_drbg_init(&b->drbg);
+    mbedtls_ssl_config_init(&b->cli);
+    mbedtls_ssl_config_init(&b->srv);
+    mbedtls_x509_crt_init(&b->ecCrt);
+    mbedtls_x509_crt_init(&b->rsaCrt);
+    mbedtls_pk_init(&b->ecKey);
+    mbedtls_pk_init(&b->rsaKey);
+    mbedtls_ssl_cache_init(&b->cache);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&b->drbg, mbedtls_entropy_func,
+                                     &b->entropy, (const unsigned char *) pers,
+                                     strlen(pers))) != 0 ||
+        (ret = mbedtls_x509_crt_parse(
+             &b->ecCrt, (const unsigned char *) mbedtls_test_srv_crt_ec,
+             mbedtls_test_srv_crt_ec_len)) != 0 ||
+        (ret = mbedtls_x509_crt_parse(
+             &b->rsaCrt, (const unsigned char *) mbedtls_test_srv_crt_rsa,
+             mbedtls_test_srv_crt_rsa_len)) != 0 ||
+        (ret = mbedtls_pk_parse_key(
+             &b->ecKey, (const unsigned char *) mbedtls_test_srv_key_ec,
+             mbedtls_test_srv_key_ec_len, NULL, 0)) != 0 ||
+        (ret = mbedtls_pk_parse_key(
+             &b->rsaKey, (const unsigned char *) mbedtls_test_srv_key_rsa,
+             mbedtls_test_srv_key_rsa_len, NULL, 0)) != 0)
+        return ret;
+
+    // the client is set up like connect_ssl
+    if ((ret = mbedtls_ssl_config_defaults(&b->cli, MBEDTLS_SSL_IS_CLIENT,
+                                           MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT)) != 0 ||
+        (ret = mbedtls_ssl_config_defaults(&b->srv, MBEDTLS_SSL_IS_SERVER,
+                                           MBEDTLS_SSL_TRANSPORT_STREAM,
+                                           MBEDTLS_SSL_PRESET_DEFAULT)) != 0 ||
+        (ret = mbedtls_ssl_conf_own_cert(&b->srv, &b->ecCrt, &b->ecKey)) !=
+            0 ||
+        (ret = mbedtls_ssl_conf_own_cert(&b->srv, &b->rsaCrt, &b->rsaKey)) !=
+            0)
+        return ret;
+
+    mbedtls_ssl_conf_authmode(&b->cli, MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_rng(&b->cli, mbedtls_ctr_drbg_random, &b->drbg);
+    mbedtls_ssl_conf_rng(&b->srv, mbedtls_ctr_drbg_random, &b->drbg);
+    mbedtls_ssl_conf_session_cache(&b->srv, &b->cache, mbedtls_ssl_cache_get,
+                                   mbedtls_ssl_cache_set);
+    mbedtls_ssl_conf_ciphersuites(&b->cli, b->suite);
+    mbedtls_ssl_conf_ciphersuites(&b->srv, b->suite);
+    mbedtls_ssl_conf_curves(&b->cli, b->cliCurves);
+    mbedtls_ssl_conf_curves(&b->srv, b->srvCurves);
+    return 0;
+}
+
+static void close_pair(Bench *b) {
+    mbedtls_ssl_free(&b->c);
+    mbedtls_ssl_free(&b->s);
+    b->toSrv.len = b->toSrv.pos = 0;
+    b->toCli.len = b->toCli.pos = 0;
+}
+
+static int open_pair(Bench *b) {
+    int ret;
+    mbedtls_ssl_init(&b->c);
+    mbedtls_ssl_init(&b->s);
+    if ((ret = mbedtls_ssl_setup(&b->c, &b->cli)) != 0 ||
+        (ret = mbedtls_ssl_setup(&b->s, &b->srv)) != 0 ||
+        (ret = mbedtls_ssl_set_hostname(&b->c, "localhost")) != 0)
+        return ret;
+
+    b->cliLink.in  = &b->toCli;
+    b->cliLink.out = &b->toSrv;
+    b->srvLink.in  = &b->toSrv;
+    b->srvLink.out = &b->toCli;
+    mbedtls_ssl_set_bio(&b->c, &b->cliLink, link_send, link_recv, NULL);
+    mbedtls_ssl_set_bio(&b->s, &b->srvLink, link_send, link_recv, NULL);
+    return 0;
+}
+
+static int pending(int ret) {
+    return ret == MBEDTLS_ERR_SSL_WANT_READ ||
+           ret == MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+// step both sides until done, only the client's time is counted
+static int handshake(Bench *b, double *cliSec) {
+    int rc = 1, rs = 1;
+    *cliSec = 0;
+
+    for (int i = 0; i < 1000 && (rc != 0 || rs != 0); i++) {
+        if (rc != 0) {
+            double t = now();
+            rc       = mbedtls_ssl_handshake(&b->c);
+            *cliSec += now() - t;
+            if (rc != 0 && !pending(rc))
+                return rc;
+        }
+        if (rs != 0) {
+            rs = mbedtls_ssl_handshake(&b->s);
+            if (rs != 0 && !pending(rs))
+                return rs;
+        }
+    }
+    return rc != 0 || rs != 0 ? -1 : 0;
+}
+
+// the server encrypts bytes up front, then the client's reads are timed
+static int decrypt_rate(Bench *b, size_t bytes, double *mbps) {
+    static unsigned char data[RECORD_SIZE];
+    int ret;
+
+    for (size_t sent = 0; sent < bytes; sent += (size_t) ret) {
+        ret = mbedtls_ssl_write(&b->s, data, RECORD_SIZE);
+        if (ret <= 0)
+            return ret;
+    }
+
+    double t = now();
+    for (size_t got = 0; got < bytes; got += (size_t) ret) {
+        ret = mbedtls_ssl_read(&b->c, data, RECORD_SIZE);
+        if (ret <= 0)
+            return ret;
+    }
+    *mbps = bytes / (now() - t) / (1024.0 * 1024.0);
+    return 0;
+}
+
+// a full handshake, the bulk rate if asked, then a resumed handshake
+static int run(Bench *b, size_t bytes, double *fullMs, double *resumedMs,
+               double *mbps) {
+    mbedtls_ssl_session session;
+    unsigned char id[32];
+    size_t idLen;
+    double sec;
+    int ret;
+
+    mbedtls_ssl_session_init(&session);
+    if ((ret = open_pair(b)) != 0 || (ret = handshake(b, &sec)) != 0 ||
+        (ret = mbedtls_ssl_get_session(&b->c, &session)) != 0 ||
+        (mbps && (ret = decrypt_rate(b, bytes, mbps)) != 0)) {
+        close_pair(b);
+        mbedtls_ssl_session_free(&session);
+        return ret;
+    }
+    close_pair(b);
+    *fullMs = sec * 1000;
+
+    idLen = session.id_len;
+    memcpy(id, session.id, idLen);
+    if ((ret = open_pair(b)) != 0 ||
+        (ret = mbedtls_ssl_set_session(&b->c, &session)) != 0 ||
+        (ret = handshake(b, &sec)) != 0) {
+        close_pair(b);
+        mbedtls_ssl_session_free(&session);
+        return ret;
+    }
+
+    // the server echoes the id when it resumed
+    mbedtls_ssl_session_free(&session);
+    mbedtls_ssl_session_init(&session);
+    mbedtls_ssl_get_session(&b->c, &session);
+    bool resumed = session.id_len == idLen && idLen > 0 &&
+                   memcmp(session.id, id, idLen) == 0;
+    *resumedMs = resumed ? sec * 1000 : -1;
+
+    close_pair(b);
+    mbedtls_ssl_session_free(&session);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes = argc > 1 ? (size_t) atoi(argv[1]) : 16;
+    size_t bytes     = (megabytes ? megabytes : 1) * 1024 * 1024;
+    static Bench b;
+    int ret;
+
+    if ((ret = setup(&b)) != 0) {
+        fprintf(stderr, "setup failed: -0x%04x\n", -ret);
+        return 1;
+    }
+
+    printf("%-46s %-10s %8s %10s %13s\n", "suite", "curve", "full ms",
+           "resumed ms", "decrypt MB/s");
+
+    for (size_t i = 0; i < COUNT(SUITES); i++) {
+        b.suite[0] = mbedtls_ssl_get_ciphersuite_id(SUITES[i]);
+        b.suite[1] = 0;
+        if (!b.suite[0]) {
+            printf("%-46s not in this mbedtls build\n", SUITES[i]);
+            continue;
+        }
+
+        bool ecdhe = strstr(SUITES[i], "ECDHE") != NULL;
+        for (size_t j = 0; j < COUNT(CURVES); j++) {
+            const mbedtls_ecp_curve_info *info =
+                mbedtls_ecp_curve_info_from_name(CURVES[j]);
+            if (!info)
+                continue;
+            b.cliCurves[0] = info->grp_id;
+            b.cliCurves[1] = info->grp_id == MBEDTLS_ECP_DP_SECP256R1
+                                 ? MBEDTLS_ECP_DP_NONE
+                                 : MBEDTLS_ECP_DP_SECP256R1;
+            b.cliCurves[2] = MBEDTLS_ECP_DP_NONE;
+            b.srvCurves[0] = info->grp_id;
+            b.srvCurves[1] = MBEDTLS_ECP_DP_NONE;
+
+            // the record rate doesn't depend on the curve, static rsa
+            // key exchange doesn't use one
+            double fullMs = 0, resumedMs = 0, mbps = 0;
+            for (int k = 0; k < HANDSHAKE_RUNS; k++) {
+                double full, resumed;
+                ret = run(&b, bytes, &full, &resumed,
+                          j == 0 && k == 0 ? &mbps : NULL);
+                if (ret != 0)
+                    break;
+                if (k == 0 || full < fullMs)
+                    fullMs = full;
+                if (k == 0 || (resumed >= 0 && resumed < resumedMs))
+                    resumedMs = resumed;
+            }
+            if (ret != 0) {
+                printf("%-46s %-10s failed: -0x%04x\n", SUITES[i],
+                       ecdhe ? CURVES[j] : "-", -ret);
+            } else {
+                printf("%-46s %-10s %8.1f ", SUITES[i],
+                       ecdhe ? CURVES[j] : "-", fullMs);
+                if (resumedMs >= 0)
+                    printf("%10.1f ", resumedMs);
+                else
+                    printf("%10s ", "no");
+                if (j == 0)
+                    printf("%13.1f\n", mbps);
+                else
+                    printf("%13s\n", "-");
+            }
+            if (!ecdhe)
+                break;
+        }
+    }
+
+    return 0;
+}